@@ -0,0 +1,236 @@
+// synthetic client workloads for benchmarking the compositor under Xvfb
+// this opens a bunch of plain Xlib windows and then does something with them (through XTest for anything the user would do) for a given amount of time
+// compile with:
+// $ cc bench/clients.c -O2 -lX11 -lXtst -lm -o clients
+// usage:
+// $ clients <workload> [window count] [duration in seconds]
+// where workload is one of 'static', 'redraw', 'churn', 'drag', 'resize', or 'focus'
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#define WINDOW_WIDTH  400
+#define WINDOW_HEIGHT 300
+
+// how long to wait between two steps of a workload, in microseconds
+// this is deliberately faster than any monitor refresh rate, so that the compositor has to deal with several changes per frame
+
+#define STEP_INTERVAL 2000
+
+typedef struct {
+	Display* display;
+	int screen;
+	Window root_window;
+
+	int width, height;
+
+	Window* windows;
+	int window_count;
+
+	GC gc;
+	unsigned step;
+} clients_t;
+
+static double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void window_position(clients_t* clients, int window_index, int* x, int* y) {
+	// spread windows out in a grid-ish pattern, so that they overlap a bit without all being on top of each other
+	// x and y are never 0, or else the WM would move the window to the cursor
+
+	int columns = MAX(1, (clients->width - WINDOW_WIDTH) / (WINDOW_WIDTH / 3));
+	int rows    = MAX(1, (clients->height - WINDOW_HEIGHT) / (WINDOW_HEIGHT / 3));
+
+	*x = 1 + (window_index % columns) * (WINDOW_WIDTH / 3);
+	*y = 1 + (window_index / columns % rows) * (WINDOW_HEIGHT / 3);
+}
+
+static void create_windows(clients_t* clients) {
+	clients->windows = (Window*) calloc(clients->window_count, sizeof(*clients->windows));
+
+	for (int i = 0; i < clients->window_count; i++) {
+		int x, y;
+		window_position(clients, i, &x, &y);
+
+		unsigned long colour = (i * 0x3f1a7b + 0x402010) & 0xffffff;
+
+		clients->windows[i] = XCreateSimpleWindow(clients->display, clients->root_window, x, y, WINDOW_WIDTH, WINDOW_HEIGHT, 0, 0, colour);
+		XMapWindow(clients->display, clients->windows[i]);
+	}
+
+	clients->gc = XCreateGC(clients->display, clients->root_window, 0, NULL);
+	XSync(clients->display, 0);
+}
+
+// XTest helpers
+// these pretend to be the user, so that the events go through the WM exactly like they would normally
+
+static void press_key(clients_t* clients, KeySym key, int press) {
+	XTestFakeKeyEvent(clients->display, XKeysymToKeycode(clients->display, key), press, CurrentTime);
+}
+
+static void move_pointer(clients_t* clients, int x, int y) {
+	XTestFakeMotionEvent(clients->display, clients->screen, x, y, CurrentTime);
+}
+
+static void press_button(clients_t* clients, unsigned button, int press) {
+	XTestFakeButtonEvent(clients->display, button, press, CurrentTime);
+}
+
+// workloads
+// each of these does one step of the workload, and is called every 'STEP_INTERVAL' microseconds
+
+static void step_static(clients_t* clients) {
+	// nothing to do, the compositor shouldn't have to do anything either
+}
+
+static void step_redraw(clients_t* clients) {
+	// every window redraws a small moving square, like a terminal with a blinking cursor or a progress bar would
+
+	for (int i = 0; i < clients->window_count; i++) {
+		int offset = (clients->step * 4 + i * 16) % (WINDOW_WIDTH - 32);
+
+		XSetForeground(clients->display, clients->gc, (clients->step * 0x010203 + i) & 0xffffff);
+		XFillRectangle(clients->display, clients->windows[i], clients->gc, offset, WINDOW_HEIGHT / 2 - 16, 32, 32);
+	}
+}
+
+static void step_churn(clients_t* clients) {
+	// keep mapping and unmapping windows, like short-lived popups and tooltips
+
+	Window window = clients->windows[clients->step % clients->window_count];
+
+	if (clients->step / clients->window_count % 2) XMapWindow(clients->display, window);
+	else XUnmapWindow(clients->display, window);
+}
+
+static void step_drag(clients_t* clients, unsigned button) {
+	// grab the topmost window with Super+click and move the pointer around in a circle, one full turn every 256 steps
+	// this is used both for moving (left button) and resizing (right button) windows
+
+	int x = clients->width  / 2;
+	int y = clients->height / 2;
+
+	if (!clients->step) {
+		move_pointer(clients, x, y);
+
+		press_key(clients, XK_Super_L, 1);
+		press_button(clients, button, 1);
+	}
+
+	int radius = MIN(clients->width, clients->height) / 4;
+	double angle = clients->step / 256.0 * 2 * 3.14159265358979;
+
+	move_pointer(clients, x + radius * cos(angle), y + radius * sin(angle));
+}
+
+static void step_focus(clients_t* clients) {
+	// click on each window in turn, which raises and focuses it
+	// we click a little inside the corner each window has to itself in the grid, so we always hit the one we want
+
+	if (clients->step % 8) return; // give the WM a bit of time to animate between focus changes
+
+	int i = clients->step / 8 % clients->window_count;
+
+	int x, y;
+	window_position(clients, i, &x, &y);
+
+	move_pointer(clients, x + 8, y + 8);
+
+	press_button(clients, 1, 1);
+	press_button(clients, 1, 0);
+}
+
+static void release_everything(clients_t* clients) {
+	// make sure no buttons or keys stay pressed after a drag workload
+
+	press_button(clients, 1, 0);
+	press_button(clients, 3, 0);
+
+	press_key(clients, XK_Super_L, 0);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <static|redraw|churn|drag|resize|focus> [window count] [duration in seconds]\n", argv[0]);
+		return 1;
+	}
+
+	const char* workload = argv[1];
+
+	clients_t _clients;
+	clients_t* clients = &_clients;
+	memset(clients, 0, sizeof(*clients));
+
+	clients->window_count = argc > 2 ? atoi(argv[2]) : 20;
+	double duration = argc > 3 ? atof(argv[3]) : 10;
+
+	if (clients->window_count < 1) clients->window_count = 1;
+
+	clients->display = XOpenDisplay(NULL);
+
+	if (!clients->display) {
+		fprintf(stderr, "Failed to open display\n");
+		return 1;
+	}
+
+	int event_base, error_base, major, minor;
+
+	if (!XTestQueryExtension(clients->display, &event_base, &error_base, &major, &minor)) {
+		fprintf(stderr, "XTest extension not available\n");
+		return 1;
+	}
+
+	clients->screen = DefaultScreen(clients->display);
+	clients->root_window = DefaultRootWindow(clients->display);
+
+	clients->width  = DisplayWidth (clients->display, clients->screen);
+	clients->height = DisplayHeight(clients->display, clients->screen);
+
+	create_windows(clients);
+
+	// give the WM some time to notice all the windows and finish animating them in
+
+	sleep(1);
+
+	double start = now();
+
+	while (now() - start < duration) {
+		if      (!strcmp(workload, "static")) step_static(clients);
+		else if (!strcmp(workload, "redraw")) step_redraw(clients);
+		else if (!strcmp(workload, "churn"))  step_churn (clients);
+		else if (!strcmp(workload, "drag"))   step_drag  (clients, 1);
+		else if (!strcmp(workload, "resize")) step_drag  (clients, 3);
+		else if (!strcmp(workload, "focus"))  step_focus (clients);
+
+		else {
+			fprintf(stderr, "Unknown workload '%s'\n", workload);
+			return 1;
+		}
+
+		XFlush(clients->display);
+
+		clients->step++;
+		usleep(STEP_INTERVAL);
+	}
+
+	release_everything(clients);
+	XSync(clients->display, 0);
+
+	XCloseDisplay(clients->display);
+	return 0;
+}
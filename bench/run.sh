@@ -0,0 +1,107 @@
+#!/bin/sh
+# headless benchmark suite
+# for each workload, this starts a fresh Xvfb server, runs the compositor on it with Mesa's llvmpipe software renderer, runs the workload (see bench/clients.c), and then stops everything
+# the statistics the compositor writes on exit (see 'CWM_STATS') are collected into a single JSON array on stdout
+# usage (from the root of the repo, after running 'make x-compositing-wm bench/clients'):
+# $ bench/run.sh > results.json
+# the workloads, window count, and duration of each workload (in seconds) can be set with 'BENCH_WORKLOADS', 'BENCH_WINDOWS', and 'BENCH_DURATION'
+# each workload is run once for each way the compositor can get window contents into textures (see 'CWM_CONTENT_PATH'), which can be narrowed down with 'BENCH_CONTENT_PATHS'
+# it's then run again with the CPU compositor instead of llvmpipe (see 'CWM_BACKEND'), which can be left out by setting 'BENCH_BACKENDS' to just 'gl'
+
+set -e
+
+WORKLOADS=${BENCH_WORKLOADS:-static redraw churn drag resize focus}
+WINDOWS=${BENCH_WINDOWS:-20}
+DURATION=${BENCH_DURATION:-10}
+CONTENT_PATHS=${BENCH_CONTENT_PATHS:-pixmap shm}
+BACKENDS=${BENCH_BACKENDS:-gl cpu}
+DISPLAY_NUMBER=${BENCH_DISPLAY:-99}
+
+WM=${WM:-./x-compositing-wm}
+CLIENTS=${CLIENTS:-bench/clients}
+
+for program in Xvfb $WM $CLIENTS; do
+	if ! command -v $program > /dev/null; then
+		echo "$program not found" >&2
+		exit 1
+	fi
+done
+
+# there's no GPU under Xvfb, so force Mesa's software rasterizer
+# this makes absolute numbers meaningless compared to real hardware, but it means CPU time is a reasonable proxy for how much work the compositor is doing, and results are comparable between runs on the same machine
+
+export LIBGL_ALWAYS_SOFTWARE=1
+export GALLIUM_DRIVER=llvmpipe
+export DISPLAY=:$DISPLAY_NUMBER
+
+# don't let Xvfb dictate the frame rate (it doesn't have a real refresh rate to pace to anyway)
+
+export CWM_FRAME_RATE=${CWM_FRAME_RATE:-60}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo "["
+first=1
+
+for workload in $WORKLOADS; do
+	for backend in $BACKENDS; do
+		# the CPU compositor always gets window contents through MIT-SHM, so there's only one content path to run it with
+
+		content_paths=$CONTENT_PATHS
+		[ $backend = cpu ] && content_paths=shm
+
+		for content_path in $content_paths; do
+			run=$workload-$backend-$content_path
+
+			Xvfb :$DISPLAY_NUMBER -screen 0 1920x1080x24 +extension GLX +xinerama -nolisten tcp > "$TMP/xvfb.log" 2>&1 &
+			xvfb_pid=$!
+
+			# wait for the server to create its socket
+
+			tries=0
+
+			while [ ! -e /tmp/.X11-unix/X$DISPLAY_NUMBER ]; do
+				tries=$((tries + 1))
+
+				if [ $tries -gt 50 ]; then
+					echo "Xvfb didn't start (see below)" >&2
+					cat "$TMP/xvfb.log" >&2
+					exit 1
+				fi
+
+				sleep 0.1
+			done
+
+			CWM_BACKEND=$backend CWM_CONTENT_PATH=$content_path CWM_STATS="$TMP/$run.json" $WM > "$TMP/$run.log" 2>&1 &
+			wm_pid=$!
+			sleep 1
+
+			$CLIENTS $workload $WINDOWS $DURATION
+
+			kill -TERM $wm_pid
+			wait $wm_pid || true
+
+			kill -TERM $xvfb_pid
+			wait $xvfb_pid || true
+
+			if [ ! -s "$TMP/$run.json" ]; then
+				echo "No statistics written for '$workload' workload with '$backend' backend and '$content_path' content path (see below)" >&2
+				cat "$TMP/$run.log" >&2
+				exit 1
+			fi
+
+			[ $first = 1 ] || echo ","
+			first=0
+
+			# tag the compositor's statistics with the workload, backend, and content path they were measured under
+
+			printf '\t{"workload": "%s", "backend": "%s", "content_path": "%s", "windows": %d, "stats": ' $workload $backend $content_path $WINDOWS
+			cat "$TMP/$run.json"
+			printf '}'
+		done
+	done
+done
+
+echo
+echo "]"
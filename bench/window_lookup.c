@@ -0,0 +1,65 @@
+// microbenchmark for looking up windows by XID, which happens on pretty much every event the WM receives
+// this doesn't need an X server, it just fills up the WM's window list with fake windows
+// compile with:
+// $ cc bench/window_lookup.c -O2 -Isrc -lX11 -lX11-xcb -lxcb -lXdamage -lXinerama -lXrandr -lXext -lm -o window_lookup
+
+#include <wm.h>
+
+#include <time.h>
+
+#define LOOKUP_COUNT 10000000
+
+static double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void bench(int window_count) {
+	wm_t wm;
+	memset(&wm, 0, sizeof(wm));
+
+	// XIDs are handed out sequentially from each client's resource base, so emulate a bunch of clients with a few windows each
+
+	new_slab(&wm.windows, sizeof(wm_window_t));
+
+	for (int i = 0; i < window_count; i++) {
+		int window_index = slab_alloc(&wm.windows);
+		wm_window_t* window = wm_get_window(&wm, window_index);
+
+		window->exists = 1;
+		window->window = ((Window) (i / 8 + 1) << 21) | (i % 8 + 1);
+
+		wm_hash_insert(&wm.window_hash, window->window, window_index);
+	}
+
+	// look up windows in a pseudo-random order, so we're not just measuring the cache
+
+	unsigned index = 0;
+	long checksum = 0;
+
+	double start = now();
+
+	for (int i = 0; i < LOOKUP_COUNT; i++) {
+		index = (index * 1103515245 + 12345) % window_count;
+		checksum += wm_find_window_by_xid(&wm, wm_get_window(&wm, index)->window);
+	}
+
+	double elapsed = now() - start;
+
+	printf("{ \"windows\": %d, \"ns_per_lookup\": %.2f, \"checksum\": %ld }\n", window_count, elapsed / LOOKUP_COUNT * 1e9, checksum);
+
+	free_slab(&wm.windows);
+	free(wm.window_hash.entries);
+}
+
+int main(void) {
+	int window_counts[] = { 10, 100, 1000, 5000 };
+
+	for (int i = 0; i < sizeof(window_counts) / sizeof(*window_counts); i++) {
+		bench(window_counts[i]);
+	}
+
+	return 0;
+}
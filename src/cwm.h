@@ -9,6 +9,18 @@
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/shape.h>
 
+// XDamage tells us when the contents of a window change, so we don't have to redraw the screen when nothing happened
+
+#include <X11/extensions/Xdamage.h>
+
+// X SYNC fences let us make sure the server is done rendering to window pixmaps before OpenGL samples them, without having to grab the server
+
+#include <X11/extensions/sync.h>
+
+// MIT-SHM lets the server copy window contents straight into memory we share with it, for when binding pixmaps to textures isn't cheap (see 'cwm_content_path_t')
+
+#include <xcb/shm.h>
+
 // we use GLEW to help us load most of the OpenGL functions we're using
 // it is important that it goes before the 'glx.h' include
 
@@ -17,312 +29,1848 @@
 
 // standard library includes
 
+#include <time.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <sys/param.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 // defines and stuff for GLX
 
 #define GLX_CONTEXT_MAJOR_VERSION_ARB 0x2091
 #define GLX_CONTEXT_MINOR_VERSION_ARB 0x2092
 
+#if !defined(GLX_BACK_BUFFER_AGE_EXT)
+	#define GLX_BACK_BUFFER_AGE_EXT 0x20F4
+#endif
+
 typedef GLXContext (*glXCreateContextAttribsARB_t) (Display*, GLXFBConfig, GLXContext, Bool, const int*);
 
 typedef void (*glXBindTexImageEXT_t) (Display*, GLXDrawable, int, const int*);
 typedef void (*glXReleaseTexImageEXT_t) (Display*, GLXDrawable, int);
 
 typedef void (*glXSwapIntervalEXT_t) (Display*, GLXDrawable, int);
+typedef void (*glXCopySubBufferMESA_t) (Display*, GLXDrawable, int, int, int, int);
 
 // structures and types
 
+// damage regions are kept as a short list of non-overlapping rectangles (in X coordinates, so starting from the top left)
+// that way we can hand them straight to 'glScissor' and 'glXCopySubBufferMESA'
+// when we run out of space, we just merge rectangles together, which means we might repaint a little more than necessary, but never less
+
+#define CWM_DAMAGE_MAX_RECTS 16
+
+// how many frames of damage we remember
+// with 'GLX_EXT_buffer_age', we need to repair whatever changed since the back buffer was last drawn to, which could be a few frames ago
+
+#define CWM_DAMAGE_HISTORY 4
+
+// occlusion regions are lists of rectangles which are known to be completely covered by opaque windows
+// unlike damage regions, we can't merge these together (we'd think things are covered when they aren't), so when we run out of space we just forget the smallest rectangle
+
+#define CWM_OCCLUSION_MAX_RECTS 16
+
+// how many pieces a rectangle can be cut into when working out which parts of it are visible
+// if we need more than that, we give up and consider the whole rectangle visible
+
+#define CWM_OCCLUSION_MAX_PIECES 64
+
+// GLX frame buffer configuration (and texture format) to use when binding a pixmap of a certain depth
+// looking these up is slow, so we do it once for every possible depth at startup
+
+#define CWM_MAX_DEPTH 32
+
+typedef struct {
+	int valid;
+
+	GLXFBConfig config;
+	int format;
+} cwm_pixmap_config_t;
+
+typedef struct {
+	int x, y;
+	int width, height;
+} cwm_rect_t;
+
+typedef struct {
+	int rect_count;
+	cwm_rect_t rects[CWM_DAMAGE_MAX_RECTS];
+} cwm_damage_t;
+
+typedef struct {
+	int rect_count;
+	cwm_rect_t rects[CWM_OCCLUSION_MAX_RECTS];
+} cwm_occlusion_t;
+
+// one of the fences we use to wait for X rendering (see 'cwm_begin_window_binds')
+
+typedef struct {
+	XSyncFence x_fence;
+	GLsync gl_fence; // the same fence, imported into OpenGL
+
+	GLsync done_fence; // signalled once the GPU is done waiting on the fence, at which point we can reset it
+	int triggered;
+} cwm_fence_t;
+
+// how many fences we cycle through
+// a fence is reset half this many frames before it's used again, which gives the server time to process the reset before we trigger it again
+
+#define CWM_FENCE_COUNT 4
+
+// how we get window contents into textures
+// by default, we bind window pixmaps straight to textures with 'GLX_EXT_texture_from_pixmap', which costs nothing on a GPU but which software renderers (like llvmpipe) implement by copying the whole pixmap on every bind
+// the alternative ('CWM_CONTENT_PATH=shm') is to copy only the damaged parts of each window ourselves, through MIT-SHM and then a ring of persistently mapped PBOs, into textures we own
+
+typedef enum {
+	CWM_CONTENT_PIXMAP,
+	CWM_CONTENT_SHM,
+} cwm_content_path_t;
+
+// what we draw with
+// normally that's OpenGL, but when it isn't available (or with 'CWM_BACKEND=cpu'), we draw into a frame buffer in memory with our own compositor instead (see 'soft.h')
+
+typedef enum {
+	CWM_BACKEND_GL,
+	CWM_BACKEND_CPU,
+} cwm_backend_t;
+
+// how many PBOs we cycle through
+// a PBO is only written to again once the GPU is done uploading from it, which it should be long before we come back round to it
+
+#define CWM_PBO_COUNT 3
+
+// one damaged part of a window we asked the server to copy into the shared memory segment, waiting to be uploaded (see 'cwm_finish_window_binds')
+
+typedef struct {
+	GLuint texture;
+	uint32_t* pixels; // with the CPU compositor, where the window's contents go instead of a texture
+	int pixels_width;
+
+	cwm_rect_t rect;
+
+	size_t offset; // in the shared memory segment (and in the PBO it's uploaded from)
+	xcb_shm_get_image_cookie_t cookie;
+} cwm_shm_copy_t;
+
+// one of the outputs (monitors) we draw to
+// each has its own damage and frame schedule, so that something changing on one monitor doesn't make us redraw the others, nor redraw them more often than their refresh rate
+// they all share the same output window though, so they're presented together at whatever cadence the swap is synced to (see 'cwm_swap')
+
+typedef struct {
+	cwm_rect_t rect;
+
+	uint64_t frame_interval;
+	uint64_t next_frame_time;
+
+	cwm_damage_t damage; // what changed on the output since we last drew it
+	int due; // whether or not we're drawing the output this frame (or drew it last frame, until the next one starts)
+
+	uint64_t rendered_frame_count;
+} cwm_output_t;
+
 typedef struct {
 	wm_t* wm;
 
+	cwm_backend_t backend;
+
+	// when this is off, we grab the server once per frame while we're binding and drawing windows (toggled with Super+V)
+	// nothing else can draw while we hold the grab, which makes some capture tools (like OBS with XSHM) a lot smoother, at the expense of every other client
+
 	int vsync;
-	struct timeval previous_time;
+	uint64_t previous_frame_time; // microseconds on the monotonic clock, so that the time of day jumping around doesn't affect animations
 
 	Window overlay_window;
 	Window output_window;
+	Colormap output_colormap; // only with OpenGL, the CPU compositor's output window uses the default one
 
 	GLXContext glx_context;
 
 	int glx_config_count;
 	GLXFBConfig* glx_configs;
 
+	cwm_pixmap_config_t pixmap_configs[CWM_MAX_DEPTH + 1]; // indexed by depth
+
 	glXBindTexImageEXT_t glXBindTexImageEXT;
 	glXReleaseTexImageEXT_t glXReleaseTexImageEXT;
-} cwm_t;
 
-typedef struct {
-	Pixmap x_pixmap;
-	GLXPixmap pixmap;
-} cwm_window_internal_t;
+	// X rendering synchronization (only if both X SYNC and 'GL_EXT_x11_sync_object' are supported)
+	// otherwise, we rely on the driver to synchronize X rendering and texture sampling implicitly, which is what Mesa does anyway
 
-// functions
+	int fences_supported;
 
-void new_cwm(cwm_t* cwm, wm_t* wm) {
-	memset(cwm, 0, sizeof(*cwm));
-	cwm->wm = wm;
+	cwm_fence_t fences[CWM_FENCE_COUNT];
+	int current_fence;
 
-	// make it so that our compositing window manager can be recognized as such by other processes
+	// content path (see 'cwm_content_path_t')
+	// the shared memory segment is big enough for the whole screen, and is filled from the start each frame (if a frame needs more than that, we upload what we have and start over)
 
-	Window screen_owner = XCreateSimpleWindow(wm->display, wm->root_window, 0, 0, 1, 1, 0, 0, 0);
-	Xutf8SetWMProperties(wm->display, screen_owner, "xcompmgr", "xcompmgr", NULL, 0, NULL, NULL, NULL);
+	cwm_content_path_t content_path;
 
-	char name[] = "_NET_WM_CM_S##";
-	snprintf(name, sizeof(name), "_NET_WM_CM_S%d", cwm->wm->screen);
+	xcb_shm_seg_t shm_segment;
+	unsigned char* shm_data;
+	size_t shm_size;
+	size_t shm_used;
 
-	Atom atom = XInternAtom(wm->display, name, 0);
-	XSetSelectionOwner(wm->display, atom, screen_owner, 0);
+	cwm_shm_copy_t* shm_copies;
+	int shm_copy_count;
+	int shm_copy_capacity;
 
-	// we want to enable manual redirection, because we want to track damage and flush updates ourselves
-	// if we were to pass 'CompositeRedirectAutomatic' instead, the server would handle all that internally
+	// without 'GL_ARB_buffer_storage', we upload straight from the shared memory segment instead (which is more of a stall, but still only the damaged parts)
 
-	XCompositeRedirectSubwindows(wm->display, wm->root_window, CompositeRedirectManual);
+	int pbos_supported;
 
-	// get the overlay window
-	// this window allows us to draw what we want on a layer between normal windows and the screensaver without interference
+	GLuint pbos[CWM_PBO_COUNT];
+	unsigned char* pbo_data[CWM_PBO_COUNT];
+	GLsync pbo_fences[CWM_PBO_COUNT];
+	int current_pbo;
 
-	cwm->overlay_window = XCompositeGetOverlayWindow(wm->display, wm->root_window);
+	// CPU compositor stuff
+	// the frame buffer is shared with the server, and we can't touch it again until the server is done copying it to the output window ('present_pending')
 
-	// explained in more detail in the comment before '#include <X11/extensions/Xfixes.h>'
-	// basically, make the overlay transparent to events and pass them on through to lower windows
+	uint32_t* frame_buffer;
+	xcb_shm_seg_t frame_segment;
+	xcb_gcontext_t frame_gc;
+	int frame_depth;
 
-	XserverRegion region = XFixesCreateRegion(wm->display, NULL, 0);
-	XFixesSetWindowShapeRegion(wm->display, cwm->overlay_window, ShapeInput, 0, 0, region);
-	XFixesDestroyRegion(wm->display, region);
+	int present_pending;
+	xcb_get_input_focus_cookie_t present_cookie;
 
-	// create the output window
-	// this window is where the actual drawing is going to happen
+	// repaint tracking
+	// 'needs_repaint' is set whenever something changed on screen (window contents, window state, running animations, &c)
+	// when it isn't set, there's no point in drawing a new frame, so we can just block until the next event instead
 
-	/* const */ int default_visual_attributes[] = {
-		GLX_RGBA, GLX_DOUBLEBUFFER,
-		GLX_SAMPLE_BUFFERS, 1,
-		GLX_SAMPLES, 4,
-		GLX_RED_SIZE, 8,
-		GLX_GREEN_SIZE, 8,
-		GLX_BLUE_SIZE, 8,
-		GLX_ALPHA_SIZE, 8,
-		GLX_DEPTH_SIZE, 16, 0
-	};
+	int needs_repaint;
 
-	XVisualInfo* default_visual = glXChooseVisual(wm->display, wm->screen, default_visual_attributes);
-	if (!default_visual) wm_error(wm, "Failed to get default GLX visual");
+	uint64_t rendered_frame_count;
+	uint64_t skipped_frame_count;
 
-	XSetWindowAttributes attributes = {
-		.colormap = XCreateColormap(wm->display, wm->root_window, default_visual->visual, AllocNone),
-		.border_pixel = 0,
-	};
+	// frame scheduling
+	// each output is drawn at most once every 'frame_interval' microseconds of its own (by default, its refresh rate), and only if something changed on it
+	// a frame draws all the outputs which are due at that point, and the others hold on to their damage until their own deadline
+	// times are in microseconds on the monotonic clock
 
-	cwm->output_window = XCreateWindow(
-		wm->display, wm->root_window, 0, 0, wm->width, wm->height, 0, default_visual->depth,
-		InputOutput, default_visual->visual, CWBorderPixel | CWColormap, &attributes);
+	int output_count;
+	cwm_output_t* outputs;
 
-	XReparentWindow(wm->display, cwm->output_window, cwm->overlay_window, 0, 0);
-	XMapRaised(wm->display, cwm->output_window);
+	uint64_t frame_interval; // of the fastest output
 
-	// get the GLX frame buffer configurations that match our specified attributes
-	// generally we'll just be using the first one ('glx_configs[0]')
+	int idle; // whether or not we went idle (stopped drawing frames) since the last frame
 
-	const int config_attributes[] = {
-		GLX_BIND_TO_TEXTURE_RGBA_EXT, 1,
-		GLX_BIND_TO_TEXTURE_TARGETS_EXT, GLX_TEXTURE_2D_BIT_EXT,
-		GLX_RENDER_TYPE, GLX_RGBA_BIT,
-		GLX_DRAWABLE_TYPE, GLX_PIXMAP_BIT,
-		GLX_X_VISUAL_TYPE, GLX_TRUE_COLOR,
-		GLX_X_RENDERABLE, 1,
-		GLX_FRAMEBUFFER_SRGB_CAPABLE_EXT, (GLint) GLX_DONT_CARE,
-		GLX_BUFFER_SIZE, 32,
-//		GLX_SAMPLE_BUFFERS, 1,
-//		GLX_SAMPLES, 4,
-		GLX_DOUBLEBUFFER, 1,
-		GLX_RED_SIZE, 8,
-		GLX_GREEN_SIZE, 8,
-		GLX_BLUE_SIZE, 8,
-		GLX_ALPHA_SIZE, 8,
-		GLX_STENCIL_SIZE, 0,
-		GLX_DEPTH_SIZE, 16, 0
-	};
+	// partial repaint stuff
+	// 'damage' is what changed on the outputs we're drawing this frame, 'repaint' is what we actually need to redraw taking the age of the back buffer into account
 
-	cwm->glx_configs = glXChooseFBConfig(wm->display, wm->screen, config_attributes, &cwm->glx_config_count);
-	if (!cwm->glx_configs) wm_error(wm, "Failed to get GLX frame buffer configurations");
+	int buffer_age_supported;
+	glXCopySubBufferMESA_t glXCopySubBufferMESA;
 
-	// create our OpenGL context
-	// we must load the 'glXCreateContextAttribsARB' function ourselves
+	cwm_damage_t damage;
+	cwm_damage_t repaint;
 
-	const int gl_version_attributes[] = { // we want OpenGL 3.3
-		GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
-		GLX_CONTEXT_MINOR_VERSION_ARB, 3,
-		GLX_CONTEXT_FLAGS_ARB, GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB, 0
-	};
+	cwm_damage_t damage_history[CWM_DAMAGE_HISTORY];
 
-	glXCreateContextAttribsARB_t glXCreateContextAttribsARB = (glXCreateContextAttribsARB_t) glXGetProcAddressARB((const GLubyte*) "glXCreateContextAttribsARB");
-	cwm->glx_context = glXCreateContextAttribsARB(wm->display, cwm->glx_configs[0], NULL, 1, gl_version_attributes);
-	if (!cwm->glx_context) wm_error(wm, "Failed to create OpenGL context");
+	// windows which got damage events since we last told the server we'd seen them (see '__cwm_acknowledge_damage')
 
-	// load the other two functions we need but don't have
+	unsigned* damaged_windows;
+	int damaged_window_count;
+	int damaged_window_capacity;
 
-	cwm->glXBindTexImageEXT = (glXBindTexImageEXT_t) glXGetProcAddress((const GLubyte*) "glXBindTexImageEXT");
-	cwm->glXReleaseTexImageEXT = (glXReleaseTexImageEXT_t) glXGetProcAddress((const GLubyte*) "glXReleaseTexImageEXT");
+	// statistics about how often we have to recreate window pixmaps (which is expensive)
 
-	// finally, make the context we just made the OpenGL context of this thread
-	glXMakeCurrent(wm->display, cwm->output_window, cwm->glx_context);
+	uint64_t pixmap_creation_count;
+	uint64_t pixmap_destruction_count;
 
-	// initialize GLEW
-	// this will be needed for most modern OpenGL calls
+	uint64_t bind_count; // how many times we've bound window pixmaps to textures
+	uint64_t uploaded_byte_count; // how much window content we copied ourselves (only with the MIT-SHM content path)
 
-	glewExperimental = GL_TRUE;
-	if (glewInit() != GLEW_OK) wm_error(wm, "Failed to initialize GLEW");
+	// unredirection
+	// when an opaque window covers a whole output, we let it draw straight to the screen and cut that output out of the overlay window
+	// if that output is the whole screen, nothing we could draw would be visible anyway, so we stop drawing altogether ('suspended')
 
-	// enable adaptive vsync (-1 for adaptive vsync, 1 for non-adaptive vsync, 0 for no vsync)
-	// this extension seems completely broken on NVIDIA
+	int unredirected_window; // index in the WM's window list, -1 if there's none
+	cwm_rect_t unredirected_output;
 
-	// glXSwapIntervalEXT_t glXSwapIntervalEXT = (glXSwapIntervalEXT_t) glXGetProcAddress((const GLubyte*) "glXSwapIntervalEXT");
-	// glXSwapIntervalEXT(wm->display, cwm->output_window, 0);
+	int suspended;
 
-	cwm->vsync = 1;
+	uint64_t unredirection_count;
 
-	// blacklist the overlay and output windows for events
+	// our own per-window state (see 'cwm_window_internal_t'), which each window points to through its 'internal' field
 
-	wm->event_blacklisted_windows = (Window*) realloc(wm->event_blacklisted_windows, (2 + wm->event_blacklisted_window_count) * sizeof(Window));
+	slab_t window_internals;
+} cwm_t;
 
-	wm->event_blacklisted_windows[wm->event_blacklisted_window_count + 0] = cwm->overlay_window;
-	wm->event_blacklisted_windows[wm->event_blacklisted_window_count + 1] = cwm->output_window;
-	// wm->event_blacklisted_windows[wm->event_blacklisted_window_count + 2] = screen_owner;
+typedef struct {
+	Pixmap x_pixmap;
+	GLXPixmap pixmap;
 
-	wm->event_blacklisted_window_count += 2;
+	// each window has its own texture object, so that several windows can be bound at once on different texture units
+	GLuint texture;
 
-	// setup the timing code (window managers don't seem to be able to vsync)
+	// size and mapping of the window when we last saw it
+	// the pixmap only needs to be recreated when one of these change, not when the window is just moved or restacked
+
+	int width, height;
+	int visible;
+
+	Damage damage;
+	int damage_unacknowledged; // whether the window is in 'damaged_windows'
+
+	// with the MIT-SHM content path, the parts of the window's texture which are out of date, and the size the texture was last allocated at
+	// the CPU compositor keeps the window's contents in 'pixels' instead of a texture
+
+	cwm_damage_t content_damage;
+	int texture_width, texture_height;
+
+	// the actual size of the pixmap we copy from, which can differ from 'width' and 'height' if the window was resized again before we named it
+	int pixmap_width, pixmap_height;
+
+	uint32_t* pixels;
+
+	int slot; // in 'window_internals'
+} cwm_window_internal_t;
+
+// damage region functions
 
-	gettimeofday(&cwm->previous_time, 0);
+static inline int cwm_rect_intersects(cwm_rect_t a, cwm_rect_t b) {
+	return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
 }
 
-uint64_t cwm_swap(cwm_t* cwm) {
-	glXSwapBuffers(cwm->wm->display, cwm->output_window);
+static inline cwm_rect_t cwm_rect_union(cwm_rect_t a, cwm_rect_t b) {
+	int x1 = MIN(a.x, b.x);
+	int y1 = MIN(a.y, b.y);
 
-	// return the time in microseconds between this frame and the last
+	int x2 = MAX(a.x + a.width,  b.x + b.width);
+	int y2 = MAX(a.y + a.height, b.y + b.height);
 
-	struct timeval current_time;
-	gettimeofday(&current_time, 0);
+	return (cwm_rect_t) { x1, y1, x2 - x1, y2 - y1 };
+}
 
-	int64_t delta = (current_time.tv_sec - cwm->previous_time.tv_sec) * 1000000 + current_time.tv_usec - cwm->previous_time.tv_usec;
+static inline cwm_rect_t cwm_rect_intersection(cwm_rect_t a, cwm_rect_t b) {
+	// if the rectangles don't intersect, this returns an empty rectangle (zero width or height)
 
-	cwm->previous_time = current_time;
-	return delta;
+	int x1 = MAX(a.x, b.x);
+	int y1 = MAX(a.y, b.y);
+
+	int x2 = MIN(a.x + a.width,  b.x + b.width);
+	int y2 = MIN(a.y + a.height, b.y + b.height);
+
+	return (cwm_rect_t) { x1, y1, MAX(0, x2 - x1), MAX(0, y2 - y1) };
 }
 
-static cwm_window_internal_t* cwm_get_window_internal(cwm_t* cwm, wm_window_t* window) {
-	cwm_window_internal_t* window_internal = (cwm_window_internal_t*) window->internal;
+static inline int64_t cwm_rect_area(cwm_rect_t rect) {
+	return (int64_t) rect.width * rect.height;
+}
 
-	if (!window_internal) {
-		window->internal = (void*) malloc(sizeof(cwm_window_internal_t));
-		memset(window->internal, 0, sizeof(cwm_window_internal_t));
+static void cwm_damage_add(cwm_damage_t* damage, cwm_rect_t rect) {
+	if (rect.width <= 0 || rect.height <= 0) return;
+
+merge:
+
+	// merge with every rectangle we overlap, so that the list stays non-overlapping
+	// the merged rectangle might overlap new ones, so start over each time
+
+	for (int i = 0; i < damage->rect_count; i++) {
+		if (cwm_rect_intersects(damage->rects[i], rect)) {
+			rect = cwm_rect_union(rect, damage->rects[i]);
+			damage->rects[i] = damage->rects[--damage->rect_count];
+
+			goto merge;
+		}
 	}
 
-	return (cwm_window_internal_t*) window->internal;
-}
+	// if there's no space left, merge with whichever rectangle makes us grow the least
 
-// event handler functions
+	if (damage->rect_count == CWM_DAMAGE_MAX_RECTS) {
+		int best = 0;
+		int64_t best_growth = INT64_MAX;
 
-void cwm_create_event(cwm_t* cwm, unsigned window_index) {
-	wm_window_t* window = &cwm->wm->windows[window_index];
-	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+		for (int i = 0; i < damage->rect_count; i++) {
+			int64_t growth = cwm_rect_area(cwm_rect_union(rect, damage->rects[i])) - cwm_rect_area(damage->rects[i]) - cwm_rect_area(rect);
+
+			if (growth < best_growth) {
+				best = i;
+				best_growth = growth;
+			}
+		}
+
+		rect = cwm_rect_union(rect, damage->rects[best]);
+		damage->rects[best] = damage->rects[--damage->rect_count];
+
+		goto merge;
+	}
+
+	damage->rects[damage->rect_count++] = rect;
 }
 
-static inline void __cwm_free_pixmap(cwm_t* cwm, cwm_window_internal_t* window_internal) {
-	if (window_internal->x_pixmap) {
-		XFreePixmap(cwm->wm->display, window_internal->x_pixmap);
-		window_internal->x_pixmap = 0;
+static void cwm_damage_union(cwm_damage_t* damage, cwm_damage_t* other) {
+	for (int i = 0; i < other->rect_count; i++) {
+		cwm_damage_add(damage, other->rects[i]);
 	}
+}
 
-	if (window_internal->pixmap) {
-		glXDestroyPixmap(cwm->wm->display, window_internal->pixmap);
-		window_internal->pixmap = 0;
+static cwm_rect_t cwm_damage_bounds(cwm_damage_t* damage) {
+	if (!damage->rect_count) return (cwm_rect_t) { 0 };
+	cwm_rect_t bounds = damage->rects[0];
+
+	for (int i = 1; i < damage->rect_count; i++) {
+		bounds = cwm_rect_union(bounds, damage->rects[i]);
 	}
+
+	return bounds;
 }
 
-void cwm_modify_event(cwm_t* cwm, unsigned window_index) {
-	wm_window_t* window = &cwm->wm->windows[window_index];
-	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+// occlusion region functions
 
-	// delete pixmap since we're likely gonna need to update it
+static void cwm_occlusion_add(cwm_occlusion_t* occlusion, cwm_rect_t rect) {
+	if (rect.width <= 0 || rect.height <= 0) return;
 
-	__cwm_free_pixmap(cwm, window_internal);
+	if (occlusion->rect_count < CWM_OCCLUSION_MAX_RECTS) {
+		occlusion->rects[occlusion->rect_count++] = rect;
+		return;
+	}
+
+	// no space left, replace the smallest rectangle if we're bigger than it
+
+	int smallest = 0;
+
+	for (int i = 1; i < occlusion->rect_count; i++) {
+		if (cwm_rect_area(occlusion->rects[i]) < cwm_rect_area(occlusion->rects[smallest])) {
+			smallest = i;
+		}
+	}
+
+	if (cwm_rect_area(rect) > cwm_rect_area(occlusion->rects[smallest])) {
+		occlusion->rects[smallest] = rect;
+	}
 }
 
-void cwm_destroy_event(cwm_t* cwm, unsigned window_index) {
-	wm_window_t* window = &cwm->wm->windows[window_index];
-	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+static int cwm_occlusion_visible(cwm_occlusion_t* occlusion, cwm_rect_t rect, cwm_rect_t* visible_bounds) {
+	// returns whether or not any part of 'rect' isn't covered by the occlusion region
+	// if 'visible_bounds' isn't NULL, it's set to the bounding box of the visible parts of 'rect'
 
-	__cwm_free_pixmap(cwm, window_internal);
-	free(window_internal);
+	if (visible_bounds) *visible_bounds = rect;
+	if (rect.width <= 0 || rect.height <= 0) return 0;
+
+	cwm_rect_t pieces[CWM_OCCLUSION_MAX_PIECES];
+	int piece_count = 1;
+
+	pieces[0] = rect;
+
+	for (int i = 0; i < occlusion->rect_count && piece_count; i++) {
+		cwm_rect_t occluder = occlusion->rects[i];
+
+		for (int j = 0; j < piece_count; j++) {
+			cwm_rect_t piece = pieces[j];
+			if (!cwm_rect_intersects(piece, occluder)) continue;
+
+			// cut the piece into the (up to 4) parts which are outside the occluder: above, below, left, and right of it
+
+			if (piece_count + 3 > CWM_OCCLUSION_MAX_PIECES) return 1;
+
+			int x1 = MAX(piece.x, occluder.x);
+			int y1 = MAX(piece.y, occluder.y);
+
+			int x2 = MIN(piece.x + piece.width,  occluder.x + occluder.width);
+			int y2 = MIN(piece.y + piece.height, occluder.y + occluder.height);
+
+			cwm_rect_t parts[4] = {
+				{ piece.x, piece.y, piece.width, y1 - piece.y },
+				{ piece.x, y2, piece.width, piece.y + piece.height - y2 },
+				{ piece.x, y1, x1 - piece.x, y2 - y1 },
+				{ x2, y1, piece.x + piece.width - x2, y2 - y1 },
+			};
+
+			pieces[j--] = pieces[--piece_count];
+
+			for (int k = 0; k < 4; k++) {
+				if (parts[k].width > 0 && parts[k].height > 0) {
+					pieces[piece_count++] = parts[k];
+				}
+			}
+		}
+	}
+
+	if (!piece_count) return 0;
+
+	if (visible_bounds) {
+		*visible_bounds = pieces[0];
+
+		for (int i = 1; i < piece_count; i++) {
+			*visible_bounds = cwm_rect_union(*visible_bounds, pieces[i]);
+		}
+	}
+
+	return 1;
 }
 
-// rendering functions
+// functions
+
+static uint64_t cwm_now(void) {
+	return wm_now();
+}
 
 #define glXGetFBConfigAttribChecked(a, b, attr, c) \
 	if (glXGetFBConfigAttrib((a), (b), (attr), (c))) { \
 		fprintf(stderr, "WARNING Cannot get FBConfig attribute " #attr "\n"); \
 	}
 
-void cwm_bind_window_texture(cwm_t* cwm, unsigned window_index) {
-	wm_window_t* window = &cwm->wm->windows[window_index];
-	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+static unsigned char* __cwm_create_shm_segment(cwm_t* cwm, size_t size, xcb_shm_seg_t* segment) {
+	// create a shared memory segment and attach it to both us and the server, returning where it is on our side (or NULL if that didn't work)
 
-	if (!window->exists)  return;
-	if (!window->visible) return;
+	xcb_connection_t* connection = cwm->wm->connection;
 
-	// TODO 'XGrabServer'/'XUngrabServer' necessary?
-	// it seems to make things 10x faster for whatever reason
-	// which is actually good for recording using OBS with XSHM
+	int shm_id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (shm_id < 0) return NULL;
 
-	if (!cwm->vsync) XGrabServer(cwm->wm->display);
-	// glXWaitX(); // same as 'XSync', but a tad more efficient
+	unsigned char* data = (unsigned char*) shmat(shm_id, NULL, 0);
 
-	// update the window's pixmap
+	if (data == (void*) -1) {
+		shmctl(shm_id, IPC_RMID, NULL);
+		return NULL;
+	}
+
+	*segment = xcb_generate_id(connection);
+	xcb_generic_error_t* error = xcb_request_check(connection, xcb_shm_attach_checked(connection, *segment, shm_id, 0));
 
-	if (!window_internal->pixmap) {
-		XWindowAttributes attribs;
-		XGetWindowAttributes(cwm->wm->display, window->window, &attribs);
+	// the segment is only actually removed once both we and the server have detached from it, so we can mark it for removal straight away
+	// that way it doesn't outlive us if we crash
 
-		int format;
-		GLXFBConfig config;
+	shmctl(shm_id, IPC_RMID, NULL);
 
-		for (int i = 0; i < cwm->glx_config_count; i++) {
-			config = cwm->glx_configs[i];
+	if (error) {
+		free(error);
+		shmdt(data);
 
-			int has_alpha;
-			glXGetFBConfigAttribChecked(cwm->wm->display, config, GLX_BIND_TO_TEXTURE_RGBA_EXT, &has_alpha);
+		return NULL;
+	}
 
-			XVisualInfo* visual = glXGetVisualFromFBConfig(cwm->wm->display, config);
-			int visual_depth = visual->depth;
-			free(visual);
+	return data;
+}
 
-			if (attribs.depth != visual_depth) {
-				continue;
-			}
+static int __cwm_setup_shm(cwm_t* cwm) {
+	// set up everything we need for the MIT-SHM content path, returning whether or not we can use it
+	// this won't work if the server is on another machine, or if it doesn't do MIT-SHM at all
 
-			// found the config we want, break
+	wm_t* wm = cwm->wm;
 
-			format = has_alpha ? GLX_TEXTURE_FORMAT_RGBA_EXT : GLX_TEXTURE_FORMAT_RGB_EXT;
-			break;
-		}
+	xcb_shm_query_version_reply_t* version = xcb_shm_query_version_reply(wm->connection, xcb_shm_query_version(wm->connection), NULL);
+	if (!version) return 0;
+	free(version);
 
-		const int pixmap_attributes[] = {
-			GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
-			GLX_TEXTURE_FORMAT_EXT, format, 0 // GLX_TEXTURE_FORMAT_RGB_EXT
-		};
+	cwm->shm_size = (size_t) wm->width * wm->height * 4;
+	cwm->shm_data = __cwm_create_shm_segment(cwm, cwm->shm_size, &cwm->shm_segment);
 
-		window_internal->x_pixmap = XCompositeNameWindowPixmap(cwm->wm->display, window->window);
-		window_internal->pixmap = glXCreatePixmap(cwm->wm->display, config, window_internal->x_pixmap, pixmap_attributes);
+	if (!cwm->shm_data) return 0;
+
+	// create the PBOs we upload from, if we can map them persistently
+	// they're the same size as the shared memory segment, so that copies can go at the same offset in both
+	// (the CPU compositor copies straight from the segment to its own buffers, so it doesn't need any)
+
+	if (cwm->backend == CWM_BACKEND_GL && GLEW_ARB_buffer_storage) {
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glGenBuffers(CWM_PBO_COUNT, cwm->pbos);
+
+		for (int i = 0; i < CWM_PBO_COUNT; i++) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, cwm->pbos[i]);
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, cwm->shm_size, NULL, flags);
+			cwm->pbo_data[i] = (unsigned char*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, cwm->shm_size, flags);
+		}
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		cwm->pbos_supported = 1;
 	}
 
-	cwm->glXBindTexImageEXT(cwm->wm->display, window_internal->pixmap, GLX_FRONT_LEFT_EXT, NULL);
+	return 1;
 }
 
-void cwm_unbind_window_texture(cwm_t* cwm, unsigned window_index) {
-	wm_window_t* window = &cwm->wm->windows[window_index];
-	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+static int __cwm_gl_failed(cwm_t* cwm, const char* message) {
+	// undo whatever '__cwm_setup_gl' got done before failing, so that the CPU compositor can start from scratch
 
-	cwm->glXReleaseTexImageEXT(cwm->wm->display, window_internal->pixmap, GLX_FRONT_LEFT_EXT);
-	if (!cwm->vsync) XUngrabServer(cwm->wm->display);
+	fprintf(stderr, "WARNING %s\n", message);
+
+	if (cwm->glx_context) {
+		glXMakeCurrent(cwm->wm->display, None, NULL);
+		glXDestroyContext(cwm->wm->display, cwm->glx_context);
+
+		cwm->glx_context = NULL;
+	}
+
+	if (cwm->output_window) {
+		XDestroyWindow(cwm->wm->display, cwm->output_window);
+		cwm->output_window = 0;
+	}
+
+	if (cwm->output_colormap) {
+		XFreeColormap(cwm->wm->display, cwm->output_colormap);
+		cwm->output_colormap = 0;
+	}
+
+	if (cwm->glx_configs) {
+		XFree(cwm->glx_configs);
+
+		cwm->glx_configs = NULL;
+		cwm->glx_config_count = 0;
+	}
+
+	// forget about whatever GLX features we found, as none of them apply to the CPU compositor
+
+	memset(cwm->pixmap_configs, 0, sizeof(cwm->pixmap_configs));
+
+	cwm->buffer_age_supported = 0;
+	cwm->glXCopySubBufferMESA = NULL;
+
+	return 0;
+}
+
+static int __cwm_setup_gl(cwm_t* cwm) {
+	// set up the output window and everything we need to draw to it with OpenGL, returning whether or not we can
+
+	wm_t* wm = cwm->wm;
+
+	// create the output window
+	// this window is where the actual drawing is going to happen
+
+	// we don't need multisampling, window corners are antialiased in the shader
+	// we do still need a depth buffer though, so that shadows don't draw over the windows above them
+
+	/* const */ int default_visual_attributes[] = {
+		GLX_RGBA, GLX_DOUBLEBUFFER,
+		GLX_RED_SIZE, 8,
+		GLX_GREEN_SIZE, 8,
+		GLX_BLUE_SIZE, 8,
+		GLX_ALPHA_SIZE, 8,
+		GLX_DEPTH_SIZE, 16, 0
+	};
+
+	XVisualInfo* default_visual = glXChooseVisual(wm->display, wm->screen, default_visual_attributes);
+	if (!default_visual) return __cwm_gl_failed(cwm, "Failed to get default GLX visual");
+
+	cwm->output_colormap = XCreateColormap(wm->display, wm->root_window, default_visual->visual, AllocNone);
+
+	XSetWindowAttributes attributes = {
+		.colormap = cwm->output_colormap,
+		.border_pixel = 0,
+	};
+
+	cwm->output_window = XCreateWindow(
+		wm->display, wm->root_window, 0, 0, wm->width, wm->height, 0, default_visual->depth,
+		InputOutput, default_visual->visual, CWBorderPixel | CWColormap, &attributes);
+
+	XFree(default_visual);
+
+	XReparentWindow(wm->display, cwm->output_window, cwm->overlay_window, 0, 0);
+	XMapRaised(wm->display, cwm->output_window);
+
+	// get the GLX frame buffer configurations that match our specified attributes
+	// generally we'll just be using the first one ('glx_configs[0]')
+
+	const int config_attributes[] = {
+		GLX_BIND_TO_TEXTURE_RGBA_EXT, 1,
+		GLX_BIND_TO_TEXTURE_TARGETS_EXT, GLX_TEXTURE_2D_BIT_EXT,
+		GLX_RENDER_TYPE, GLX_RGBA_BIT,
+		GLX_DRAWABLE_TYPE, GLX_PIXMAP_BIT,
+		GLX_X_VISUAL_TYPE, GLX_TRUE_COLOR,
+		GLX_X_RENDERABLE, 1,
+		GLX_FRAMEBUFFER_SRGB_CAPABLE_EXT, (GLint) GLX_DONT_CARE,
+		GLX_BUFFER_SIZE, 32,
+//		GLX_SAMPLE_BUFFERS, 1,
+//		GLX_SAMPLES, 4,
+		GLX_DOUBLEBUFFER, 1,
+		GLX_RED_SIZE, 8,
+		GLX_GREEN_SIZE, 8,
+		GLX_BLUE_SIZE, 8,
+		GLX_ALPHA_SIZE, 8,
+		GLX_STENCIL_SIZE, 0,
+		GLX_DEPTH_SIZE, 16, 0
+	};
+
+	cwm->glx_configs = glXChooseFBConfig(wm->display, wm->screen, config_attributes, &cwm->glx_config_count);
+	if (!cwm->glx_configs) return __cwm_gl_failed(cwm, "Failed to get GLX frame buffer configurations");
+
+	// find the frame buffer configurations we'll use to bind window pixmaps to textures, for each depth a window can have
+	// 32-bit windows have an actual alpha channel, so we bind them as RGBA
+	// for the others (generally 24-bit), the unused byte is garbage, so we must bind them as RGB (which gives us an alpha of 1 when sampling)
+
+	int all_config_count;
+	GLXFBConfig* all_configs = glXGetFBConfigs(wm->display, wm->screen, &all_config_count);
+
+	for (int i = 0; i < all_config_count; i++) {
+		GLXFBConfig config = all_configs[i];
+
+		int drawable_type, texture_targets, bind_rgb, bind_rgba;
+
+		glXGetFBConfigAttribChecked(wm->display, config, GLX_DRAWABLE_TYPE, &drawable_type);
+		glXGetFBConfigAttribChecked(wm->display, config, GLX_BIND_TO_TEXTURE_TARGETS_EXT, &texture_targets);
+		glXGetFBConfigAttribChecked(wm->display, config, GLX_BIND_TO_TEXTURE_RGB_EXT, &bind_rgb);
+		glXGetFBConfigAttribChecked(wm->display, config, GLX_BIND_TO_TEXTURE_RGBA_EXT, &bind_rgba);
+
+		if (!(drawable_type & GLX_PIXMAP_BIT)) continue;
+		if (!(texture_targets & GLX_TEXTURE_2D_BIT_EXT)) continue;
+
+		XVisualInfo* visual = glXGetVisualFromFBConfig(wm->display, config);
+		if (!visual) continue;
+
+		int depth = visual->depth;
+		XFree(visual);
+
+		if (depth > CWM_MAX_DEPTH || cwm->pixmap_configs[depth].valid) continue;
+
+		int has_alpha = depth == 32;
+		if (has_alpha ? !bind_rgba : !bind_rgb) continue;
+
+		cwm->pixmap_configs[depth].valid = 1;
+		cwm->pixmap_configs[depth].config = config;
+		cwm->pixmap_configs[depth].format = has_alpha ? GLX_TEXTURE_FORMAT_RGBA_EXT : GLX_TEXTURE_FORMAT_RGB_EXT;
+	}
+
+	XFree(all_configs);
+
+	// create our OpenGL context
+	// we must load the 'glXCreateContextAttribsARB' function ourselves
+
+	const int gl_version_attributes[] = { // we want OpenGL 3.3
+		GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
+		GLX_CONTEXT_MINOR_VERSION_ARB, 3,
+		GLX_CONTEXT_FLAGS_ARB, GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB, 0
+	};
+
+	glXCreateContextAttribsARB_t glXCreateContextAttribsARB = (glXCreateContextAttribsARB_t) glXGetProcAddressARB((const GLubyte*) "glXCreateContextAttribsARB");
+	if (!glXCreateContextAttribsARB) return __cwm_gl_failed(cwm, "Failed to load glXCreateContextAttribsARB");
+
+	cwm->glx_context = glXCreateContextAttribsARB(wm->display, cwm->glx_configs[0], NULL, 1, gl_version_attributes);
+	if (!cwm->glx_context) return __cwm_gl_failed(cwm, "Failed to create OpenGL context");
+
+	// load the other two functions we need but don't have
+
+	cwm->glXBindTexImageEXT = (glXBindTexImageEXT_t) glXGetProcAddress((const GLubyte*) "glXBindTexImageEXT");
+	cwm->glXReleaseTexImageEXT = (glXReleaseTexImageEXT_t) glXGetProcAddress((const GLubyte*) "glXReleaseTexImageEXT");
+
+	// check which extensions we can use to only repaint the parts of the screen that actually changed
+	// 'GLX_EXT_buffer_age' tells us how old the contents of the back buffer are, so we can redraw only what changed since then
+	// failing that, 'GLX_MESA_copy_sub_buffer' lets us never swap at all and copy the damaged parts of the back buffer to the front buffer ourselves
+
+	const char* glx_extensions = glXQueryExtensionsString(wm->display, wm->screen);
+
+	cwm->buffer_age_supported = !!strstr(glx_extensions, "GLX_EXT_buffer_age");
+
+	if (strstr(glx_extensions, "GLX_MESA_copy_sub_buffer")) {
+		cwm->glXCopySubBufferMESA = (glXCopySubBufferMESA_t) glXGetProcAddress((const GLubyte*) "glXCopySubBufferMESA");
+	}
+
+	// finally, make the context we just made the OpenGL context of this thread
+	glXMakeCurrent(wm->display, cwm->output_window, cwm->glx_context);
+
+	// initialize GLEW
+	// this will be needed for most modern OpenGL calls
+
+	glewExperimental = GL_TRUE;
+	if (glewInit() != GLEW_OK) return __cwm_gl_failed(cwm, "Failed to initialize GLEW");
+
+	// enable adaptive vsync (-1 for adaptive vsync, 1 for non-adaptive vsync, 0 for no vsync)
+	// this extension seems completely broken on NVIDIA
+
+	// glXSwapIntervalEXT_t glXSwapIntervalEXT = (glXSwapIntervalEXT_t) glXGetProcAddress((const GLubyte*) "glXSwapIntervalEXT");
+	// glXSwapIntervalEXT(wm->display, cwm->output_window, 0);
+
+	// create the fences we need to synchronize with X rendering, if we can
+	// they need to exist on the server before we can import them into OpenGL, hence the 'XSync'
+
+	if (GLEW_EXT_x11_sync_object && wm->sync_supported) {
+		for (int i = 0; i < CWM_FENCE_COUNT; i++) {
+			cwm->fences[i].x_fence = XSyncCreateFence(wm->display, wm->root_window, 0);
+		}
+
+		XSync(wm->display, 0);
+
+		for (int i = 0; i < CWM_FENCE_COUNT; i++) {
+			cwm->fences[i].gl_fence = glImportSyncEXT(GL_SYNC_X11_FENCE_EXT, cwm->fences[i].x_fence, 0);
+		}
+
+		cwm->fences_supported = 1;
+	}
+
+	return 1;
+}
+
+static void __cwm_setup_cpu(cwm_t* cwm) {
+	// set up the output window and the frame buffer the CPU compositor draws into (see 'soft.h')
+	// the frame buffer is shared with the server, so presenting it is just a matter of telling the server which parts to copy to the output window
+
+	wm_t* wm = cwm->wm;
+	cwm->backend = CWM_BACKEND_CPU;
+
+	// the frame buffer has the same layout as the contents of 24 and 32-bit windows, which is also what the root window has on pretty much every server
+
+	cwm->frame_depth = DefaultDepth(wm->display, wm->screen);
+	if (cwm->frame_depth != 24 && cwm->frame_depth != 32) wm_error(wm, "The CPU compositor only supports 24 and 32-bit screens");
+
+	// we never want the server to clear the output window, so it has no background (whatever we presented last stays there)
+
+	XSetWindowAttributes attributes = {
+		.border_pixel = 0,
+	};
+
+	cwm->output_window = XCreateWindow(
+		wm->display, wm->root_window, 0, 0, wm->width, wm->height, 0, CopyFromParent,
+		InputOutput, CopyFromParent, CWBorderPixel, &attributes);
+
+	XReparentWindow(wm->display, cwm->output_window, cwm->overlay_window, 0, 0);
+	XMapRaised(wm->display, cwm->output_window);
+
+	// window contents always go through MIT-SHM, as we need them in our own memory anyway
+
+	if (!__cwm_setup_shm(cwm)) wm_error(wm, "Can't use MIT-SHM, which the CPU compositor needs");
+	cwm->content_path = CWM_CONTENT_SHM;
+
+	cwm->frame_buffer = (uint32_t*) __cwm_create_shm_segment(cwm, (size_t) wm->width * wm->height * 4, &cwm->frame_segment);
+	if (!cwm->frame_buffer) wm_error(wm, "Failed to create the CPU compositor's frame buffer");
+
+	// graphics exposures are off, so that presenting doesn't send us any events
+
+	const uint32_t gc_values[] = { 0 };
+
+	cwm->frame_gc = xcb_generate_id(wm->connection);
+	xcb_create_gc(wm->connection, cwm->frame_gc, cwm->output_window, XCB_GC_GRAPHICS_EXPOSURES, gc_values);
+}
+
+void new_cwm(cwm_t* cwm, wm_t* wm) {
+	memset(cwm, 0, sizeof(*cwm));
+	cwm->wm = wm;
+
+	new_slab(&cwm->window_internals, sizeof(cwm_window_internal_t));
+
+	cwm->unredirected_window = -1;
+
+	// make it so that our compositing window manager can be recognized as such by other processes
+
+	Window screen_owner = XCreateSimpleWindow(wm->display, wm->root_window, 0, 0, 1, 1, 0, 0, 0);
+	Xutf8SetWMProperties(wm->display, screen_owner, "xcompmgr", "xcompmgr", NULL, 0, NULL, NULL, NULL);
+
+	char name[] = "_NET_WM_CM_S##";
+	snprintf(name, sizeof(name), "_NET_WM_CM_S%d", cwm->wm->screen);
+
+	Atom atom = XInternAtom(wm->display, name, 0);
+	XSetSelectionOwner(wm->display, atom, screen_owner, 0);
+
+	// we want to enable manual redirection, because we want to track damage and flush updates ourselves
+	// if we were to pass 'CompositeRedirectAutomatic' instead, the server would handle all that internally
+
+	XCompositeRedirectSubwindows(wm->display, wm->root_window, CompositeRedirectManual);
+
+	// tell the WM we're interested in damage events
+
+	int damage_error_base;
+	if (!XDamageQueryExtension(wm->display, &wm->damage_event_base, &damage_error_base)) wm_error(wm, "XDamage extension not available");
+
+	// get the overlay window
+	// this window allows us to draw what we want on a layer between normal windows and the screensaver without interference
+
+	cwm->overlay_window = XCompositeGetOverlayWindow(wm->display, wm->root_window);
+
+	// explained in more detail in the comment before '#include <X11/extensions/Xfixes.h>'
+	// basically, make the overlay transparent to events and pass them on through to lower windows
+
+	XserverRegion region = XFixesCreateRegion(wm->display, NULL, 0);
+	XFixesSetWindowShapeRegion(wm->display, cwm->overlay_window, ShapeInput, 0, 0, region);
+	XFixesDestroyRegion(wm->display, region);
+
+	cwm->vsync = 1;
+
+	// pick the backend (see 'cwm_backend_t')
+	// if we can't use OpenGL, we fall back to the CPU compositor rather than not drawing anything
+
+	const char* backend_string = getenv("CWM_BACKEND");
+
+	if (backend_string && !strcmp(backend_string, "cpu")) {
+		__cwm_setup_cpu(cwm);
+	}
+
+	else if (!__cwm_setup_gl(cwm)) {
+		fprintf(stderr, "WARNING Can't use OpenGL 3.3, falling back to the CPU compositor\n");
+		__cwm_setup_cpu(cwm);
+	}
+
+	// pick the content path (see 'cwm_content_path_t')
+	// if the MIT-SHM one was asked for but we can't use it, fall back to the default rather than not drawing anything
+
+	const char* content_path_string = getenv("CWM_CONTENT_PATH");
+
+	if (cwm->backend == CWM_BACKEND_GL && content_path_string && !strcmp(content_path_string, "shm")) {
+		if (__cwm_setup_shm(cwm)) cwm->content_path = CWM_CONTENT_SHM;
+		else fprintf(stderr, "WARNING Can't use MIT-SHM for window contents, falling back to texture-from-pixmap\n");
+	}
+
+	// blacklist the overlay and output windows for events
+
+	wm->event_blacklisted_windows = (Window*) realloc(wm->event_blacklisted_windows, (2 + wm->event_blacklisted_window_count) * sizeof(Window));
+
+	wm->event_blacklisted_windows[wm->event_blacklisted_window_count + 0] = cwm->overlay_window;
+	wm->event_blacklisted_windows[wm->event_blacklisted_window_count + 1] = cwm->output_window;
+	// wm->event_blacklisted_windows[wm->event_blacklisted_window_count + 2] = screen_owner;
+
+	wm->event_blacklisted_window_count += 2;
+
+	// setup the timing code (window managers don't seem to be able to vsync)
+	// the frame rate can be overridden with the 'CWM_FRAME_RATE' environment variable
+
+	cwm->previous_frame_time = cwm_now();
+
+	const char* frame_rate_string = getenv("CWM_FRAME_RATE");
+	float frame_rate_override = frame_rate_string ? atof(frame_rate_string) : 0;
+
+	// setup our outputs, one for each monitor
+	// if we don't know about any monitors (e.g. Xinerama isn't there), the whole screen is a single output
+
+	cwm->output_count = MAX(wm->monitor_count, 1);
+	cwm->outputs = (cwm_output_t*) calloc(cwm->output_count, sizeof(*cwm->outputs));
+
+	cwm->frame_interval = UINT64_MAX;
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		cwm_output_t* output = &cwm->outputs[i];
+		float frame_rate = wm->refresh_rate;
+
+		if (wm->monitor_count) {
+			XineramaScreenInfo* info = &wm->monitor_infos[i];
+
+			output->rect = (cwm_rect_t) { info->x_org, info->y_org, info->width, info->height };
+			frame_rate = wm_monitor_refresh_rate(wm, i);
+		}
+
+		else {
+			output->rect = (cwm_rect_t) { 0, 0, wm->width, wm->height };
+		}
+
+		if (frame_rate_override > 0) {
+			frame_rate = frame_rate_override;
+		}
+
+		output->frame_interval = (uint64_t) (1000000 / frame_rate);
+		output->next_frame_time = 0; // draw the first frame straight away
+
+		cwm->frame_interval = MIN(cwm->frame_interval, output->frame_interval);
+
+		// we obviously need to draw the whole first frame
+
+		cwm_damage_add(&output->damage, output->rect);
+	}
+
+	cwm->needs_repaint = 1;
+}
+
+void cwm_request_repaint(cwm_t* cwm) {
+	cwm->needs_repaint = 1;
+}
+
+void cwm_damage_rect(cwm_t* cwm, int x, int y, int width, int height) {
+	// clip the rectangle to the screen before adding it to this frame's damage
+
+	int x1 = MAX(x, 0);
+	int y1 = MAX(y, 0);
+
+	int x2 = MIN(x + width,  (int) cwm->wm->width);
+	int y2 = MIN(y + height, (int) cwm->wm->height);
+
+	if (x2 <= x1 || y2 <= y1) return;
+
+	// then split it up between the outputs it's on, so that each of them only redraws what changed on it
+	// anything not on any output isn't visible anyway
+
+	cwm_rect_t rect = { x1, y1, x2 - x1, y2 - y1 };
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		cwm_output_t* output = &cwm->outputs[i];
+		cwm_rect_t output_rect = cwm_rect_intersection(rect, output->rect);
+
+		if (cwm_rect_area(output_rect)) {
+			cwm_damage_add(&output->damage, output_rect);
+			cwm->needs_repaint = 1;
+		}
+	}
+}
+
+void cwm_damage_whole_screen(cwm_t* cwm) {
+	cwm_damage_rect(cwm, 0, 0, cwm->wm->width, cwm->wm->height);
+}
+
+cwm_damage_t* cwm_repaint_region(cwm_t* cwm) {
+	// work out which parts of the back buffer we actually need to redraw this frame
+	// this must be called once per frame, after all the damage for the frame has been added
+
+	// only draw the outputs which changed and whose deadline has passed
+	// the others are left as they are, along with their damage, which we'll get to once they're due
+
+	uint64_t now = cwm_now();
+	cwm->damage = (cwm_damage_t) { 0 };
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		cwm_output_t* output = &cwm->outputs[i];
+		output->due = output->damage.rect_count && now >= output->next_frame_time;
+
+		if (output->due) {
+			cwm_damage_union(&cwm->damage, &output->damage);
+			output->damage = (cwm_damage_t) { 0 };
+		}
+	}
+
+	cwm->repaint = cwm->damage;
+
+	// the CPU compositor's frame buffer always holds what we drew last frame, so only what changed needs to be redrawn
+
+	if (cwm->backend == CWM_BACKEND_CPU) {
+		return &cwm->repaint;
+	}
+
+	if (cwm->buffer_age_supported) {
+		unsigned age = 0;
+		glXQueryDrawable(cwm->wm->display, cwm->output_window, GLX_BACK_BUFFER_AGE_EXT, &age);
+
+		// an age of 0 means the contents of the back buffer are undefined
+		// an age of n means the back buffer contains what we drew n frames ago, so we need to repair the damage of the last n - 1 frames too
+
+		if (!age || age > CWM_DAMAGE_HISTORY + 1) {
+			cwm->repaint = (cwm_damage_t) { 0 };
+			cwm_damage_add(&cwm->repaint, (cwm_rect_t) { 0, 0, cwm->wm->width, cwm->wm->height });
+		}
+
+		else for (unsigned i = 0; i < age - 1; i++) {
+			cwm_damage_union(&cwm->repaint, &cwm->damage_history[i]);
+		}
+	}
+
+	// if we can't use 'glXCopySubBufferMESA' either, there's no way of knowing what's in the back buffer, so redraw everything
+
+	else if (!cwm->glXCopySubBufferMESA && cwm->repaint.rect_count) {
+		cwm->repaint = (cwm_damage_t) { 0 };
+		cwm_damage_add(&cwm->repaint, (cwm_rect_t) { 0, 0, cwm->wm->width, cwm->wm->height });
+	}
+
+	return &cwm->repaint;
+}
+
+void cwm_scissor(cwm_t* cwm, cwm_rect_t rect) {
+	// OpenGL window coordinates start from the bottom left
+	glScissor(rect.x, cwm->wm->height - rect.y - rect.height, rect.width, rect.height);
+}
+
+static uint64_t __cwm_next_frame_time(cwm_t* cwm) {
+	// when we next need to draw a frame, i.e. the earliest deadline out of all the outputs which changed
+	// if none did yet (e.g. a window animation which hasn't damaged anything yet), go by the outputs we drew last, since that's most likely where it's happening
+
+	uint64_t damaged = UINT64_MAX;
+	uint64_t drawn = UINT64_MAX;
+	uint64_t any = UINT64_MAX;
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		cwm_output_t* output = &cwm->outputs[i];
+
+		if (output->damage.rect_count) damaged = MIN(damaged, output->next_frame_time);
+		if (output->due) drawn = MIN(drawn, output->next_frame_time);
+
+		any = MIN(any, output->next_frame_time);
+	}
+
+	if (damaged != UINT64_MAX) return damaged;
+	if (drawn != UINT64_MAX) return drawn;
+
+	return any;
+}
+
+static void __cwm_update_needs_repaint(cwm_t* cwm) {
+	// outputs which weren't due this frame still have their damage, so we'll need another frame for them
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		if (cwm->outputs[i].damage.rect_count) {
+			cwm->needs_repaint = 1;
+		}
+	}
+}
+
+int cwm_frame_timeout(cwm_t* cwm) {
+	// how long (in milliseconds) we can block waiting for events before we need to start drawing the next frame
+	// if nothing needs repainting, we can block until something happens (-1)
+
+	if (!cwm->needs_repaint) {
+		cwm->idle = 1;
+		return -1;
+	}
+
+	uint64_t now = cwm_now();
+	uint64_t next_frame_time = __cwm_next_frame_time(cwm);
+
+	if (now >= next_frame_time) {
+		return 0;
+	}
+
+	return (next_frame_time - now + 999) / 1000; // round up, it's better to be a tad late than to wake up for nothing
+}
+
+int cwm_frame_due(cwm_t* cwm) {
+	return cwm->needs_repaint && cwm_now() >= __cwm_next_frame_time(cwm);
+}
+
+void cwm_skip_frame(cwm_t* cwm) {
+	// we're not drawing a frame we would otherwise have drawn (e.g. because everything is covered by an unredirected window)
+	// this only counts if a frame was actually due, so that waking up for events which don't change anything on screen isn't counted as skipping a frame
+
+	if (cwm_frame_due(cwm)) {
+		cwm->skipped_frame_count++;
+	}
+}
+
+void cwm_defer_frame(cwm_t* cwm) {
+	// we were due to draw a frame, but nothing changed on any of the outputs which were due (e.g. a window animating off-screen)
+	// push their deadlines back by a frame so we don't spin, and keep the damage of the others for when they're due
+
+	uint64_t now = cwm_now();
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		cwm_output_t* output = &cwm->outputs[i];
+
+		if (now >= output->next_frame_time) {
+			output->next_frame_time = now + output->frame_interval;
+		}
+	}
+
+	cwm->skipped_frame_count++;
+	__cwm_update_needs_repaint(cwm);
+}
+
+static void __cwm_present_frame_buffer(cwm_t* cwm) {
+	// have the server copy the parts of the CPU compositor's frame buffer we redrew to the output window
+	// these copies happen whenever the server gets to them, so we follow them up with a request which has a reply, and wait for that before touching the frame buffer again (see 'cwm_frame_buffer')
+
+	xcb_connection_t* connection = cwm->wm->connection;
+
+	for (int i = 0; i < cwm->repaint.rect_count; i++) {
+		cwm_rect_t rect = cwm->repaint.rects[i];
+
+		xcb_shm_put_image(connection, cwm->output_window, cwm->frame_gc, cwm->wm->width, cwm->wm->height,
+			rect.x, rect.y, rect.width, rect.height, rect.x, rect.y,
+			cwm->frame_depth, XCB_IMAGE_FORMAT_Z_PIXMAP, 0, cwm->frame_segment, 0);
+	}
+
+	cwm->present_cookie = xcb_get_input_focus(connection);
+	cwm->present_pending = 1;
+
+	xcb_flush(connection);
+}
+
+uint32_t* cwm_frame_buffer(cwm_t* cwm) {
+	// returns the CPU compositor's frame buffer (one 32-bit pixel per pixel of the screen, with no padding between rows), once it's safe to draw to it
+
+	if (cwm->present_pending) {
+		free(xcb_get_input_focus_reply(cwm->wm->connection, cwm->present_cookie, NULL));
+		cwm->present_pending = 0;
+	}
+
+	return cwm->frame_buffer;
+}
+
+uint64_t cwm_swap(cwm_t* cwm) {
+	// if we have to manage the front buffer ourselves, only copy over the parts of the back buffer we redrew
+	// otherwise, swap as usual (the back buffer has already been repaired according to its age)
+	// either way, this presents every output at once, synced to whichever one the driver picks, so outputs with other refresh rates don't actually get their own cadence
+
+	if (cwm->backend == CWM_BACKEND_CPU) {
+		__cwm_present_frame_buffer(cwm);
+	}
+
+	else if (!cwm->buffer_age_supported && cwm->glXCopySubBufferMESA) {
+		for (int i = 0; i < cwm->repaint.rect_count; i++) {
+			cwm_rect_t rect = cwm->repaint.rects[i];
+			cwm->glXCopySubBufferMESA(cwm->wm->display, cwm->output_window, rect.x, cwm->wm->height - rect.y - rect.height, rect.width, rect.height);
+		}
+	}
+
+	else {
+		glXSwapBuffers(cwm->wm->display, cwm->output_window);
+	}
+
+	cwm->rendered_frame_count++;
+
+	// remember this frame's damage for the next few frames and start afresh
+
+	memmove(&cwm->damage_history[1], &cwm->damage_history[0], (CWM_DAMAGE_HISTORY - 1) * sizeof(*cwm->damage_history));
+	cwm->damage_history[0] = cwm->damage;
+
+	cwm->damage = (cwm_damage_t) { 0 };
+
+	// schedule the next frame of each of the outputs we just drew
+	// if we're running late, don't try to catch up by drawing frames back to back
+
+	uint64_t now = cwm_now();
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		cwm_output_t* output = &cwm->outputs[i];
+		if (!output->due) continue;
+
+		output->next_frame_time += output->frame_interval;
+
+		if (output->next_frame_time < now) {
+			output->next_frame_time = now;
+		}
+
+		output->rendered_frame_count++;
+	}
+
+	__cwm_update_needs_repaint(cwm);
+
+	// return the time in microseconds between this frame and the last
+	// if we were idle since the last frame, pretend it was just one frame ago so that animations don't jump
+
+	int64_t delta = now - cwm->previous_frame_time;
+
+	if (cwm->idle) {
+		delta = cwm->frame_interval;
+		cwm->idle = 0;
+	}
+
+	cwm->previous_frame_time = now;
+	return delta;
+}
+
+static cwm_window_internal_t* cwm_get_window_internal(cwm_t* cwm, wm_window_t* window) {
+	cwm_window_internal_t* window_internal = (cwm_window_internal_t*) window->internal;
+
+	// slab slots never move, so it's fine for the window to keep a pointer to its slot
+
+	if (!window_internal) {
+		int slot = slab_alloc(&cwm->window_internals);
+
+		window_internal = (cwm_window_internal_t*) slab_get(&cwm->window_internals, slot);
+		window_internal->slot = slot;
+
+		window->internal = (void*) window_internal;
+	}
+
+	return window_internal;
+}
+
+static inline int __cwm_window_uses_shm(cwm_t* cwm, wm_window_t* window) {
+	// we only know how to upload 24 and 32-bit windows ourselves (which is pretty much all of them), anything else goes through texture-from-pixmap
+
+	return cwm->content_path == CWM_CONTENT_SHM && (window->depth == 24 || window->depth == 32);
+}
+
+static inline void __cwm_free_pixmap(cwm_t* cwm, cwm_window_internal_t* window_internal) {
+	if (window_internal->x_pixmap) {
+		cwm->pixmap_destruction_count++;
+
+		XFreePixmap(cwm->wm->display, window_internal->x_pixmap);
+		window_internal->x_pixmap = 0;
+	}
+
+	if (window_internal->pixmap) {
+		glXDestroyPixmap(cwm->wm->display, window_internal->pixmap);
+		window_internal->pixmap = 0;
+	}
+}
+
+// unredirection functions
+
+int cwm_window_covers_output(cwm_t* cwm, unsigned window_index, cwm_rect_t* output) {
+	// returns whether or not the window covers a whole output (either a single monitor or the whole screen), and which one if so
+	// this uses the window's actual geometry, not where we're drawing it, since that's what matters once it isn't redirected anymore
+
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_rect_t rect = { window->x, window->y, window->width, window->height };
+
+	cwm_rect_t screen = { 0, 0, cwm->wm->width, cwm->wm->height };
+	cwm_rect_t union_rect = cwm_rect_union(rect, screen);
+
+	if (!memcmp(&union_rect, &rect, sizeof(rect))) {
+		*output = screen;
+		return 1;
+	}
+
+	for (int i = 0; i < cwm->wm->monitor_count; i++) {
+		XineramaScreenInfo* info = &cwm->wm->monitor_infos[i];
+
+		cwm_rect_t monitor = { info->x_org, info->y_org, info->width, info->height };
+		union_rect = cwm_rect_union(rect, monitor);
+
+		if (!memcmp(&union_rect, &rect, sizeof(rect))) {
+			*output = monitor;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void __cwm_restore_overlay(cwm_t* cwm) {
+	// give the overlay window its full shape back
+	// neither it nor the output window have a background, so whatever is on screen stays there until we draw over it (no flash)
+
+	XFixesSetWindowShapeRegion(cwm->wm->display, cwm->overlay_window, ShapeBounding, 0, 0, None);
+
+	cwm->unredirected_window = -1;
+	cwm->suspended = 0;
+
+	// we haven't drawn the unredirected output for a while, so repaint it straight away
+
+	cwm_damage_rect(cwm, cwm->unredirected_output.x, cwm->unredirected_output.y, cwm->unredirected_output.width, cwm->unredirected_output.height);
+
+	for (int i = 0; i < cwm->output_count; i++) {
+		if (cwm_rect_intersects(cwm->outputs[i].rect, cwm->unredirected_output)) {
+			cwm->outputs[i].next_frame_time = 0;
+		}
+	}
+}
+
+void cwm_unredirect_window(cwm_t* cwm, unsigned window_index, cwm_rect_t output) {
+	// let the window draw straight to the screen, bypassing us completely
+
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = (cwm_window_internal_t*) window->internal;
+
+	if (cwm->unredirected_window >= 0) return;
+
+	// the server copies the window's contents back to the screen when unredirecting it, so it's already there when we cut its output out of the overlay
+	// the window's pixmap is gone after this, so we need to free ours
+
+	XCompositeUnredirectWindow(cwm->wm->display, window->window, CompositeRedirectManual);
+	if (window_internal) __cwm_free_pixmap(cwm, window_internal);
+
+	XserverRegion region = XFixesCreateRegion(cwm->wm->display, &(XRectangle) { 0, 0, cwm->wm->width, cwm->wm->height }, 1);
+	XserverRegion output_region = XFixesCreateRegion(cwm->wm->display, &(XRectangle) { output.x, output.y, output.width, output.height }, 1);
+
+	XFixesSubtractRegion(cwm->wm->display, region, region, output_region);
+	XFixesSetWindowShapeRegion(cwm->wm->display, cwm->overlay_window, ShapeBounding, 0, 0, region);
+
+	XFixesDestroyRegion(cwm->wm->display, region);
+	XFixesDestroyRegion(cwm->wm->display, output_region);
+
+	cwm->unredirected_window = window_index;
+	cwm->unredirected_output = output;
+
+	cwm->suspended = output.x <= 0 && output.y <= 0 && output.width >= (int) cwm->wm->width && output.height >= (int) cwm->wm->height;
+	cwm->unredirection_count++;
+}
+
+void cwm_redirect_window(cwm_t* cwm) {
+	// start compositing the unredirected window again
+	// the overlay must cover the window before we redirect it, or else we'd see the root window through the hole it leaves
+
+	if (cwm->unredirected_window < 0) return;
+	wm_window_t* window = wm_get_window(cwm->wm, cwm->unredirected_window);
+
+	__cwm_restore_overlay(cwm);
+
+	// the server gives the window a new pixmap with a copy of its current contents, so we can draw it straight away
+
+	XCompositeRedirectWindow(cwm->wm->display, window->window, CompositeRedirectManual);
+}
+
+// event handler functions
+
+void cwm_create_event(cwm_t* cwm, unsigned window_index) {
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	// we want to know exactly which parts of the window changed, so that we only need to repaint those
+
+	window_internal->damage = XDamageCreate(cwm->wm->display, window->window, XDamageReportDeltaRectangles);
+	cwm->needs_repaint = 1;
+}
+
+void cwm_modify_event(cwm_t* cwm, unsigned window_index) {
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	// delete pixmap if the window's storage changed, since we're gonna need to update it
+	// the server allocates a new pixmap for the window each time it's mapped, but just moving it or changing its stacking order doesn't affect it
+	// (resizing is dealt with in 'cwm_bind_window_texture', as we might want to hold on to the old pixmap for a bit)
+
+	if (window->visible != window_internal->visible) {
+		__cwm_free_pixmap(cwm, window_internal);
+	}
+
+	window_internal->visible = window->visible;
+
+	// if the unredirected window was hidden or doesn't cover its output anymore, go back to compositing it
+	// (just restacking it doesn't change anything, so we don't want to go through all that each time it's raised)
+
+	cwm_rect_t output;
+
+	if (window_index == cwm->unredirected_window && (!window->visible || !cwm_window_covers_output(cwm, window_index, &output) || memcmp(&output, &cwm->unredirected_output, sizeof(output)))) {
+		cwm_redirect_window(cwm);
+	}
+
+	cwm->needs_repaint = 1;
+}
+
+void cwm_destroy_event(cwm_t* cwm, unsigned window_index, int destroyed) {
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	// if the window was destroyed, the server already freed the damage object along with it
+	// otherwise (the window was reparented away from the root window), it still exists, so we have to free it ourselves, or else we'd leak it (and create a second one if the window ever comes back)
+	// either way, there's no need to redirect the window if it was unredirected, as we only redirect the root window's children
+
+	if (!destroyed && window_internal->damage) {
+		XDamageDestroy(cwm->wm->display, window_internal->damage);
+	}
+
+	if (window_index == cwm->unredirected_window) {
+		__cwm_restore_overlay(cwm);
+	}
+
+	__cwm_free_pixmap(cwm, window_internal);
+
+	if (window_internal->texture) {
+		glDeleteTextures(1, &window_internal->texture);
+	}
+
+	free(window_internal->pixels);
+
+	slab_free(&cwm->window_internals, window_internal->slot);
+
+	window->internal = NULL;
+	cwm->needs_repaint = 1;
+}
+
+void cwm_damage_event(cwm_t* cwm, unsigned window_index, int x, int y, int width, int height) {
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	// with the MIT-SHM content path, remember which part of the window changed (relative to its contents), so that we only copy that part next time we bind it
+
+	if (__cwm_window_uses_shm(cwm, window)) {
+		cwm_damage_add(&window_internal->content_damage, (cwm_rect_t) { x, y, width, height });
+	}
+
+	// the damage is only acknowledged once per frame, however many events the window sends us in the meantime
+
+	if (!window_internal->damage_unacknowledged) {
+		window_internal->damage_unacknowledged = 1;
+
+		if (cwm->damaged_window_count >= cwm->damaged_window_capacity) {
+			cwm->damaged_window_capacity = MAX(16, cwm->damaged_window_capacity * 2);
+			cwm->damaged_windows = (unsigned*) realloc(cwm->damaged_windows, cwm->damaged_window_capacity * sizeof(*cwm->damaged_windows));
+		}
+
+		cwm->damaged_windows[cwm->damaged_window_count++] = window_index;
+	}
+
+	cwm->needs_repaint = 1;
+}
+
+// rendering functions
+
+int cwm_window_opaque(cwm_t* cwm, unsigned window_index) {
+	// returns whether or not the window's contents are known to be completely opaque, i.e. whether it hides everything below it
+	// windows without an alpha channel are always opaque, but we can't know for 32-bit windows without looking at their contents, so we assume they aren't
+
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+
+	if (!window->exists)  return 0;
+	if (!window->visible) return 0;
+
+	if (window->depth <= 0 || window->depth > CWM_MAX_DEPTH) return 0;
+	if (__cwm_window_uses_shm(cwm, window)) return window->depth == 24;
+	if (!cwm->pixmap_configs[window->depth].valid) return 0; // we won't be able to draw it anyway
+
+	return cwm->pixmap_configs[window->depth].format == GLX_TEXTURE_FORMAT_RGB_EXT;
+}
+
+static void __cwm_reset_fence(cwm_t* cwm, cwm_fence_t* fence, int wait) {
+	if (!fence->triggered) return;
+
+	// we can't reset the fence while the GPU might still be waiting on it
+	// if we're not allowed to wait for it and it isn't done yet, we'll just try again next frame
+
+	GLenum status = glClientWaitSync(fence->done_fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 /* 1 second */ : 0);
+	if (status == GL_TIMEOUT_EXPIRED) return;
+
+	glDeleteSync(fence->done_fence);
+	fence->done_fence = 0;
+
+	XSyncResetFence(cwm->wm->display, fence->x_fence);
+	fence->triggered = 0;
+}
+
+static void __cwm_acknowledge_damage(cwm_t* cwm) {
+	// with 'XDamageReportDeltaRectangles', the server only tells us about damage outside of the window's damage region, so we have to empty it for the next changes to be reported
+	// this must be done before we read any window contents, or else whatever changed in between would never be reported again
+	// windows which were destroyed (or reparented away) since their damage event don't have a damage object anymore
+
+	for (int i = 0; i < cwm->damaged_window_count; i++) {
+		wm_window_t* window = wm_get_window(cwm->wm, cwm->damaged_windows[i]);
+		if (!window->exists || !window->internal) continue;
+
+		cwm_window_internal_t* window_internal = (cwm_window_internal_t*) window->internal;
+		if (!window_internal->damage_unacknowledged) continue;
+
+		window_internal->damage_unacknowledged = 0;
+		XDamageSubtract(cwm->wm->display, window_internal->damage, None, None);
+	}
+
+	cwm->damaged_window_count = 0;
+}
+
+void cwm_begin_window_binds(cwm_t* cwm) {
+	// call this once per frame, before binding any windows
+	// it makes sure that everything the server was asked to draw so far (including what clients drew in their windows) is done before the GPU samples any window
+	// this only costs us one request, and unlike grabbing the server, it doesn't stop anyone else from drawing in the meantime
+
+	__cwm_acknowledge_damage(cwm);
+
+	if (!cwm->vsync) XGrabServer(cwm->wm->display);
+	if (!cwm->fences_supported) return;
+
+	cwm_fence_t* fence = &cwm->fences[cwm->current_fence];
+
+	// this fence should have been reset a couple of frames ago, but if the GPU is really far behind, we have no choice but to wait for it
+	// we then also have to wait for the server to process the reset, or else we might see the fence as still triggered from last time
+
+	if (fence->triggered) {
+		__cwm_reset_fence(cwm, fence, 1);
+		XSync(cwm->wm->display, 0);
+	}
+
+	XSyncTriggerFence(cwm->wm->display, fence->x_fence);
+	XFlush(cwm->wm->display);
+
+	glWaitSync(fence->gl_fence, 0, GL_TIMEOUT_IGNORED);
+	fence->triggered = 1;
+}
+
+void cwm_end_window_binds(cwm_t* cwm) {
+	// call this once per frame, after unbinding all windows
+
+	if (!cwm->vsync) XUngrabServer(cwm->wm->display);
+	if (!cwm->fences_supported) return;
+
+	cwm_fence_t* fence = &cwm->fences[cwm->current_fence];
+	fence->done_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	cwm->current_fence = (cwm->current_fence + 1) % CWM_FENCE_COUNT;
+
+	// reset the fence we used half a cycle ago, which is also the one we'll use half a cycle from now
+
+	__cwm_reset_fence(cwm, &cwm->fences[(cwm->current_fence + CWM_FENCE_COUNT / 2) % CWM_FENCE_COUNT], 0);
+}
+
+static void __cwm_finish_cpu_copies(cwm_t* cwm) {
+	// same as 'cwm_finish_window_binds', but for the CPU compositor, which keeps window contents in its own memory instead of in textures
+
+	for (int i = 0; i < cwm->shm_copy_count; i++) {
+		cwm_shm_copy_t* copy = &cwm->shm_copies[i];
+
+		xcb_generic_error_t* error = NULL;
+		xcb_shm_get_image_reply_t* reply = xcb_shm_get_image_reply(cwm->wm->connection, copy->cookie, &error);
+
+		free(error);
+		if (!reply) continue;
+		free(reply);
+
+		const uint32_t* source = (const uint32_t*) (cwm->shm_data + copy->offset);
+		uint32_t* destination = copy->pixels + (size_t) copy->rect.y * copy->pixels_width + copy->rect.x;
+
+		for (int y = 0; y < copy->rect.height; y++) {
+			memcpy(destination, source, copy->rect.width * 4);
+
+			source += copy->rect.width;
+			destination += copy->pixels_width;
+		}
+
+		cwm->uploaded_byte_count += (size_t) copy->rect.width * copy->rect.height * 4;
+	}
+
+	cwm->shm_copy_count = 0;
+	cwm->shm_used = 0;
+}
+
+void cwm_finish_window_binds(cwm_t* cwm) {
+	// call this once per frame, after binding all windows and before drawing any of them
+	// with the MIT-SHM content path, this waits for the server to be done with the copies we asked for, and uploads them to the windows' textures
+	// only the damaged parts ever cross the memory bus: once from the server into the shared memory segment, and once from there into a PBO the GPU reads from asynchronously
+
+	if (!cwm->shm_copy_count) return;
+
+	if (cwm->backend == CWM_BACKEND_CPU) {
+		__cwm_finish_cpu_copies(cwm);
+		return;
+	}
+
+	xcb_connection_t* connection = cwm->wm->connection;
+
+	// make sure the GPU is done uploading from the PBO we're about to overwrite
+
+	int pbo = cwm->current_pbo;
+
+	if (cwm->pbos_supported) {
+		if (cwm->pbo_fences[pbo]) {
+			glClientWaitSync(cwm->pbo_fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 /* 1 second */);
+			glDeleteSync(cwm->pbo_fences[pbo]);
+
+			cwm->pbo_fences[pbo] = 0;
+		}
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, cwm->pbos[pbo]);
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+
+	for (int i = 0; i < cwm->shm_copy_count; i++) {
+		cwm_shm_copy_t* copy = &cwm->shm_copies[i];
+
+		// the reply only comes once the server is done writing to the segment
+		// if the copy failed (e.g. the window was destroyed in the meantime), there's nothing to upload
+
+		xcb_generic_error_t* error = NULL;
+		xcb_shm_get_image_reply_t* reply = xcb_shm_get_image_reply(connection, copy->cookie, &error);
+
+		free(error);
+		if (!reply) continue;
+		free(reply);
+
+		size_t size = (size_t) copy->rect.width * copy->rect.height * 4;
+		const void* pixels = cwm->shm_data + copy->offset;
+
+		// the PBO is mapped coherently, so the GPU sees what we write to it without us having to flush anything
+
+		if (cwm->pbos_supported) {
+			memcpy(cwm->pbo_data[pbo] + copy->offset, pixels, size);
+			pixels = (const void*) copy->offset;
+		}
+
+		glBindTexture(GL_TEXTURE_2D, copy->texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, copy->rect.x, copy->rect.y, copy->rect.width, copy->rect.height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+
+		cwm->uploaded_byte_count += size;
+	}
+
+	if (cwm->pbos_supported) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		cwm->pbo_fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		cwm->current_pbo = (pbo + 1) % CWM_PBO_COUNT;
+	}
+
+	cwm->shm_copy_count = 0;
+	cwm->shm_used = 0;
+}
+
+static void __cwm_queue_shm_copy(cwm_t* cwm, cwm_window_internal_t* window_internal, cwm_rect_t rect) {
+	// ask the server to copy part of the window's pixmap into the shared memory segment
+	// we don't wait for it to be done here, so that all the copies of a frame only cost us a single round trip (see 'cwm_finish_window_binds')
+
+	xcb_connection_t* connection = cwm->wm->connection;
+
+	// split the rectangle into bands of rows which each fit in the segment (only really matters for windows bigger than the screen)
+
+	int stride = rect.width * 4;
+	int max_rows = cwm->shm_size / stride;
+
+	if (max_rows < 1) return;
+
+	for (int y = rect.y; y < rect.y + rect.height; y += max_rows) {
+		int rows = MIN(max_rows, rect.y + rect.height - y);
+		size_t size = (size_t) rows * stride;
+
+		// out of space for this frame, so upload what we have so far to make room
+
+		if (cwm->shm_used + size > cwm->shm_size) {
+			cwm_finish_window_binds(cwm);
+		}
+
+		if (cwm->shm_copy_count >= cwm->shm_copy_capacity) {
+			cwm->shm_copy_capacity = MAX(16, cwm->shm_copy_capacity * 2);
+			cwm->shm_copies = (cwm_shm_copy_t*) realloc(cwm->shm_copies, cwm->shm_copy_capacity * sizeof(*cwm->shm_copies));
+		}
+
+		cwm_shm_copy_t* copy = &cwm->shm_copies[cwm->shm_copy_count++];
+
+		copy->texture = window_internal->texture;
+		copy->pixels = window_internal->pixels;
+		copy->pixels_width = window_internal->texture_width;
+		copy->rect = (cwm_rect_t) { rect.x, y, rect.width, rows };
+		copy->offset = cwm->shm_used;
+
+		copy->cookie = xcb_shm_get_image(connection, window_internal->x_pixmap, rect.x, y, rect.width, rows, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, cwm->shm_segment, copy->offset);
+		cwm->shm_used += size;
+	}
+}
+
+static void __cwm_update_shm_texture(cwm_t* cwm, wm_window_t* window, cwm_window_internal_t* window_internal) {
+	// (re)allocate the texture if the pixmap changed size, in which case all of it needs to be copied again
+
+	// this always goes by the pixmap we're holding on to, so while it's being kept around during a resize, the texture stays at its size too (and gets stretched like with texture-from-pixmap)
+
+	int width  = window_internal->pixmap_width;
+	int height = window_internal->pixmap_height;
+
+	if (window_internal->texture_width != width || window_internal->texture_height != height) {
+		window_internal->texture_width  = width;
+		window_internal->texture_height = height;
+
+		// like with texture-from-pixmap, the unused byte of 24-bit windows is garbage, so the texture mustn't have an alpha channel
+
+		if (cwm->backend == CWM_BACKEND_CPU) {
+			free(window_internal->pixels);
+			window_internal->pixels = (uint32_t*) malloc((size_t) width * height * 4);
+		}
+
+		else {
+			GLint internal_format = window->depth == 32 ? GL_RGBA8 : GL_RGB8;
+			glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+		}
+
+		window_internal->content_damage.rect_count = 0;
+		cwm_damage_add(&window_internal->content_damage, (cwm_rect_t) { 0, 0, width, height });
+	}
+
+	// queue up copies of everything which changed since last time
+	// damage is reported at the window's current size, so anything outside of the pixmap we have (e.g. the new parts of a window whose resize we're still waiting on) can't be copied yet
+
+	cwm_rect_t bounds = { 0, 0, width, height };
+
+	for (int i = 0; i < window_internal->content_damage.rect_count; i++) {
+		cwm_rect_t rect = cwm_rect_intersection(window_internal->content_damage.rects[i], bounds);
+		if (rect.width <= 0 || rect.height <= 0) continue;
+
+		__cwm_queue_shm_copy(cwm, window_internal, rect);
+	}
+
+	window_internal->content_damage.rect_count = 0;
+}
+
+int cwm_bind_window_texture(cwm_t* cwm, unsigned window_index, unsigned texture_unit) {
+	// binds the window's contents to texture unit 'texture_unit'
+	// returns whether or not the window's texture could be bound (if not, don't try drawing it or unbinding it!)
+	// with the MIT-SHM content path, the texture is only up to date once 'cwm_finish_window_binds' has been called
+
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	if (!window->exists)  return 0;
+	if (!window->visible) return 0;
+
+	// unredirected windows don't have a pixmap we can bind (and they're drawn straight to the screen anyway)
+
+	if (window_index == cwm->unredirected_window) return 0;
+
+	// find the frame buffer configuration for the window's depth (we already got that when the window was created)
+
+	if (window->depth <= 0 || window->depth > CWM_MAX_DEPTH) return 0;
+	cwm_pixmap_config_t* pixmap_config = &cwm->pixmap_configs[window->depth];
+
+	int uses_shm = __cwm_window_uses_shm(cwm, window);
+	if (!uses_shm && !pixmap_config->valid) return 0;
+
+	// the server also allocates a new pixmap for the window each time it's resized
+	// while the client is still drawing at its new size though, that pixmap is garbage, so keep using the old one (stretched to the new size) until the client tells us it's done
+
+	if (window_internal->x_pixmap && (window->width != window_internal->width || window->height != window_internal->height) && !wm_window_busy(cwm->wm, window_index)) {
+		__cwm_free_pixmap(cwm, window_internal);
+	}
+
+	// update the window's pixmap
+	// a new pixmap means we don't know what's in it yet, so with the MIT-SHM content path, all of it needs to be copied
+
+	if (!window_internal->x_pixmap) {
+		window_internal->x_pixmap = XCompositeNameWindowPixmap(cwm->wm->display, window->window);
+
+		window_internal->width  = window->width;
+		window_internal->height = window->height;
+
+		// with the MIT-SHM content path, we also need the pixmap's actual size, which is whatever size the window was when we named it (it might've been resized again since the last event we got)
+		// this costs a round trip, but only when the pixmap changes
+
+		if (uses_shm) {
+			xcb_connection_t* connection = cwm->wm->connection;
+			xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(connection, xcb_get_geometry(connection, window_internal->x_pixmap), NULL);
+
+			window_internal->pixmap_width  = geometry ? geometry->width  : 0;
+			window_internal->pixmap_height = geometry ? geometry->height : 0;
+
+			free(geometry);
+
+			window_internal->content_damage.rect_count = 0;
+			cwm_damage_add(&window_internal->content_damage, (cwm_rect_t) { 0, 0, window_internal->pixmap_width, window_internal->pixmap_height });
+		}
+
+		else {
+			const int pixmap_attributes[] = {
+				GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
+				GLX_TEXTURE_FORMAT_EXT, pixmap_config->format, 0
+			};
+
+			window_internal->pixmap = glXCreatePixmap(cwm->wm->display, pixmap_config->config, window_internal->x_pixmap, pixmap_attributes);
+		}
+
+		cwm->pixmap_creation_count++;
+	}
+
+	// if naming the pixmap failed (e.g. the window was unmapped in the meantime), there's nothing to copy from
+
+	if (uses_shm && (!window_internal->pixmap_width || !window_internal->pixmap_height)) return 0;
+
+	// the CPU compositor doesn't have textures, just the window's contents in memory (see 'cwm_window_pixels')
+
+	if (cwm->backend == CWM_BACKEND_CPU) {
+		__cwm_update_shm_texture(cwm, window, window_internal);
+		cwm->bind_count++;
+
+		return 1;
+	}
+
+	glActiveTexture(GL_TEXTURE0 + texture_unit);
+
+	if (!window_internal->texture) {
+		glGenTextures(1, &window_internal->texture);
+		glBindTexture(GL_TEXTURE_2D, window_internal->texture);
+
+		// these are part of the texture object, so we only need to set them once
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	else {
+		glBindTexture(GL_TEXTURE_2D, window_internal->texture);
+	}
+
+	if (uses_shm) __cwm_update_shm_texture(cwm, window, window_internal);
+	else cwm->glXBindTexImageEXT(cwm->wm->display, window_internal->pixmap, GLX_FRONT_LEFT_EXT, NULL);
+
+	cwm->bind_count++;
+	return 1;
+}
+
+const uint32_t* cwm_window_pixels(cwm_t* cwm, unsigned window_index, int* width, int* height) {
+	// with the CPU compositor, returns the contents of an already bound window (one 32-bit pixel per pixel of the window, with no padding between rows)
+
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	*width  = window_internal->texture_width;
+	*height = window_internal->texture_height;
+
+	return window_internal->pixels;
+}
+
+void cwm_use_window_texture(cwm_t* cwm, unsigned window_index, unsigned texture_unit) {
+	// switch an already bound window's texture to texture unit 'texture_unit' (this doesn't rebind the window's contents, so it's cheap)
+
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	glActiveTexture(GL_TEXTURE0 + texture_unit);
+	glBindTexture(GL_TEXTURE_2D, window_internal->texture);
+}
+
+void cwm_unbind_window_texture(cwm_t* cwm, unsigned window_index) {
+	wm_window_t* window = wm_get_window(cwm->wm, window_index);
+	cwm_window_internal_t* window_internal = cwm_get_window_internal(cwm, window);
+
+	// textures we upload to ourselves stay around as they are, there's nothing to release
+
+	if (__cwm_window_uses_shm(cwm, window)) return;
+	cwm->glXReleaseTexImageEXT(cwm->wm->display, window_internal->pixmap, GLX_FRONT_LEFT_EXT);
 }
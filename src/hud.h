@@ -0,0 +1,340 @@
+// this file contains the performance HUD, an overlay showing how long frames take to draw and what goes into them, and the statistics behind it
+// it's toggled with Super+H, or enabled at startup by setting the 'CWM_HUD' environment variable
+// this must be included after 'cwm.h' and 'opengl.h'
+
+#include <inttypes.h>
+
+// how many frames we keep statistics for, and how often (in microseconds) we update the text
+// the text is only ever updated on frames we're drawing anyway, so the HUD never causes frames to be drawn by itself
+
+#define HUD_HISTORY 256
+#define HUD_UPDATE_INTERVAL 250000
+
+// frame times over the whole run are kept in a histogram, so we can get percentiles without keeping every single frame around
+// each bucket is 100 microseconds wide, and the last one holds everything which took longer than that
+
+#define HUD_HISTOGRAM_BUCKET_SIZE 100 // microseconds
+#define HUD_HISTOGRAM_BUCKETS 1000
+
+// text layout
+// glyphs are 3x5 pixels, with a pixel of spacing around them, and are scaled up when drawn
+
+#define HUD_COLUMNS 48
+#define HUD_LINES 4
+
+#define HUD_GLYPH_WIDTH  4
+#define HUD_GLYPH_HEIGHT 6
+
+#define HUD_SCALE 2
+#define HUD_MARGIN 8 // pixels from the top left of the screen
+
+// 3x5 bitmap font covering ASCII from ' ' to 'Z' (lowercase letters are drawn as uppercase)
+// each glyph is 15 bits, one row of 3 bits after the other from the top, with the most significant bit on the left
+
+static const uint16_t hud_font[] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x52a5, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x01c0, 0x0002, 0x12a4,
+	0x7b6f, 0x2c97, 0x73e7, 0x72cf, 0x5bc9, 0x79cf, 0x79ef, 0x7292,
+	0x7bef, 0x7bcf, 0x0410, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x2bed, 0x6bae, 0x3923, 0x6b6e, 0x79a7, 0x79a4, 0x396b,
+	0x5bed, 0x7497, 0x126a, 0x5bad, 0x4927, 0x5fed, 0x6b6d, 0x2b6a,
+	0x6ba4, 0x2b73, 0x6bad, 0x388e, 0x7492, 0x5b6f, 0x5b6a, 0x5bfd,
+	0x5aad, 0x5a92, 0x72a7,
+};
+
+typedef struct {
+	cwm_t* cwm;
+	int enabled;
+
+	// timestamps of the current frame, in microseconds on the monotonic clock
+	// these are taken when we wake up to draw the frame, after processing events, after rendering, and after swapping
+
+	uint64_t frame_start;
+	uint64_t events_end;
+	uint64_t render_end;
+	uint64_t swap_end;
+
+	// per-frame history (circular buffers, times are in microseconds)
+
+	int history_count;
+	int history_next;
+
+	uint32_t frame_times [HUD_HISTORY];
+	uint32_t event_times [HUD_HISTORY];
+	uint32_t render_times[HUD_HISTORY];
+	uint32_t swap_times  [HUD_HISTORY];
+
+	uint32_t event_counts[HUD_HISTORY];
+	uint32_t bind_counts [HUD_HISTORY];
+	uint32_t draw_counts [HUD_HISTORY];
+
+	uint64_t frame_time_histogram[HUD_HISTOGRAM_BUCKETS];
+	uint64_t frame_count;
+
+	// totals at the end of the last frame, so we can work out how much each frame added
+
+	uint64_t previous_event_count;
+	uint64_t previous_bind_count;
+	uint64_t previous_draw_count;
+
+	uint64_t last_update;
+
+	// OpenGL stuff
+	// the text is rendered into a texture on the CPU whenever it changes, and drawn as a single quad
+
+	char text[HUD_LINES][HUD_COLUMNS + 1];
+	cwm_rect_t rect; // where the HUD is on screen, in pixels
+
+	GLuint texture;
+	GLuint shader;
+	GLuint rect_uniform;
+
+	GLuint vao;
+	int quad_index_count;
+} hud_t;
+
+void new_hud(hud_t* hud, cwm_t* cwm, GLuint quad_vbo, GLuint quad_ibo, int quad_index_count) {
+	memset(hud, 0, sizeof(*hud));
+
+	hud->cwm = cwm;
+	hud->enabled = !!getenv("CWM_HUD");
+
+	int width  = HUD_COLUMNS * HUD_GLYPH_WIDTH  + 1;
+	int height = HUD_LINES   * HUD_GLYPH_HEIGHT + 1;
+
+	hud->rect = (cwm_rect_t) { HUD_MARGIN, HUD_MARGIN, width * HUD_SCALE, height * HUD_SCALE };
+
+	// the HUD is only drawn with OpenGL, but we still keep track of the statistics behind it with the CPU compositor
+
+	if (cwm->backend == CWM_BACKEND_CPU) {
+		hud->enabled = 0;
+		return;
+	}
+
+	// the HUD uses the same quad as the windows
+
+	hud->quad_index_count = quad_index_count;
+
+	glGenVertexArrays(1, &hud->vao);
+	glBindVertexArray(hud->vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
+
+	gl_vertex_attribute(0, 2, 0, 0);
+
+	glGenTextures(1, &hud->texture);
+	glBindTexture(GL_TEXTURE_2D, hud->texture);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+
+	const char* vertex_shader_source = "#version 330\n"
+		"layout(location = 0) in vec2 vertex_position;"
+
+		"out vec2 texture_coords;"
+
+		"uniform vec4 rect;" // centre and size in normalized device coordinates
+
+		"void main(void) {"
+		"	texture_coords = vertex_position * vec2(1.0, -1.0) + vec2(0.5);"
+		"	gl_Position = vec4(vertex_position * rect.zw + rect.xy, 0.0, 1.0);"
+		"}";
+
+	const char* fragment_shader_source = "#version 330\n"
+		"in vec2 texture_coords;"
+
+		"out vec4 fragment_colour;"
+
+		"uniform sampler2D text_sampler;"
+
+		"void main(void) {"
+		"	float value = texture(text_sampler, texture_coords).r;"
+		"	fragment_colour = vec4(vec3(value), 0.6 + 0.4 * value);"
+		"}";
+
+	hud->shader = gl_create_shader_program(vertex_shader_source, fragment_shader_source);
+	hud->rect_uniform = glGetUniformLocation(hud->shader, "rect");
+
+	glUseProgram(hud->shader);
+	glUniform1i(glGetUniformLocation(hud->shader, "text_sampler"), 0);
+}
+
+void hud_toggle(hud_t* hud) {
+	if (hud->cwm->backend == CWM_BACKEND_CPU) return;
+
+	hud->enabled = !hud->enabled;
+	hud->last_update = 0; // make sure the text is up to date when it's shown
+
+	cwm_damage_rect(hud->cwm, hud->rect.x, hud->rect.y, hud->rect.width, hud->rect.height);
+}
+
+void hud_record_frame(hud_t* hud, uint64_t event_count, uint64_t bind_count, uint64_t draw_count) {
+	// call this once the frame has been swapped, with the total number of events received, pixmaps bound, and draw calls made so far
+
+	int i = hud->history_next;
+
+	hud->frame_times [i] = hud->swap_end   - hud->frame_start;
+	hud->event_times [i] = hud->events_end - hud->frame_start;
+	hud->render_times[i] = hud->render_end - hud->events_end;
+	hud->swap_times  [i] = hud->swap_end   - hud->render_end;
+
+	hud->event_counts[i] = event_count - hud->previous_event_count;
+	hud->bind_counts [i] = bind_count  - hud->previous_bind_count;
+	hud->draw_counts [i] = draw_count  - hud->previous_draw_count;
+
+	hud->previous_event_count = event_count;
+	hud->previous_bind_count  = bind_count;
+	hud->previous_draw_count  = draw_count;
+
+	hud->history_next = (hud->history_next + 1) % HUD_HISTORY;
+	hud->history_count = MIN(hud->history_count + 1, HUD_HISTORY);
+
+	hud->frame_time_histogram[MIN(hud->frame_times[i] / HUD_HISTOGRAM_BUCKET_SIZE, HUD_HISTOGRAM_BUCKETS - 1)]++;
+	hud->frame_count++;
+}
+
+float hud_frame_time_percentile(hud_t* hud, int percentile) {
+	// frame time percentile over the whole run, in milliseconds (rounded up to the end of the histogram bucket it falls in)
+
+	if (!hud->frame_count) return 0;
+
+	uint64_t target = (hud->frame_count - 1) * percentile / 100 + 1;
+	uint64_t count = 0;
+
+	for (int i = 0; i < HUD_HISTOGRAM_BUCKETS; i++) {
+		count += hud->frame_time_histogram[i];
+
+		if (count >= target) {
+			return (float) (i + 1) * HUD_HISTOGRAM_BUCKET_SIZE / 1000;
+		}
+	}
+
+	return (float) HUD_HISTOGRAM_BUCKETS * HUD_HISTOGRAM_BUCKET_SIZE / 1000;
+}
+
+static int hud_compare_times(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+static float hud_average(hud_t* hud, uint32_t* values) {
+	if (!hud->history_count) return 0;
+	uint64_t total = 0;
+
+	for (int i = 0; i < hud->history_count; i++) {
+		total += values[i];
+	}
+
+	return (float) total / hud->history_count;
+}
+
+static void hud_render_text(hud_t* hud) {
+	int width  = HUD_COLUMNS * HUD_GLYPH_WIDTH  + 1;
+	int height = HUD_LINES   * HUD_GLYPH_HEIGHT + 1;
+
+	GLubyte* data = (GLubyte*) calloc(width * height, 1);
+
+	for (int line = 0; line < HUD_LINES; line++) {
+		for (int column = 0; hud->text[line][column]; column++) {
+			int c = hud->text[line][column];
+
+			if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+			if (c < ' ' || c > 'Z') continue;
+
+			uint16_t glyph = hud_font[c - ' '];
+
+			for (int y = 0; y < 5; y++) {
+				for (int x = 0; x < 3; x++) {
+					if (!(glyph & (1 << (14 - y * 3 - x)))) continue;
+					data[(line * HUD_GLYPH_HEIGHT + 1 + y) * width + column * HUD_GLYPH_WIDTH + 1 + x] = 255;
+				}
+			}
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_2D, hud->texture);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, data);
+
+	free(data);
+}
+
+void hud_update(hud_t* hud) {
+	// refresh the text if it's been long enough since we last did
+	// call this before working out what needs to be repainted, so that the HUD is repainted on the same frame
+
+	if (!hud->enabled) return;
+
+	uint64_t now = cwm_now();
+	if (now - hud->last_update < HUD_UPDATE_INTERVAL) return;
+
+	hud->last_update = now;
+
+	// work out frame time percentiles
+
+	uint32_t sorted[HUD_HISTORY];
+	int count = hud->history_count;
+
+	memcpy(sorted, hud->frame_times, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), hud_compare_times);
+
+	#define PERCENTILE(p) (count ? sorted[(count - 1) * (p) / 100] / 1000.0 : 0.0)
+
+	snprintf(hud->text[0], sizeof(hud->text[0]), "FRAME MS P50 %.2f P90 %.2f P99 %.2f MAX %.2f",
+		PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), PERCENTILE(100));
+
+	#undef PERCENTILE
+
+	snprintf(hud->text[1], sizeof(hud->text[1]), "STAGES MS EVENTS %.2f RENDER %.2f SWAP %.2f",
+		hud_average(hud, hud->event_times) / 1000, hud_average(hud, hud->render_times) / 1000, hud_average(hud, hud->swap_times) / 1000);
+
+	snprintf(hud->text[2], sizeof(hud->text[2]), "PER FRAME EVENTS %.1f BINDS %.1f DRAWS %.1f",
+		hud_average(hud, hud->event_counts), hud_average(hud, hud->bind_counts), hud_average(hud, hud->draw_counts));
+
+	snprintf(hud->text[3], sizeof(hud->text[3]), "RENDERED %" PRIu64 " SKIPPED %" PRIu64,
+		hud->cwm->rendered_frame_count, hud->cwm->skipped_frame_count);
+
+	hud_render_text(hud);
+	cwm_damage_rect(hud->cwm, hud->rect.x, hud->rect.y, hud->rect.width, hud->rect.height);
+}
+
+void hud_render(hud_t* hud, cwm_damage_t* repaint) {
+	// draw the HUD over everything else
+
+	if (!hud->enabled) return;
+
+	int draw = 0;
+
+	for (int i = 0; i < repaint->rect_count; i++) {
+		draw |= cwm_rect_intersects(repaint->rects[i], hud->rect);
+	}
+
+	if (!draw) return;
+
+	glDisable(GL_DEPTH_TEST);
+
+	glUseProgram(hud->shader);
+	glBindVertexArray(hud->vao);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, hud->texture);
+
+	glUniform4f(hud->rect_uniform,
+		wm_x_coordinate_to_float(hud->cwm->wm, hud->rect.x + hud->rect.width  / 2),
+		wm_y_coordinate_to_float(hud->cwm->wm, hud->rect.y + hud->rect.height / 2),
+		wm_width_dimension_to_float (hud->cwm->wm, hud->rect.width),
+		wm_height_dimension_to_float(hud->cwm->wm, hud->rect.height));
+
+	for (int i = 0; i < repaint->rect_count; i++) {
+		cwm_scissor(hud->cwm, repaint->rects[i]);
+		glDrawElements(GL_TRIANGLES, hud->quad_index_count, GL_UNSIGNED_BYTE, NULL);
+	}
+
+	glEnable(GL_DEPTH_TEST);
+}
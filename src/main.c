@@ -1,22 +1,44 @@
 
+#define _GNU_SOURCE // for 'memfd_create' on Linux
+
 #define DEBUGGING 1
 #include <cwm.h>
 
 #include <opengl.h>
+#include <hud.h>
+#include <soft.h>
 
+#include <inttypes.h>
 #include <math.h>
+#include <signal.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 
 // structures and types
 
+typedef enum {
+	LAYER_NORMAL = 0,
+	LAYER_ABOVE, // always on top
+
+	LAYER_COUNT
+} layer_t;
+
 typedef struct {
 	unsigned internal_id;
 
 	int exists;
 	int visible;
 
-	uint64_t farness;
+	// stacking order
+	// each layer has its own doubly-linked list of windows going from the bottom to the top of the stack
+	// 'above' and 'below' are indices in 'windows' (-1 if there's no window above/below in the same layer)
+	// this way, windows never have to move around in memory when restacking
+
+	layer_t layer;
+	int above, below;
 
 	float opacity;
 	float x, y;
@@ -28,22 +50,55 @@ typedef struct {
 
 	float visual_shadow_opacity;
 	float visual_shadow_radius;
-	float visual_shadow_y_offset;
+
+	// area of the screen (in pixels, shadow included) the window covered when it was last drawn
+	// we need this to know what to repaint when the window moves or disappears
+
+	cwm_rect_t bounds;
+
+	// whether the window's contents (and its shadow) are completely covered by opaque windows above it, and what part of its contents isn't
+	// these are worked out each frame by 'occlude_windows'
+
+	int occluded, shadow_occluded;
+	cwm_rect_t clip;
 
 	int maximized;
 
 	float unmaximized_x, unmaximized_y;
 	float unmaximized_width, unmaximized_height;
+} window_t;
 
-	int always_on_top; // TODO doesn't always on top mean always focused to X?
-	                   //      it appears not, but this still needs to be implemented
-					   //      also maybe creating a proper linked list system for windows before implementing will make this easier
+// per-window data we need to draw a window and its shadow
+// we upload this for all windows at once each frame, so that drawing doesn't require any per-window uniforms or buffers
 
-	// OpenGL stuff
+typedef struct {
+	GLfloat position[2];
+	GLfloat size[2];
 
-	int index_count;
-	GLuint vao, vbo, ibo;
-} window_t;
+	GLfloat depth;
+	GLfloat opacity;
+
+	GLint texture_unit; // -1 if the window's contents couldn't be bound
+
+	GLfloat shadow_strength;
+	GLfloat shadow_radius; // pixels
+
+	GLfloat clip[4]; // left, bottom, right, top; the parts of the window outside of this are covered by other windows
+} instance_t;
+
+// how many windows we can bind at once, and thus draw in a single call
+// OpenGL 3.3 guarantees us at least 16 texture units in the fragment shader
+
+#define TEXTURE_UNIT_COUNT 8
+
+#define CORNER_RADIUS 6 // pixels
+
+// shadows fade out from an eighth of their radius inside the window to their full radius outside of it
+// that falloff only depends on the distance to the window divided by the radius (and the strength just scales it), so all shadows can share the same nine-slice texture
+// each slice of the texture is big enough that the focused window's shadow (128 pixels) is never magnified
+
+#define SHADOW_INSET (1.0 / 8)
+#define SHADOW_SLICE_SIZE 144 // texels
 
 typedef enum {
 	ACTION_NONE = 0,
@@ -59,16 +114,36 @@ typedef struct {
 
 	int running;
 
-	window_t* windows;
-	int window_count;
+	// our own state for each window, kept in a slab like the WM's (see 'slab.h')
+	// indices in there are what we call window indices, which aren't the same as the WM's internal ids
+
+	slab_t windows;
+
+	// maps internal ids (indices in the WM's own window list) directly to indices in 'windows'
+	// entries for internal ids which aren't in use are set to -1
+
+	int* window_indices;
+	int window_index_count;
+
+	// window stack (see 'window_t')
+	// all windows of a layer are drawn above all windows of the layers before it
+
+	int stack_bottoms[LAYER_COUNT];
+	int stack_tops[LAYER_COUNT];
+
+	int stacked_window_count;
 
 	// focused window and current action stuff
 
-	unsigned focused_window_id;
+	slab_handle_t focused_window; // handle in 'windows', so that it stops referring to anything once the window is gone
 	float focused_window_x, focused_window_y;
 
 	action_t action;
 
+	// whether we're adopting windows which were already there when we started (see 'wm_adopt_windows')
+
+	int adopting;
+
 	// monitor configuration info
 
 	int monitor_count;
@@ -77,106 +152,275 @@ typedef struct {
 	float* monitor_widths, *monitor_heights;
 
 	// OpenGL stuff
+	// all windows are drawn as the same quad, and everything specific to each window comes from the instance buffer
 
 	GLuint shader;
-	GLuint texture_uniform;
+	GLuint pixel_size_uniform;
+	GLuint corner_radius_uniform;
+
+	// opaque windows are drawn with a separate shader which doesn't do any blending or cut out any corners (see 'build_draws')
+
+	GLuint opaque_shader;
+	GLuint opaque_pixel_size_uniform;
 
-	GLuint opacity_uniform;
-	GLuint depth_uniform;
+	int quad_index_count;
+	GLuint window_vao, quad_vbo, quad_ibo;
 
-	GLuint position_uniform;
-	GLuint size_uniform;
+	GLuint instance_vbo;
+
+	instance_t* instances;
+	int* instance_windows; // index in 'windows' of the window each instance was made from
+
+	int instance_count;
+	int instance_capacity;
+
+	// what we actually draw of each window's contents, in the order we draw it
+	// these come after the instances in the instance buffer (the instances themselves are only used as-is for the shadows)
+
+	instance_t* draws;
+	int* draw_instances; // index in 'instances' of the instance each draw was made from
+
+	int draw_count;
+	int draw_capacity;
+	int opaque_draw_count; // the first 'opaque_draw_count' draws are drawn without blending
 
 	// shadow stuff
+	// shadows are drawn as a ring around their window (the middle would be hidden by the window anyway), textured with the shared falloff
+
+	GLuint shadow_shader;
+	GLuint shadow_pixel_size_uniform;
+	GLuint shadow_inset_uniform;
 
 	int shadow_index_count;
 	GLuint shadow_vao, shadow_vbo, shadow_ibo;
 
-	GLuint shadow_shader;
+	GLuint shadow_texture;
 
-	GLuint shadow_strength_uniform;
+	// CPU compositor stuff (see 'soft.h'), only used when we can't use OpenGL
+	// each window we draw becomes a layer, made from its instance
 
-	GLuint shadow_depth_uniform;
-	GLuint shadow_position_uniform;
-	GLuint shadow_size_uniform;
+	soft_t soft;
 
-	GLuint shadow_spread_uniform;
+	soft_layer_t* layers;
+	int layer_capacity;
+
+	// performance HUD stuff
+
+	hud_t hud;
+	uint64_t draw_call_count;
 } my_wm_t;
 
 // useful functions
 
+static inline window_t* get_window(my_wm_t* wm, int window_index) {
+	return (window_t*) slab_get(&wm->windows, window_index);
+}
+
+static int focused_window_index(my_wm_t* wm) {
+	// returns -1 if no window is focused, or if the focused window was destroyed
+	return slab_resolve(&wm->windows, wm->focused_window);
+}
+
 static unsigned window_internal_id_to_index(my_wm_t* wm, unsigned internal_id) {
-	for (int i = 0; i < wm->window_count; i++) {
-		window_t* window = &wm->windows[i];
+	// no window with that internal id was found
+
+	if (internal_id >= wm->window_index_count) {
+		return -1;
+	}
+
+	return wm->window_indices[internal_id];
+}
 
-		// it's really super important to verify our window actually exists
-		// we could have a window that doesn't exist anymore, but that had the same ID as one that currently exists
+static void set_window_index(my_wm_t* wm, unsigned internal_id, int window_index) {
+	if (internal_id >= wm->window_index_count) {
+		int count = internal_id + 1;
+		wm->window_indices = (int*) realloc(wm->window_indices, count * sizeof(*wm->window_indices));
 
-		if (window->exists && window->internal_id == internal_id) {
-			return i;
+		for (int i = wm->window_index_count; i < count; i++) {
+			wm->window_indices[i] = -1;
 		}
+
+		wm->window_index_count = count;
 	}
 
-	// no window with that internal id was found
-	return -1;
+	wm->window_indices[internal_id] = window_index;
 }
 
-static void print_window_stack(my_wm_t* wm) { // debugging function
-	printf("Window stack (%d windows):\n", wm->window_count);
+// window stack functions
+
+static void stack_unlink(my_wm_t* wm, int window_index) {
+	window_t* window = get_window(wm, window_index);
+
+	if (window->below >= 0) get_window(wm, window->below)->above = window->above;
+	else wm->stack_bottoms[window->layer] = window->above;
+
+	if (window->above >= 0) get_window(wm, window->above)->below = window->below;
+	else wm->stack_tops[window->layer] = window->below;
+
+	window->above = -1;
+	window->below = -1;
+
+	wm->stacked_window_count--;
+}
+
+static void stack_push_top(my_wm_t* wm, int window_index) {
+	window_t* window = get_window(wm, window_index);
+	int top = wm->stack_tops[window->layer];
+
+	window->below = top;
+	window->above = -1;
+
+	if (top >= 0) get_window(wm, top)->above = window_index;
+	else wm->stack_bottoms[window->layer] = window_index;
 
-	for (int i = 0; i < wm->window_count; i++) {
-		window_t* window = &wm->windows[i];
+	wm->stack_tops[window->layer] = window_index;
+	wm->stacked_window_count++;
+}
+
+static void stack_push_bottom(my_wm_t* wm, int window_index) {
+	window_t* window = get_window(wm, window_index);
+	int bottom = wm->stack_bottoms[window->layer];
+
+	window->above = bottom;
+	window->below = -1;
+
+	if (bottom >= 0) get_window(wm, bottom)->below = window_index;
+	else wm->stack_tops[window->layer] = window_index;
+
+	wm->stack_bottoms[window->layer] = window_index;
+	wm->stacked_window_count++;
+}
+
+// these two functions walk the whole stack, across layers
+// start from 'stack_next(wm, -1)' to get the bottommost window, or 'stack_previous(wm, -1)' to get the topmost one
+// they both return -1 once we've gone past the end of the stack
+
+static int stack_next(my_wm_t* wm, int window_index) {
+	int layer = 0;
 
-		if (window->exists) printf("\t[%d]: internal_id = %d, visible = %d, farness = %lu\n", i, window->internal_id, window->visible, window->farness);
-		else printf("\t[%d]: empty space\n", i);
+	if (window_index >= 0) {
+		window_t* window = get_window(wm, window_index);
+		if (window->above >= 0) return window->above;
+
+		layer = window->layer + 1;
 	}
 
-	printf("\n");
+	for (; layer < LAYER_COUNT; layer++) {
+		if (wm->stack_bottoms[layer] >= 0) return wm->stack_bottoms[layer];
+	}
+
+	return -1;
 }
 
-static void focus_window(my_wm_t* wm, unsigned window_id, int internally) {
-	unsigned internal_id = wm->windows[window_id].internal_id;
+static int stack_previous(my_wm_t* wm, int window_index) {
+	int layer = LAYER_COUNT - 1;
 
-	if (internally) {
-		wm_focus_window(&wm->wm, internal_id);
+	if (window_index >= 0) {
+		window_t* window = get_window(wm, window_index);
+		if (window->below >= 0) return window->below;
+
+		layer = window->layer - 1;
 	}
 
-	for (int i = 0; i < wm->window_count; i++) {
-		window_t* window = &wm->windows[i];
+	for (; layer >= 0; layer--) {
+		if (wm->stack_tops[layer] >= 0) return wm->stack_tops[layer];
+	}
+
+	return -1;
+}
 
-		/* if (window->always_on_top) window->farness = 0;
-		else */ window->farness++;
+static void print_window_stack(my_wm_t* wm) { // debugging function
+	printf("Window stack (%d windows, from bottom to top):\n", wm->stacked_window_count);
+
+	for (int i = stack_next(wm, -1); i >= 0; i = stack_next(wm, i)) {
+		window_t* window = get_window(wm, i);
+		printf("\t[%d]: internal_id = %d, visible = %d, layer = %d\n", i, window->internal_id, window->visible, window->layer);
 	}
 
-	wm->windows[window_id].farness = 0;
+	printf("\n");
+}
+
+static cwm_rect_t window_rect(my_wm_t* wm, window_t* window) {
+	// area of the screen covered by the window itself, as it's drawn (this might be off by a pixel because of subpixel positioning)
+
+	int width  = (int) ceil(window->visual_width  / 2 * wm->x_resolution);
+	int height = (int) ceil(window->visual_height / 2 * wm->y_resolution);
+
+	int x = wm_float_to_x_coordinate(&wm->wm, window->visual_x) - width  / 2;
+	int y = wm_float_to_y_coordinate(&wm->wm, window->visual_y) - height / 2;
+
+	return (cwm_rect_t) { x, y, width, height };
+}
+
+static cwm_rect_t window_bounds(my_wm_t* wm, window_t* window) {
+	// area of the screen covered by the window and its shadow (which extends 'visual_shadow_radius' pixels around it)
+
+	int margin = (int) ceil(window->visual_shadow_radius) + 2; // add a bit of room for subpixel positioning
+	cwm_rect_t rect = window_rect(wm, window);
+
+	return (cwm_rect_t) { rect.x - margin, rect.y - margin, rect.width + margin * 2, rect.height + margin * 2 };
+}
+
+static void damage_window(my_wm_t* wm, window_t* window) {
+	cwm_damage_rect(&wm->cwm, window->bounds.x, window->bounds.y, window->bounds.width, window->bounds.height);
+}
+
+static void focus_window(my_wm_t* wm, unsigned window_id, int internally) {
+	window_t* window = get_window(wm, window_id);
 
-	// sort windows
-	// this could be a much more efficient system with linked lists (as I believe X does internally), but this is fine for now
+	if (internally) {
+		wm_focus_window(&wm->wm, window->internal_id);
 
-	for (int i = 0; i < wm->window_count; i++) {
-		for (int j = i + 1; j < wm->window_count; j++) {
-			if (wm->windows[i].farness < wm->windows[j].farness) {
-				window_t temp;
+		// raising a window in X puts it above everything, so make sure windows in the layers above stay above it
 
-				memcpy(&temp, &wm->windows[i], sizeof(window_t));
-				memcpy(&wm->windows[i], &wm->windows[j], sizeof(window_t));
-				memcpy(&wm->windows[j], &temp, sizeof(window_t));
+		for (int layer = window->layer + 1; layer < LAYER_COUNT; layer++) {
+			for (int i = wm->stack_bottoms[layer]; i >= 0; i = get_window(wm, i)->above) {
+				wm_raise_window(&wm->wm, get_window(wm, i)->internal_id);
 			}
 		}
 	}
 
-	wm->focused_window_id = window_internal_id_to_index(wm, internal_id);
+	// move the window to the top of its layer
+
+	stack_unlink(wm, window_id);
+	stack_push_top(wm, window_id);
+
+	wm->focused_window = slab_handle(&wm->windows, window_id);
+
+	// the window is going to be drawn on top of the others now, so repaint it
+
+	damage_window(wm, window);
+	cwm_request_repaint(&wm->cwm);
 }
 
 static void unfocus_window(my_wm_t* wm) {
-	// loop backwards through all the windows and check if they're a valid candidate for refocusing
-	// we start at 'wm->window_count - 2', because we want the index and two ignore the last window on the stack (hopefully our focused window)
+	// walk down the stack from the focused window and focus the first valid candidate we find
+
+	for (int i = stack_previous(wm, focused_window_index(wm)); i >= 0; i = stack_previous(wm, i)) {
+		window_t* window = get_window(wm, i);
+
+		if (window->exists && window->visible) {
+			focus_window(wm, i, 1);
+			break;
+		}
+	}
+}
+
+static void lower_window(my_wm_t* wm, unsigned window_id) {
+	if (!slab_used(&wm->windows, window_id)) return;
+	window_t* window = get_window(wm, window_id);
+	wm_lower_window(&wm->wm, window->internal_id);
 
-	for (int i = wm->focused_window_id - 1; i >= 0; i--) {
-		if (i != wm->focused_window_id) { // just to make sure, but this shouldn't happen
-			window_t* window = &wm->windows[i];
+	stack_unlink(wm, window_id);
+	stack_push_bottom(wm, window_id);
 
-			if (window->exists && window->visible) {
+	damage_window(wm, window);
+
+	// if we lowered the focused window, give focus to whatever is on top now
+
+	if (window_id == focused_window_index(wm)) {
+		for (int i = stack_previous(wm, -1); i >= 0; i = stack_previous(wm, i)) {
+			if (get_window(wm, i)->exists && get_window(wm, i)->visible) {
 				focus_window(wm, i, 1);
 				break;
 			}
@@ -184,8 +428,21 @@ static void unfocus_window(my_wm_t* wm) {
 	}
 }
 
+static void set_window_layer(my_wm_t* wm, unsigned window_id, layer_t layer) {
+	if (!slab_used(&wm->windows, window_id)) return;
+	window_t* window = get_window(wm, window_id);
+	if (window->layer == layer) return;
+
+	stack_unlink(wm, window_id);
+	window->layer = layer;
+	stack_push_top(wm, window_id);
+
+	wm_raise_window(&wm->wm, window->internal_id);
+	damage_window(wm, window);
+}
+
 static void maximize_window(my_wm_t* wm, unsigned window_id, int single_monitor) {
-	window_t* window = &wm->windows[window_id];
+	window_t* window = get_window(wm, window_id);
 
 	if (window->maximized) {
 		window->maximized = 0;
@@ -226,6 +483,150 @@ static void maximize_window(my_wm_t* wm, unsigned window_id, int single_monitor)
 	wm_move_window(&wm->wm, window->internal_id, 0.0, 0.0, 2.0, 2.0);
 }
 
+// restart state
+// when restarting, we hand whatever the server can't tell us (layers, maximized state, and focus) over to the new process in an inherited memfd
+// its file descriptor is passed on through the 'CWM_RESTART_STATE' environment variable
+
+#define RESTART_STATE_MAGIC 0x72776d63 // "cwmr"
+
+typedef struct {
+	uint32_t magic;
+	int window_count;
+
+	Window focused_window;
+} restart_header_t;
+
+typedef struct {
+	Window window;
+	layer_t layer;
+
+	int maximized;
+
+	float unmaximized_x, unmaximized_y;
+	float unmaximized_width, unmaximized_height;
+} restart_window_t;
+
+static void save_restart_state(my_wm_t* wm) {
+	// this isn't close-on-exec, so the new process inherits it
+
+	int fd = memfd_create("cwm-restart-state", 0);
+	if (fd < 0) return;
+
+	restart_header_t header = {
+		.magic = RESTART_STATE_MAGIC,
+		.window_count = 0,
+		.focused_window = None,
+	};
+
+	restart_window_t* records = (restart_window_t*) malloc(MAX(wm->windows.live_count, 1) * sizeof(*records));
+
+	// windows are saved from the bottom of the stack to the top, so that we can restack them by just pushing each one to the top of its layer in turn
+
+	for (int i = stack_next(wm, -1); i >= 0; i = stack_next(wm, i)) {
+		window_t* window = get_window(wm, i);
+		if (!window->exists) continue;
+
+		records[header.window_count++] = (restart_window_t) {
+			.window = wm_get_window(&wm->wm, window->internal_id)->window,
+			.layer = window->layer,
+
+			.maximized = window->maximized,
+
+			.unmaximized_x = window->unmaximized_x,
+			.unmaximized_y = window->unmaximized_y,
+
+			.unmaximized_width  = window->unmaximized_width,
+			.unmaximized_height = window->unmaximized_height,
+		};
+	}
+
+	int focused_window = focused_window_index(wm);
+
+	if (focused_window >= 0) {
+		header.focused_window = wm_get_window(&wm->wm, get_window(wm, focused_window)->internal_id)->window;
+	}
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header) || write(fd, records, header.window_count * sizeof(*records)) != header.window_count * sizeof(*records)) {
+		close(fd);
+		free(records);
+
+		return;
+	}
+
+	free(records);
+
+	char fd_string[16];
+	snprintf(fd_string, sizeof(fd_string), "%d", fd);
+
+	setenv("CWM_RESTART_STATE", fd_string, 1);
+}
+
+static void load_restart_state(my_wm_t* wm) {
+	// this must be called once all existing windows have been adopted
+
+	const char* fd_string = getenv("CWM_RESTART_STATE");
+	if (!fd_string) return;
+
+	int fd = atoi(fd_string);
+	unsetenv("CWM_RESTART_STATE"); // so that we don't pass it on to anything we run
+
+	restart_header_t header;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != RESTART_STATE_MAGIC || header.window_count < 0) {
+		close(fd);
+		return;
+	}
+
+	size_t records_size = header.window_count * sizeof(restart_window_t);
+	restart_window_t* records = (restart_window_t*) malloc(MAX(records_size, 1));
+
+	if (pread(fd, records, records_size, sizeof(header)) != records_size) {
+		header.window_count = 0;
+	}
+
+	close(fd);
+
+	int focused_window_index = -1;
+
+	for (int i = 0; i < header.window_count; i++) {
+		restart_window_t* record = &records[i];
+
+		// the window might have been destroyed while we were restarting
+
+		int internal_id = wm_find_window_by_xid(&wm->wm, record->window);
+		if (internal_id < 0) continue;
+
+		int window_index = window_internal_id_to_index(wm, internal_id);
+		if (window_index < 0) continue;
+
+		window_t* window = get_window(wm, window_index);
+
+		stack_unlink(wm, window_index);
+		window->layer = record->layer;
+		stack_push_top(wm, window_index);
+
+		window->maximized = record->maximized;
+
+		window->unmaximized_x = record->unmaximized_x;
+		window->unmaximized_y = record->unmaximized_y;
+
+		window->unmaximized_width  = record->unmaximized_width;
+		window->unmaximized_height = record->unmaximized_height;
+
+		if (record->window == header.focused_window && window->visible) {
+			focused_window_index = window_index;
+		}
+	}
+
+	free(records);
+
+	// the server kept the input focus on the same window while we restarted, we just need to know about it ourselves
+
+	if (focused_window_index >= 0) {
+		focus_window(wm, focused_window_index, 0);
+	}
+}
+
 // event callback functions
 
 static char* first_argument;
@@ -233,14 +634,25 @@ static char* first_argument;
 void keyboard_event(my_wm_t* wm, unsigned internal_id, unsigned press, unsigned modifiers, unsigned key) {
 	int alt   = modifiers & 0x8;
 	int super = modifiers & 0x40;
+
+	int focused_window = focused_window_index(wm);
 	
 	if (press && super &&         key == 67) wm->running = 0; // Super+F1
-	if (press && super &&         key == 24) wm_close_window(&wm->wm, wm->windows[wm->focused_window_id].internal_id); // Super+Q (quit)
-	if (press && super &&  alt && key == 41) maximize_window(wm, wm->focused_window_id, 0); // Super+Alt+F (fullfullscreen)
-	if (press && super && !alt && key == 41) maximize_window(wm, wm->focused_window_id, 1); // Super+F (fullscreen)
+	if (press && super &&         key == 24 && focused_window >= 0) wm_close_window(&wm->wm, get_window(wm, focused_window)->internal_id); // Super+Q (quit)
+	if (press && super &&  alt && key == 41 && focused_window >= 0) maximize_window(wm, focused_window, 0); // Super+Alt+F (fullfullscreen)
+	if (press && super && !alt && key == 41 && focused_window >= 0) maximize_window(wm, focused_window, 1); // Super+F (fullscreen)
 	if (press && super &&         key == 55) wm->cwm.vsync = !wm->cwm.vsync; // Super+V (vsync)
+	if (press && super &&         key == 46) lower_window(wm, focused_window); // Super+L (lower)
+	if (press && super &&         key == 43) hud_toggle(&wm->hud); // Super+H (HUD)
+
+	if (press && super && key == 38 && focused_window >= 0) { // Super+A (always on top)
+		window_t* window = get_window(wm, focused_window);
+		set_window_layer(wm, focused_window, window->layer == LAYER_ABOVE ? LAYER_NORMAL : LAYER_ABOVE);
+	}
 
 	if (press && super &&  key == 27) { // Super+R (restart)
+		save_restart_state(wm);
+
 		execl(first_argument, first_argument, NULL);
 		exit(1);
 	}
@@ -272,16 +684,23 @@ int click_event(my_wm_t* wm, unsigned internal_id, unsigned press, unsigned modi
 
 		focus_window(wm, window_index, 1);
 
-		wm->focused_window_x = wm->windows[wm->focused_window_id].x - x;
-		wm->focused_window_y = wm->windows[wm->focused_window_id].y - y;
+		wm->focused_window_x = get_window(wm, window_index)->x - x;
+		wm->focused_window_y = get_window(wm, window_index)->y - y;
 
 	} else if (wm->action) { // releasing and were already doing something
-		window_t* window = &wm->windows[wm->focused_window_id];
+		// the window might have been destroyed while we were moving or resizing it
 
-		window->opacity = 1.0;
-		wm_move_window(&wm->wm, window->internal_id, window->x, window->y, window->width, window->height);
+		int focused_window = focused_window_index(wm);
+
+		if (focused_window >= 0) {
+			window_t* window = get_window(wm, focused_window);
+
+			window->opacity = 1.0;
+			wm_move_window(&wm->wm, window->internal_id, window->x, window->y, window->width, window->height);
+		}
 
 		wm->action = ACTION_NONE;
+		cwm_request_repaint(&wm->cwm);
 		return 0;
 	}
 
@@ -289,7 +708,8 @@ int click_event(my_wm_t* wm, unsigned internal_id, unsigned press, unsigned modi
 		if      (button == 1) wm->action = ACTION_MOVE;
 		else if (button == 3) wm->action = ACTION_RESIZE;
 
-		wm->windows[wm->focused_window_id].opacity = 0.9;
+		get_window(wm, window_index)->opacity = 0.9;
+		cwm_request_repaint(&wm->cwm);
 
 		return 0;
 	}
@@ -298,8 +718,10 @@ int click_event(my_wm_t* wm, unsigned internal_id, unsigned press, unsigned modi
 }
 
 void move_event(my_wm_t* wm, unsigned internal_id, unsigned modifiers, float x, float y) {
-	if (wm->action && !wm->windows[wm->focused_window_id].maximized) {
-		window_t* window = &wm->windows[wm->focused_window_id];
+	int focused_window = focused_window_index(wm);
+
+	if (wm->action && focused_window >= 0 && !get_window(wm, focused_window)->maximized) {
+		window_t* window = get_window(wm, focused_window);
 
 		if (wm->action == ACTION_MOVE) {
 			window->x = x + wm->focused_window_x;
@@ -310,215 +732,311 @@ void move_event(my_wm_t* wm, unsigned internal_id, unsigned modifiers, float x,
 			window->width  = 2 * fabs(x - window->x);
 			window->height = 2 * fabs(y - window->y);
 
-			// this is not ideal for performance in certain applications, but it looks hella cool for apps that work correctly nonetheless
-			// basically the problem is that you're calling a 'ConfigureNotify' event each time,
-			// which means the compositor needs to create a new pixmap for each frame
-			// not good...
+			// sending the new size on each motion event would mean a 'ConfigureNotify' and a new pixmap each time, which heavier apps can't keep up with
+			// so we only send the next size once the client is done drawing at the previous one (the rest happens in 'modify_event' once it is)
+			// in the meantime, the compositor just stretches the last contents it got from the client to the size we're showing
 
-			wm_move_window(&wm->wm, window->internal_id, window->x, window->y, window->width, window->height);
+			if (!wm_window_busy(&wm->wm, window->internal_id)) {
+				wm_move_window(&wm->wm, window->internal_id, window->x, window->y, window->width, window->height);
+			}
 		}
+
+		cwm_request_repaint(&wm->cwm);
 	}
 }
 
 void create_event(my_wm_t* wm, unsigned internal_id) {
 	cwm_create_event(&wm->cwm, internal_id);
 
-	int window_index = 0;
-
-	for (; window_index < wm->window_count; window_index++) {
-		if (!wm->windows[window_index].exists) {
-			goto got_space;
-		}
-	}
-
-	wm->windows = (window_t*) realloc(wm->windows, ++wm->window_count * sizeof(*wm->windows));
-	window_index = wm->window_count - 1;
-
-got_space: {}
-
-	window_t* window = &wm->windows[window_index];
-	memset(window, 0, sizeof(*window));
+	int window_index = slab_alloc(&wm->windows);
+	window_t* window = get_window(wm, window_index);
 
 	window->internal_id = internal_id;
 	window->exists = 1;
 	window->opacity = 1.0;
 
-	gl_create_vao_vbo_ibo(&window->vao, &window->vbo, &window->ibo);
+	set_window_index(wm, internal_id, window_index);
+
+	// X puts new windows on top of the stack, so we do the same
+
+	window->layer = LAYER_NORMAL;
+	stack_push_top(wm, window_index);
 }
 
 void modify_event(my_wm_t* wm, unsigned internal_id, int visible, float x, float y, float width, float height) {
 	cwm_modify_event(&wm->cwm, internal_id);
 
 	int window_index = window_internal_id_to_index(wm, internal_id);
-	window_t* window = &wm->windows[window_index];
+	window_t* window = get_window(wm, window_index);
 
 	int was_visible = window->visible;
 	window->visible = visible;
 
-	window->x = x;
-	window->y = y;
+	// if the window is being resized, the geometry we have is more up to date than the one the server is telling us about
+	// this is also where we find out the client caught up with the last size we sent it, in which case we can send it the latest one
 
-	window->width  = width;
-	window->height = height;
+	if (wm->action == ACTION_RESIZE && window_index == focused_window_index(wm)) {
+		wm_window_t* wm_window = wm_get_window(&wm->wm, internal_id);
 
-	// regenerate vertex attributes and indices
+		int size_changed =
+			wm_float_to_width_dimension (&wm->wm, window->width)  != wm_window->width ||
+			wm_float_to_height_dimension(&wm->wm, window->height) != wm_window->height;
 
-	#define TAU 6.283185
-
-	#define CORNER_RESOLUTION 8
-	#define CORNER_RADIUS 3 // pixels
+		if (size_changed && !wm_window_busy(&wm->wm, internal_id)) {
+			wm_move_window(&wm->wm, internal_id, window->x, window->y, window->width, window->height);
+		}
+	}
 
-	float x_radius = 4 * (float) CORNER_RADIUS / wm->x_resolution / width;
-	float y_radius = 4 * (float) CORNER_RADIUS / wm->y_resolution / height;
+	else {
+		window->x = x;
+		window->y = y;
 
-	// loop through all the vertex pairs
+		window->width  = width;
+		window->height = height;
+	}
 
-	GLfloat vertex_positions[CORNER_RESOLUTION * 2 * 4 + 4];
-	GLubyte indices[CORNER_RESOLUTION * 2 * 6 + 3];
+	if (window->visible && !was_visible) {
+		window->opacity = 1.0;
 
-	int prev_index_pair[2] = { -1 };
+		window->visual_x = window->x;
+		window->visual_y = window->y;
 
-	for (int i = 0; i < CORNER_RESOLUTION * 2 + 1; i++) {
-		// calculate indices
+		// windows which were already there when we started were on screen all along, so they don't need to animate in
 
-		int index_pair[2] = { i * 2, i * 2 + 1 };
+		if (wm->adopting) {
+			window->visual_opacity = 1.0;
 
-		if (prev_index_pair[0] >= 0) {
-			indices[i * 6 + 0] = prev_index_pair[0];
-			indices[i * 6 + 1] = prev_index_pair[1];
-			indices[i * 6 + 2] =      index_pair[1];
-			indices[i * 6 + 3] = prev_index_pair[0];
-			indices[i * 6 + 4] =      index_pair[1];
-			indices[i * 6 + 5] =      index_pair[0];
+			window->visual_width  = window->width;
+			window->visual_height = window->height;
 		}
 
-		memcpy(prev_index_pair, index_pair, sizeof(prev_index_pair));
+		else {
+			window->visual_opacity = 0.0;
+			wm_move_window(&wm->wm, window->internal_id, window->x, window->y, window->width, window->height);
+
+			window->visual_width  = window->width  * 0.9;
+			window->visual_height = window->height * 0.9;
+		}
 
-		// calculate vertices
+	 	focus_window(wm, window_index, 0);
+	}
 
-		float theta = (float) (i - (i > CORNER_RESOLUTION / 2)) / CORNER_RESOLUTION * TAU / 2;
+	else if (!window->visible && was_visible) {
+		damage_window(wm, window);
 
-		float corner_x = cos(theta) * x_radius;
-		float corner_y = sin(theta) * y_radius;
+		if (window_index == focused_window_index(wm)) {
+			unfocus_window(wm);
+		}
+	}
+}
 
-		float x = (i <= CORNER_RESOLUTION / 2 ? 0.5 - x_radius : -0.5 + x_radius) + corner_x;
-		float y = 0.5 - y_radius + corner_y;
+void destroy_event(my_wm_t* wm, unsigned internal_id, int destroyed) {
+	cwm_destroy_event(&wm->cwm, internal_id, destroyed);
 
-		vertex_positions[i * 4 + 0] =  x;
-		vertex_positions[i * 4 + 1] =  y;
+	unsigned window_index = window_internal_id_to_index(wm, internal_id);
+	window_t* window = get_window(wm, window_index);
 
-		vertex_positions[i * 4 + 2] =  x;
-		vertex_positions[i * 4 + 3] = -y;
+	if (window->visible) {
+		damage_window(wm, window);
 	}
 
-	window->index_count = sizeof(indices) / sizeof(*indices);
-	gl_set_vao_vbo_ibo_data(window->vao, window->vbo, sizeof(vertex_positions), vertex_positions, window->ibo, sizeof(indices), indices);
-
-	if (window->visible && !was_visible) {
-		window->opacity = 1.0;
-		window->visual_opacity = 0.0;
+	// the window's last 'UnmapNotify' might have been coalesced away, so make sure we're not still focusing it
 
-		wm_move_window(&wm->wm, window->internal_id, window->x, window->y, window->width, window->height);
+	if (window_index == focused_window_index(wm)) {
+		unfocus_window(wm);
+	}
 
-		window->visual_x = window->x;
-		window->visual_y = window->y;
+	stack_unlink(wm, window_index);
 
-		window->visual_width  = window->width  * 0.9;
-		window->visual_height = window->height * 0.9;
+	window->exists = 0;
+	set_window_index(wm, internal_id, -1);
 
-	 	focus_window(wm, window_index, 0);
-	}
+	// if the window was still focused (because there was nothing else to focus), freeing its slot invalidates the handle
 
-	else if (window_index == wm->focused_window_id && !window->visible && was_visible) {
-		unfocus_window(wm);
-	}
+	slab_free(&wm->windows, window_index);
 }
 
-void destroy_event(my_wm_t* wm, unsigned internal_id) {
-	cwm_destroy_event(&wm->cwm, internal_id);
+void damage_event(my_wm_t* wm, unsigned internal_id, int x, int y, int width, int height) {
+	cwm_damage_event(&wm->cwm, internal_id, x, y, width, height);
 
 	unsigned window_index = window_internal_id_to_index(wm, internal_id);
-	window_t* window = &wm->windows[window_index];
+	if (window_index == -1) return;
 
-	window->exists = 0;
-}
+	window_t* window = get_window(wm, window_index);
+	if (!window->visible || window->width <= 0 || window->height <= 0) return;
 
-// main functions
+	// if the window is hidden behind other windows, its contents changing doesn't change anything on screen
+	// once it's uncovered, whatever covered it will have damaged that part of the screen anyway
 
-static void render_window(my_wm_t* wm, unsigned window_id, float delta) {
-	window_t* window = &wm->windows[window_id];
+	if (window->occluded) return;
 
-	if (!window->exists ) return;
-	if (!window->visible) return;
+	// the damaged area is relative to the window's actual contents, which we stretch to the window's visual size on screen
+	// we add a pixel on each side because of linear filtering
 
-	// calculate visual window coordinates and size (animation)
+	float x_scale = window->visual_width  / window->width;
+	float y_scale = window->visual_height / window->height;
 
-	delta = MIN(0.1, delta); // just make sure this doesn't get too crazy
-	                         // TODO see if this actually does anything
+	int left = wm_float_to_x_coordinate(&wm->wm, window->visual_x - window->visual_width  / 2);
+	int top  = wm_float_to_y_coordinate(&wm->wm, window->visual_y + window->visual_height / 2);
 
-	window->visual_opacity += (window->opacity - window->visual_opacity) * delta * 10;
+	cwm_damage_rect(&wm->cwm,
+		left + (int) floor(x * x_scale) - 1, top + (int) floor(y * y_scale) - 1,
+		(int) ceil(width * x_scale) + 2, (int) ceil(height * y_scale) + 2);
+}
 
-	window->visual_x += (window->x - window->visual_x) * delta * 20;
-	window->visual_y += (window->y - window->visual_y) * delta * 20;
+// unredirection functions
 
-	// TODO for some reason, when disabling vsync, windows take a real long time before starting their "appearing" animation
-	//      maybe this is because of this?
+static int unredirection_candidate(my_wm_t* wm, cwm_rect_t* output) {
+	// find the window we can let draw straight to the screen, if there's one (-1 if not)
+	// this must be the topmost visible window, it must cover a whole output, and it mustn't be animating (nothing can be drawn over it)
+	// it must also be opaque, unless the client asked us not to composite it, in which case it's on it to make sure it is
 
-	window->visual_width  += (window->width  - window->visual_width ) * delta * 30;
-	window->visual_height += (window->height - window->visual_height) * delta * 30;
+	int window_index = stack_previous(wm, -1);
 
-	float x = window->visual_x;
-	float y = window->visual_y;
+	for (; window_index >= 0; window_index = stack_previous(wm, window_index)) {
+		window_t* window = get_window(wm, window_index);
+		if (window->exists && window->visible) break;
+	}
 
-	float width  = window->visual_width;
-	float height = window->visual_height;
+	if (window_index < 0) return -1;
 
-	// check if window coordinates and size are pixel aligned
-	// rounding here instead of simply flooring to preserve proper subpixel rendering when animating
+	window_t* window = get_window(wm, window_index);
+	wm_window_t* wm_window = wm_get_window(&wm->wm, window->internal_id);
 
-	int width_pixels  = (int) round(width  / 2 * wm->x_resolution);
-	int height_pixels = (int) round(height / 2 * wm->y_resolution);
+	if (window->opacity < 1.0 || window->visual_opacity < 1.0) return -1;
 
-	if (width_pixels  % 2) x += 0.5 / wm->x_resolution * 2; // if width odd, add half a pixel to x
-	if (height_pixels % 2) y += 0.5 / wm->y_resolution * 2; // if height odd, subtract half a pixel to y
+	if (window->visual_x != window->x || window->visual_y != window->y) return -1;
+	if (window->visual_width != window->width || window->visual_height != window->height) return -1;
 
-	// calculate window depth
+	if (wm_window->bypass_compositor == 2) return -1;
+	if (wm_window->bypass_compositor != 1 && !cwm_window_opaque(&wm->cwm, window->internal_id)) return -1;
 
-	float depth = 1.0 - (float) window_id / wm->window_count;
+	if (!cwm_window_covers_output(&wm->cwm, window->internal_id, output)) return -1;
 
-	// draw the window contents
+	return window_index;
+}
 
-	glUseProgram(wm->shader);
-	glUniform1i(wm->texture_uniform, 0);
+static void update_unredirection(my_wm_t* wm) {
+	cwm_rect_t output;
+	int window_index = unredirection_candidate(wm, &output);
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	int internal_id = window_index >= 0 ? (int) get_window(wm, window_index)->internal_id : -1;
+	if (internal_id == wm->cwm.unredirected_window) return;
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	// something else is going on, start compositing the previous window again before anything else
 
-	glActiveTexture(GL_TEXTURE0);
-	cwm_bind_window_texture(&wm->cwm, window->internal_id);
+	cwm_redirect_window(&wm->cwm);
 
-	// actually draw the window
+	if (internal_id >= 0) {
+		cwm_unredirect_window(&wm->cwm, internal_id, output);
+	}
+}
 
-	glUniform1f(wm->opacity_uniform, window->visual_opacity);
-	glUniform1f(wm->depth_uniform, depth);
+// statistics functions
 
-	glUniform2f(wm->position_uniform, x, y);
-	glUniform2f(wm->size_uniform, width, height);
+static volatile sig_atomic_t terminating = 0;
 
-	glBindVertexArray(window->vao);
-	glDrawElements(GL_TRIANGLES, window->index_count, GL_UNSIGNED_BYTE, NULL);
+static void terminate_signal_handler(int signal_number) {
+	// just ask the main loop to stop, so that we still get to write out our statistics
+	terminating = 1;
+}
 
-	cwm_unbind_window_texture(&wm->cwm, window->internal_id);
+static void write_stats(my_wm_t* wm, const char* path, uint64_t start_time) {
+	// write statistics about the whole run as JSON, for benchmarking
 
-	// draw the shadow
-	// we do this after drawing the window contents so we can take advantage of alpha sorting
+	FILE* file = fopen(path, "w");
 
-	glUseProgram(wm->shadow_shader);
+	if (!file) {
+		fprintf(stderr, "WARNING Failed to open '%s' to write statistics\n", path);
+		return;
+	}
 
-	float shadow_opacity = 0.15 + 0.1 * (window_id == wm->focused_window_id);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	double duration = (double) (cwm_now() - start_time) / 1000000;
+
+	double user_time   = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0;
+	double system_time = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"duration_s\": %.3f,\n", duration);
+	fprintf(file, "\t\"cpu_user_s\": %.3f,\n", user_time);
+	fprintf(file, "\t\"cpu_system_s\": %.3f,\n", system_time);
+	fprintf(file, "\t\"cpu_percent\": %.1f,\n", duration > 0 ? (user_time + system_time) / duration * 100 : 0.0);
+	fprintf(file, "\t\"frames_rendered\": %" PRIu64 ",\n", wm->cwm.rendered_frame_count);
+	fprintf(file, "\t\"frames_skipped\": %" PRIu64 ",\n", wm->cwm.skipped_frame_count);
+	fprintf(file, "\t\"frame_time_ms\": { \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f },\n",
+		hud_frame_time_percentile(&wm->hud, 50), hud_frame_time_percentile(&wm->hud, 90),
+		hud_frame_time_percentile(&wm->hud, 99), hud_frame_time_percentile(&wm->hud, 100));
+	fprintf(file, "\t\"events_received\": %" PRIu64 ",\n", wm->wm.raw_event_count);
+	fprintf(file, "\t\"events_delivered\": %" PRIu64 ",\n", wm->wm.delivered_event_count);
+	fprintf(file, "\t\"x_queries\": %" PRIu64 ",\n", wm->wm.query_count);
+	fprintf(file, "\t\"window_slots\": { \"live\": %d, \"free\": %d, \"peak\": %d },\n", wm->wm.windows.live_count, slab_free_count(&wm->wm.windows), wm->wm.windows.peak_count);
+	fprintf(file, "\t\"pixmaps_created\": %" PRIu64 ",\n", wm->cwm.pixmap_creation_count);
+	fprintf(file, "\t\"backend\": \"%s\",\n", wm->cwm.backend == CWM_BACKEND_CPU ? "cpu" : "gl");
+	fprintf(file, "\t\"content_path\": \"%s\",\n", wm->cwm.content_path == CWM_CONTENT_SHM ? "shm" : "pixmap");
+	fprintf(file, "\t\"pixmap_binds\": %" PRIu64 ",\n", wm->cwm.bind_count);
+	fprintf(file, "\t\"uploaded_bytes\": %" PRIu64 ",\n", wm->cwm.uploaded_byte_count);
+	fprintf(file, "\t\"draw_calls\": %" PRIu64 ",\n", wm->draw_call_count);
+	fprintf(file, "\t\"cpu_tiles\": %" PRIu64 ",\n", wm->soft.tile_count);
+	fprintf(file, "\t\"unredirections\": %" PRIu64 "\n", wm->cwm.unredirection_count);
+	fprintf(file, "}\n");
+
+	fclose(file);
+}
+
+// main functions
+
+#define ANIMATION_THRESHOLD 0.0001
+
+static int animate(float* value, float target, float speed, float delta) {
+	// move 'value' a bit closer to 'target'
+	// once it's close enough, snap it so that we know the animation is over and we can stop drawing frames
+
+	*value += (target - *value) * delta * speed;
+
+	if (fabs(target - *value) > ANIMATION_THRESHOLD) {
+		return 1;
+	}
+
+	*value = target;
+	return 0;
+}
+
+static int animate_window(my_wm_t* wm, unsigned window_id, float delta) {
+	// returns whether or not the window is still animating
+
+	window_t* window = get_window(wm, window_id);
+
+	if (!window->exists ) return 0;
+	if (!window->visible) return 0;
+
+	int animating = 0;
+
+	// calculate visual window coordinates and size (animation)
+
+	delta = MIN(0.1, delta); // just make sure this doesn't get too crazy
+	                         // TODO see if this actually does anything
+
+	// the client can make its window translucent with the '_NET_WM_WINDOW_OPACITY' property, on top of whatever we're doing with it
+
+	float opacity = window->opacity * wm_get_window(&wm->wm, window->internal_id)->opacity;
+	animating |= animate(&window->visual_opacity, opacity, 10, delta);
+
+	animating |= animate(&window->visual_x, window->x, 20, delta);
+	animating |= animate(&window->visual_y, window->y, 20, delta);
+
+	// TODO for some reason, when disabling vsync, windows take a real long time before starting their "appearing" animation
+	//      maybe this is because of this?
+
+	animating |= animate(&window->visual_width,  window->width,  30, delta);
+	animating |= animate(&window->visual_height, window->height, 30, delta);
+
+	// calculate visual shadow parameters
+
+	int focused = window_id == focused_window_index(wm);
+	float shadow_opacity = 0.15 + 0.1 * focused;
 
 	// TODO do I really want to disable shadows on maximized windows?
 
@@ -527,28 +1045,767 @@ static void render_window(my_wm_t* wm, unsigned window_id, float delta) {
 	// }
 
 	// else {
-		window->visual_shadow_opacity += (shadow_opacity - window->visual_shadow_opacity) * delta * 30;
+		animating |= animate(&window->visual_shadow_opacity, shadow_opacity, 30, delta);
 	// }
 
-	glUniform1f(wm->shadow_strength_uniform, window->visual_opacity * window->visual_shadow_opacity);
+	float shadow_radius = (float) (64 + (64 * focused)); // pixels
+	animating |= animate(&window->visual_shadow_radius, shadow_radius, 20, delta);
+
+	// if anything changed, we need to repaint both where the window was and where it is now
+
+	cwm_rect_t bounds = window_bounds(wm, window);
+
+	if (animating || memcmp(&bounds, &window->bounds, sizeof(bounds))) {
+		damage_window(wm, window);
+		window->bounds = bounds;
+		damage_window(wm, window);
+	}
+
+	return animating;
+}
+
+static void set_instance_attributes(my_wm_t* wm, int first_instance) {
+	// point the instance attributes of the currently bound VAO at the instance buffer, starting from 'first_instance'
+	// OpenGL 3.3 doesn't have 'glDrawElementsInstancedBaseInstance', so this is how we draw a subset of the instances
+
+	size_t base = first_instance * sizeof(instance_t);
+	glBindBuffer(GL_ARRAY_BUFFER, wm->instance_vbo);
+
+	gl_instance_attribute(2, 2, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, position));
+	gl_instance_attribute(3, 2, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, size));
+	gl_instance_attribute(4, 1, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, depth));
+	gl_instance_attribute(5, 1, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, opacity));
+	gl_instance_attribute(6, 1, GL_INT,   sizeof(instance_t), base + offsetof(instance_t, texture_unit));
+	gl_instance_attribute(7, 1, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, shadow_strength));
+	gl_instance_attribute(8, 1, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, shadow_radius));
+	gl_instance_attribute(9, 4, GL_FLOAT, sizeof(instance_t), base + offsetof(instance_t, clip));
+}
+
+static void set_instance_clip(my_wm_t* wm, instance_t* instance, cwm_rect_t clip) {
+	instance->clip[0] = wm_x_coordinate_to_float(&wm->wm, clip.x);
+	instance->clip[1] = wm_y_coordinate_to_float(&wm->wm, clip.y + clip.height);
+	instance->clip[2] = wm_x_coordinate_to_float(&wm->wm, clip.x + clip.width);
+	instance->clip[3] = wm_y_coordinate_to_float(&wm->wm, clip.y);
+}
+
+static int window_drawn_opaque(my_wm_t* wm, window_t* window) {
+	// whether the window can be drawn without blending, i.e. it has no alpha channel and neither we nor the client are making it translucent
+
+	return window->visual_opacity >= 1.0 && cwm_window_opaque(&wm->cwm, window->internal_id);
+}
+
+static void occlude_windows(my_wm_t* wm) {
+	// walk the stack from the top down, keeping track of the region covered by the opaque windows we've gone through so far
+	// anything completely inside that region doesn't need to be drawn (or bound) at all, and anything partly inside it only needs to be drawn where it isn't
+
+	cwm_occlusion_t occlusion = { 0 };
+
+	for (int i = stack_previous(wm, -1); i >= 0; i = stack_previous(wm, i)) {
+		window_t* window = get_window(wm, i);
+
+		if (!window->exists ) continue;
+		if (!window->visible) continue;
+
+		cwm_rect_t rect = window_rect(wm, window);
+
+		window->occluded = !cwm_occlusion_visible(&occlusion, rect, &window->clip);
+		window->shadow_occluded = window->occluded && !cwm_occlusion_visible(&occlusion, window->bounds, NULL);
+
+		// translucent windows don't hide anything
+
+		if (!window_drawn_opaque(wm, window)) continue;
+
+		// the rounded corners don't hide anything either, so the window only covers a cross shape
+		// we also leave out a pixel on each side, since the window might be drawn a little off from where we think it is
+
+		int inset = 1;
+		int corner = CORNER_RADIUS + inset;
+
+		cwm_occlusion_add(&occlusion, (cwm_rect_t) { rect.x + inset, rect.y + corner, rect.width - inset * 2, rect.height - corner * 2 });
+		cwm_occlusion_add(&occlusion, (cwm_rect_t) { rect.x + corner, rect.y + inset, rect.width - corner * 2, rect.height - inset * 2 });
+	}
+}
+
+static void build_instances(my_wm_t* wm, cwm_damage_t* repaint) {
+	// fill in the instance data of all the windows we need to draw this frame, from the bottom of the stack to the top
+
+	cwm_rect_t repaint_bounds = cwm_damage_bounds(repaint);
+
+	wm->instance_count = 0;
+	int stack_position = 0;
+
+	for (int i = stack_next(wm, -1); i >= 0; i = stack_next(wm, i)) {
+		// each window gets its own depth so that the shadows of the windows below it don't draw over it
+
+		float depth = 1.0 - (float) ++stack_position / (wm->stacked_window_count + 1);
+		window_t* window = get_window(wm, i);
+
+		if (!window->exists ) continue;
+		if (!window->visible) continue;
+
+		// don't bother drawing anything if the window isn't in the region we're repainting
+
+		if (!cwm_rect_intersects(window->bounds, repaint_bounds)) continue;
+
+		// nor if it's completely hidden behind other windows
+
+		if (window->shadow_occluded) continue;
+
+		if (wm->instance_count >= wm->instance_capacity) {
+			wm->instance_capacity = wm->instance_capacity ? wm->instance_capacity * 2 : 16;
+
+			wm->instances        = (instance_t*) realloc(wm->instances,        wm->instance_capacity * sizeof(*wm->instances));
+			wm->instance_windows = (int*)        realloc(wm->instance_windows, wm->instance_capacity * sizeof(*wm->instance_windows));
+		}
+
+		float x = window->visual_x;
+		float y = window->visual_y;
+
+		float width  = window->visual_width;
+		float height = window->visual_height;
+
+		// check if window coordinates and size are pixel aligned
+		// rounding here instead of simply flooring to preserve proper subpixel rendering when animating
+
+		int width_pixels  = (int) round(width  / 2 * wm->x_resolution);
+		int height_pixels = (int) round(height / 2 * wm->y_resolution);
+
+		if (width_pixels  % 2) x += 0.5 / wm->x_resolution * 2; // if width odd, add half a pixel to x
+		if (height_pixels % 2) y += 0.5 / wm->y_resolution * 2; // if height odd, subtract half a pixel to y
+
+		// only draw the part of the window which isn't covered (plus a pixel for filtering)
+		// if it's completely covered, this collapses the window to nothing and we only draw its shadow
+
+		cwm_rect_t clip = { 0 };
+
+		if (!window->occluded) {
+			clip = (cwm_rect_t) { window->clip.x - 1, window->clip.y - 1, window->clip.width + 2, window->clip.height + 2 };
+		}
+
+		wm->instance_windows[wm->instance_count] = i;
+		instance_t* instance = &wm->instances[wm->instance_count++];
+
+		*instance = (instance_t) {
+			.position = { x, y },
+			.size = { width, height },
+
+			.depth = depth,
+			.opacity = window->visual_opacity,
+
+			.texture_unit = -1, // we only know this once we try binding the window
+
+			.shadow_strength = window->visual_opacity * window->visual_shadow_opacity,
+			.shadow_radius = window->visual_shadow_radius,
+		};
+
+		set_instance_clip(wm, instance, clip);
+	}
+}
+
+static void push_draw(my_wm_t* wm, int instance_index, cwm_rect_t clip) {
+	// draw the part of an instance's window which is inside 'clip' (in pixels)
+
+	if (clip.width <= 0 || clip.height <= 0) return;
+
+	if (wm->draw_count >= wm->draw_capacity) {
+		wm->draw_capacity = wm->draw_capacity ? wm->draw_capacity * 2 : 32;
+
+		wm->draws          = (instance_t*) realloc(wm->draws,          wm->draw_capacity * sizeof(*wm->draws));
+		wm->draw_instances = (int*)        realloc(wm->draw_instances, wm->draw_capacity * sizeof(*wm->draw_instances));
+	}
+
+	wm->draw_instances[wm->draw_count] = instance_index;
+	instance_t* draw = &wm->draws[wm->draw_count++];
+
+	*draw = wm->instances[instance_index];
+	set_instance_clip(wm, draw, clip);
+}
+
+static void build_draws(my_wm_t* wm, cwm_damage_t* repaint) {
+	// opaque windows are drawn first, without blending, from the top of the stack to the bottom, so that the depth test rejects whatever is hidden behind them before it's even shaded
+	// that's only possible where they're completely covered though, so we leave out their antialiased edges and rounded corners (we use the same cross shape as in 'occlude_windows', just a bit more conservative)
+	// translucent windows and the edges of opaque windows are then blended over that from the bottom of the stack to the top, which is the only order which gives the right result
+	// the insides of opaque windows are rejected by the depth test in that second pass, as they were already drawn at exactly the same depth
+
+	cwm_rect_t repaint_bounds = cwm_damage_bounds(repaint);
+
+	int inset = 2;
+	int corner = CORNER_RADIUS + inset;
+
+	wm->draw_count = 0;
+
+	for (int i = wm->instance_count - 1; i >= 0; i--) {
+		if (wm->instances[i].texture_unit < 0) continue;
+
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+		if (!window_drawn_opaque(wm, window)) continue;
+
+		cwm_rect_t rect = window_rect(wm, window);
+		cwm_rect_t clip = { window->clip.x - 1, window->clip.y - 1, window->clip.width + 2, window->clip.height + 2 };
+
+		push_draw(wm, i, cwm_rect_intersection(clip, (cwm_rect_t) { rect.x + inset, rect.y + corner, rect.width - inset * 2, rect.height - corner * 2 }));
+		push_draw(wm, i, cwm_rect_intersection(clip, (cwm_rect_t) { rect.x + corner, rect.y + inset, rect.width - corner * 2, rect.height - inset * 2 }));
+	}
+
+	wm->opaque_draw_count = wm->draw_count;
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		if (wm->instances[i].texture_unit < 0) continue;
+
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+		cwm_rect_t clip = { window->clip.x - 1, window->clip.y - 1, window->clip.width + 2, window->clip.height + 2 };
+
+		if (!window_drawn_opaque(wm, window)) {
+			push_draw(wm, i, clip);
+			continue;
+		}
+
+		// these strips go a pixel further out than the window, in case it's drawn a little off from where we think it is (the window's own quad is what actually limits them)
+		// most of the time (e.g. a terminal redrawing its cursor), the region we're repainting doesn't touch any of them
+
+		cwm_rect_t rect = window_rect(wm, window);
+
+		cwm_rect_t edges[] = {
+			{ rect.x - 1, rect.y - 1, rect.width + 2, corner + 1 }, // top
+			{ rect.x - 1, rect.y + rect.height - corner, rect.width + 2, corner + 1 }, // bottom
+			{ rect.x - 1, rect.y + corner, inset + 1, rect.height - corner * 2 }, // left
+			{ rect.x + rect.width - inset, rect.y + corner, inset + 1, rect.height - corner * 2 }, // right
+		};
+
+		for (int j = 0; j < sizeof(edges) / sizeof(*edges); j++) {
+			cwm_rect_t edge = cwm_rect_intersection(clip, edges[j]);
+
+			if (cwm_rect_intersects(edge, repaint_bounds)) {
+				push_draw(wm, i, edge);
+			}
+		}
+	}
+}
+
+static void draw_windows(my_wm_t* wm, cwm_damage_t* repaint, int start, int end) {
+	// draw the window contents of draws 'start' to 'end', with as many windows at a time as we have texture units
+	// a window can be drawn several times in a row (once for each part of it), so those share a texture unit
+
+	int first = start;
+
+	while (first < end) {
+		int unit_instances[TEXTURE_UNIT_COUNT]; // index of the instance whose window is bound to each texture unit
+		int unit_count = 0;
+
+		int count = 0;
+
+		for (; first + count < end; count++) {
+			int instance_index = wm->draw_instances[first + count];
+			int unit = -1;
+
+			for (int i = 0; i < unit_count; i++) {
+				if (unit_instances[i] == instance_index) {
+					unit = i;
+					break;
+				}
+			}
+
+			if (unit < 0) {
+				if (unit_count == TEXTURE_UNIT_COUNT) break;
+
+				unit = unit_count++;
+				unit_instances[unit] = instance_index;
+
+				cwm_use_window_texture(&wm->cwm, get_window(wm, wm->instance_windows[instance_index])->internal_id, unit);
+			}
+
+			wm->draws[first + count].texture_unit = unit;
+		}
 
-	float shadow_radius = (float) (64 + (64 * (window_id == wm->focused_window_id))); // pixels
-	window->visual_shadow_radius += (shadow_radius - window->visual_shadow_radius) * delta * 20;
+		glBufferSubData(GL_ARRAY_BUFFER, (wm->instance_count + first) * sizeof(instance_t), count * sizeof(instance_t), &wm->draws[first]);
+		set_instance_attributes(wm, wm->instance_count + first);
 
-	float spread_x = 4 * window->visual_shadow_radius / wm->x_resolution;
-	float spread_y = 4 * window->visual_shadow_radius / wm->y_resolution;
+		// draw once for each damaged rectangle
 
-	glUniform2f(wm->shadow_spread_uniform, spread_x, spread_y);
+		for (int i = 0; i < repaint->rect_count; i++) {
+			cwm_scissor(&wm->cwm, repaint->rects[i]);
+			glDrawElementsInstanced(GL_TRIANGLES, wm->quad_index_count, GL_UNSIGNED_BYTE, NULL, count);
+			wm->draw_call_count++;
+		}
+
+		first += count;
+	}
+}
 
-	float y_offset = -spread_y / 32 - spread_y / 16 * (window_id == wm->focused_window_id);
-	window->visual_shadow_y_offset += (y_offset - window->visual_shadow_y_offset) * delta * 10;
+static void draw_shadows(my_wm_t* wm, cwm_damage_t* repaint, int start, int end) {
+	// draw the shadows of instances 'start' to 'end' in one go
 
-	glUniform1f(wm->shadow_depth_uniform, depth);
-	glUniform2f(wm->shadow_position_uniform, x, y /* + window->visual_shadow_y_offset / 2 */);
-	glUniform2f(wm->shadow_size_uniform, width, height);
+	if (start >= end) return;
 
+	glUseProgram(wm->shadow_shader);
 	glBindVertexArray(wm->shadow_vao);
-	glDrawElements(GL_TRIANGLES, wm->shadow_index_count, GL_UNSIGNED_BYTE, NULL);
+	set_instance_attributes(wm, start);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, wm->shadow_texture);
+
+	for (int i = 0; i < repaint->rect_count; i++) {
+		cwm_scissor(&wm->cwm, repaint->rects[i]);
+		glDrawElementsInstanced(GL_TRIANGLES, wm->shadow_index_count, GL_UNSIGNED_BYTE, NULL, end - start);
+		wm->draw_call_count++;
+	}
+}
+
+static void render_windows(my_wm_t* wm, cwm_damage_t* repaint) {
+	if (!wm->instance_count) return;
+
+	// bind all the windows we're drawing up front, so that each only needs to be bound once, even if it's drawn in both passes
+	// windows completely hidden behind others don't need to be bound at all, we only draw their shadows
+
+	cwm_begin_window_binds(&wm->cwm);
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+		wm->instances[i].texture_unit = !window->occluded && cwm_bind_window_texture(&wm->cwm, window->internal_id, 0) ? 0 : -1;
+	}
+
+	cwm_finish_window_binds(&wm->cwm);
+
+	build_draws(wm, repaint);
+
+	// allocate this frame's instance buffer (this also orphans last frame's, so we don't have to wait for the GPU to be done with it)
+	// the instances go first, and the draws are uploaded after them as we go
+
+	glBindBuffer(GL_ARRAY_BUFFER, wm->instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, (wm->instance_count + wm->draw_count) * sizeof(instance_t), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, wm->instance_count * sizeof(instance_t), wm->instances);
+
+	glBindVertexArray(wm->window_vao);
+
+	glDisable(GL_BLEND);
+	glUseProgram(wm->opaque_shader);
+
+	draw_windows(wm, repaint, 0, wm->opaque_draw_count);
+
+	// translucent windows (and the edges of opaque ones) need the shadows below them to already be there when they're blended, so those shadows are drawn in stacking order as we go
+	// that's every shadow up to the topmost translucent window, without writing depth so that each window still draws over its own shadow
+	// the shadows above that only ever fall under opaque windows, so they can all be drawn in one go at the end (the depth test stops them from drawing over their own window and the ones above it)
+
+	int interleaved_shadow_count = 0;
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		if (wm->instances[i].texture_unit < 0) continue;
+
+		if (!window_drawn_opaque(wm, get_window(wm, wm->instance_windows[i]))) {
+			interleaved_shadow_count = i + 1;
+		}
+	}
+
+	glEnable(GL_BLEND);
+	glDepthMask(GL_FALSE);
+
+	int shadow_count = 0;
+	int first = wm->opaque_draw_count;
+
+	while (first < wm->draw_count || shadow_count < interleaved_shadow_count) {
+		// draw the shadows of every window up to the next one we're drawing, then all the draws of the windows whose shadows are down
+
+		int next = first < wm->draw_count ? wm->draw_instances[first] : wm->instance_count;
+
+		if (shadow_count <= next && shadow_count < interleaved_shadow_count) {
+			int end = MIN(next + 1, interleaved_shadow_count);
+
+			draw_shadows(wm, repaint, shadow_count, end);
+			shadow_count = end;
+		}
+
+		int last = first;
+		while (last < wm->draw_count && wm->draw_instances[last] < shadow_count) last++;
+
+		if (last == first) {
+			// the rest of the windows are above the topmost translucent one
+			last = wm->draw_count;
+		}
+
+		glDepthMask(GL_TRUE);
+		glBindVertexArray(wm->window_vao);
+		glUseProgram(wm->shader);
+
+		draw_windows(wm, repaint, first, last);
+		first = last;
+
+		glDepthMask(GL_FALSE);
+	}
+
+	glDepthMask(GL_TRUE);
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		if (wm->instances[i].texture_unit < 0) continue;
+
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+		cwm_unbind_window_texture(&wm->cwm, window->internal_id);
+	}
+
+	cwm_end_window_binds(&wm->cwm);
+
+	// draw the rest of the shadows in one go
+
+	draw_shadows(wm, repaint, shadow_count, wm->instance_count);
+}
+
+static void render_windows_cpu(my_wm_t* wm, cwm_damage_t* repaint) {
+	// same as 'render_windows', but with the CPU compositor (see 'soft.h')
+	// each window is drawn over its own shadow, from the bottom of the stack to the top
+
+	cwm_begin_window_binds(&wm->cwm);
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+		wm->instances[i].texture_unit = !window->occluded && cwm_bind_window_texture(&wm->cwm, window->internal_id, 0) ? 0 : -1;
+	}
+
+	cwm_finish_window_binds(&wm->cwm);
+
+	if (wm->instance_count > wm->layer_capacity) {
+		wm->layer_capacity = wm->instance_count;
+		wm->layers = (soft_layer_t*) realloc(wm->layers, wm->layer_capacity * sizeof(*wm->layers));
+	}
+
+	// instances are in normalized device coordinates, but the CPU compositor works in pixels from the top left of the screen
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		instance_t* instance = &wm->instances[i];
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+
+		float width  = instance->size[0] / 2 * wm->x_resolution;
+		float height = instance->size[1] / 2 * wm->y_resolution;
+
+		soft_layer_t* layer = &wm->layers[i];
+
+		*layer = (soft_layer_t) {
+			.x = (instance->position[0] + 1) / 2 * wm->x_resolution - width  / 2,
+			.y = (1 - instance->position[1]) / 2 * wm->y_resolution - height / 2,
+
+			.width = width,
+			.height = height,
+
+			.opacity = instance->opacity,
+			.opaque = window_drawn_opaque(wm, window),
+
+			.clip = window->clip, // an occluded window doesn't get any pixels, so we only draw its shadow
+
+			.shadow_strength = instance->shadow_strength,
+			.shadow_radius = instance->shadow_radius,
+		};
+
+		if (instance->texture_unit >= 0) {
+			layer->pixels = cwm_window_pixels(&wm->cwm, window->internal_id, &layer->pixels_width, &layer->pixels_height);
+			layer->has_alpha = !cwm_window_opaque(&wm->cwm, window->internal_id);
+		}
+	}
+
+	soft_render(&wm->soft, wm->layers, wm->instance_count, repaint);
+
+	for (int i = 0; i < wm->instance_count; i++) {
+		if (wm->instances[i].texture_unit < 0) continue;
+
+		window_t* window = get_window(wm, wm->instance_windows[i]);
+		cwm_unbind_window_texture(&wm->cwm, window->internal_id);
+	}
+
+	cwm_end_window_binds(&wm->cwm);
+}
+
+static GLubyte* create_shadow_falloff(void) {
+	// work out the shadow falloff once and for all, so that the shadow shader (or the CPU compositor) doesn't have to do it for every pixel of every shadow
+	// the left and bottom halves of the texture go from the outer edges of the shadow to where it stops fading out, the right and top halves are the same thing going the other way
+	// the shadow is a bit longer below the window than above it, so the bottom and top halves aren't quite symmetric
+
+	const int size = SHADOW_SLICE_SIZE * 2;
+	GLubyte* data = (GLubyte*) malloc(size * size);
+
+	for (int j = 0; j < size; j++) {
+		int top = j >= SHADOW_SLICE_SIZE;
+		float t = (top ? size - j - 0.5 : j + 0.5) / SHADOW_SLICE_SIZE; // 0 on the outer edge, 1 where the falloff stops
+
+		float dy = (1 + SHADOW_INSET) * (1 - t);
+		dy = MIN(1.0, top ? dy * 1.5 : dy / 1.2);
+
+		for (int i = 0; i < size; i++) {
+			float s = (i >= SHADOW_SLICE_SIZE ? size - i - 0.5 : i + 0.5) / SHADOW_SLICE_SIZE;
+			float dx = MIN(1.0, (1 + SHADOW_INSET) * (1 - s));
+
+			float value = 1.0 - MIN(1.0, sqrt(dx * dx + dy * dy));
+			data[j * size + i] = (GLubyte) round(value * value * 255);
+		}
+	}
+
+	return data;
+}
+
+static GLuint create_shadow_texture(void) {
+	const int size = SHADOW_SLICE_SIZE * 2;
+	GLubyte* data = create_shadow_falloff();
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, size, size, 0, GL_RED, GL_UNSIGNED_BYTE, data);
+
+	free(data);
+
+	// unfocused windows have smaller shadows, so we need mipmaps for the texture not to alias when it's shrunk
+
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	return texture;
+}
+
+static void create_gl_objects(my_wm_t* wm) {
+	// create everything we need to draw with OpenGL
+
+	// shared quad
+	// all windows are drawn as this, scaled to their size by the vertex shader
+
+	const GLubyte quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+	const GLfloat quad_vertex_positions[] = {
+		-0.5,  0.5,
+		-0.5, -0.5,
+		 0.5, -0.5,
+		 0.5,  0.5,
+	};
+
+	gl_create_vao_vbo_ibo(&wm->window_vao, &wm->quad_vbo, &wm->quad_ibo);
+
+	wm->quad_index_count = sizeof(quad_indices) / sizeof(*quad_indices);
+	gl_set_vao_vbo_ibo_data(wm->window_vao, wm->quad_vbo, sizeof(quad_vertex_positions), quad_vertex_positions, wm->quad_ibo, sizeof(quad_indices), quad_indices);
+
+	glGenBuffers(1, &wm->instance_vbo);
+	set_instance_attributes(wm, 0);
+
+	const char* vertex_shader_source = "#version 330\n"
+		"layout(location = 0) in vec2 vertex_position;"
+
+		"layout(location = 2) in vec2 instance_position;"
+		"layout(location = 3) in vec2 instance_size;"
+		"layout(location = 4) in float instance_depth;"
+		"layout(location = 5) in float instance_opacity;"
+		"layout(location = 6) in int instance_texture_unit;"
+		"layout(location = 9) in vec4 instance_clip;"
+
+		"out vec2 local_position;"
+		"out vec2 pixel_position;"
+		"out float opacity;"
+		"flat out vec2 half_size;"
+		"flat out int texture_unit;"
+
+		"uniform vec2 pixel_size;"
+
+		"void main(void) {"
+		"	vec2 position = clamp(vertex_position * instance_size + instance_position, instance_clip.xy, instance_clip.zw);"
+
+		"	local_position = (position - instance_position) / instance_size;"
+		"	half_size = instance_size / pixel_size / 2;"
+		"	pixel_position = local_position * half_size * 2;"
+
+		"	opacity = instance_opacity;"
+		"	texture_unit = instance_texture_unit;"
+
+		"	gl_Position = vec4(position, instance_depth, 1.0);"
+		"}";
+
+	// GLSL 3.30 only lets us index sampler arrays with constants, hence the switch
+	// this is shared between the window shader and the opaque window shader
+
+	#define SAMPLE_WINDOW_SOURCE \
+		"flat in int texture_unit;" \
+		"uniform sampler2D texture_samplers[8];" \
+		\
+		"vec4 sample_window(vec2 coords) {" \
+		"	switch (texture_unit) {" \
+		"		case 0: return texture(texture_samplers[0], coords);" \
+		"		case 1: return texture(texture_samplers[1], coords);" \
+		"		case 2: return texture(texture_samplers[2], coords);" \
+		"		case 3: return texture(texture_samplers[3], coords);" \
+		"		case 4: return texture(texture_samplers[4], coords);" \
+		"		case 5: return texture(texture_samplers[5], coords);" \
+		"		case 6: return texture(texture_samplers[6], coords);" \
+		"		default: return texture(texture_samplers[7], coords);" \
+		"	}" \
+		"}"
+
+	// the rounded corners are cut out using the signed distance from the pixel to the edge of the rounded rectangle
+	// a pixel is covered proportionally to how far inside that edge it is, which gives us antialiasing without having to multisample
+
+	const char* fragment_shader_source = "#version 330\n"
+		"in vec2 local_position;"
+		"in vec2 pixel_position;"
+		"in float opacity;"
+		"flat in vec2 half_size;"
+
+		"out vec4 fragment_colour;"
+
+		"uniform float corner_radius;"
+
+		SAMPLE_WINDOW_SOURCE
+
+		"float rounded_rectangle_distance(vec2 position, vec2 half_size, float radius) {"
+		"	vec2 q = abs(position) - half_size + radius;"
+		"	return length(max(q, 0.0)) + min(max(q.x, q.y), 0.0) - radius;"
+		"}"
+
+		"void main(void) {"
+		"	if (texture_unit < 0) discard;" // window couldn't be bound
+
+		"	float radius = min(corner_radius, min(half_size.x, half_size.y));"
+		"	float coverage = clamp(0.5 - rounded_rectangle_distance(pixel_position, half_size, radius), 0.0, 1.0);"
+
+		"	if (coverage <= 0.0) discard;" // so we don't write to the depth buffer outside of the window
+
+		"	vec4 colour = sample_window(local_position * vec2(1.0, -1.0) + vec2(0.5));"
+		"	float alpha = opacity * colour.a * coverage;"
+
+		"	fragment_colour = vec4(colour.rgb, alpha);"
+		"}";
+
+	wm->shader = gl_create_shader_program(vertex_shader_source, fragment_shader_source);
+	wm->pixel_size_uniform = glGetUniformLocation(wm->shader, "pixel_size");
+	wm->corner_radius_uniform = glGetUniformLocation(wm->shader, "corner_radius");
+
+	// these never change, so set them once and for all
+
+	const GLint texture_units[TEXTURE_UNIT_COUNT] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+	glUseProgram(wm->shader);
+	glUniform1iv(glGetUniformLocation(wm->shader, "texture_samplers"), TEXTURE_UNIT_COUNT, texture_units);
+	glUniform2f(wm->pixel_size_uniform, 2.0 / wm->x_resolution, 2.0 / wm->y_resolution);
+	glUniform1f(wm->corner_radius_uniform, CORNER_RADIUS);
+
+	// opaque windows are only drawn where they're completely covered, so there's nothing to cut out, nothing to blend, and nothing to discard
+	// (discarding would stop the GPU from doing the depth test before running the shader, which is the whole point of drawing them separately)
+
+	const char* opaque_fragment_shader_source = "#version 330\n"
+		"in vec2 local_position;"
+
+		"out vec4 fragment_colour;"
+
+		SAMPLE_WINDOW_SOURCE
+
+		"void main(void) {"
+		"	fragment_colour = vec4(sample_window(local_position * vec2(1.0, -1.0) + vec2(0.5)).rgb, 1.0);"
+		"}";
+
+	wm->opaque_shader = gl_create_shader_program(vertex_shader_source, opaque_fragment_shader_source);
+	wm->opaque_pixel_size_uniform = glGetUniformLocation(wm->opaque_shader, "pixel_size");
+
+	glUseProgram(wm->opaque_shader);
+	glUniform1iv(glGetUniformLocation(wm->opaque_shader, "texture_samplers"), TEXTURE_UNIT_COUNT, texture_units);
+	glUniform2f(wm->opaque_pixel_size_uniform, 2.0 / wm->x_resolution, 2.0 / wm->y_resolution);
+
+	// shadow stuff
+	// the shadows use the same instance buffer as the windows, so they can all be drawn at once too
+	// the ring is a 4x4 grid of vertices with the middle cell left out
+	// each vertex is a corner of the shadow (its anchor), moved towards the middle by 0 or 1 times the size of a slice of the shadow texture (its inset)
+
+	GLubyte shadow_indices[8 * 6];
+	GLfloat shadow_vertices[4 * 4 * 4];
+
+	for (int y = 0; y < 4; y++) {
+		for (int x = 0; x < 4; x++) {
+			GLfloat* vertex = &shadow_vertices[(y * 4 + x) * 4];
+
+			vertex[0] = x < 2 ? -0.5 : 0.5;
+			vertex[1] = y < 2 ? -0.5 : 0.5;
+
+			vertex[2] = x == 1 || x == 2;
+			vertex[3] = y == 1 || y == 2;
+		}
+	}
+
+	wm->shadow_index_count = 0;
+
+	for (int y = 0; y < 3; y++) {
+		for (int x = 0; x < 3; x++) {
+			if (x == 1 && y == 1) continue;
+
+			GLubyte i = y * 4 + x;
+			const GLubyte cell_indices[] = { i + 4, i, i + 1, i + 4, i + 1, i + 5 };
+
+			memcpy(&shadow_indices[wm->shadow_index_count], cell_indices, sizeof(cell_indices));
+			wm->shadow_index_count += sizeof(cell_indices) / sizeof(*cell_indices);
+		}
+	}
+
+	gl_create_vao_vbo_ibo(&wm->shadow_vao, &wm->shadow_vbo, &wm->shadow_ibo);
+	gl_set_vao_vbo_ibo_data(wm->shadow_vao, wm->shadow_vbo, sizeof(shadow_vertices), shadow_vertices, wm->shadow_ibo, sizeof(shadow_indices), shadow_indices);
+
+	gl_vertex_attribute(0, 2, 4 * sizeof(GLfloat), 0);
+	gl_vertex_attribute(1, 2, 4 * sizeof(GLfloat), 2 * sizeof(GLfloat));
+
+	set_instance_attributes(wm, 0);
+
+	const char* shadow_vertex_shader_source = "#version 330\n"
+		"layout(location = 0) in vec2 vertex_anchor;"
+		"layout(location = 1) in vec2 vertex_inset;"
+
+		"layout(location = 2) in vec2 instance_position;"
+		"layout(location = 3) in vec2 instance_size;"
+		"layout(location = 4) in float instance_depth;"
+		"layout(location = 7) in float instance_shadow_strength;"
+		"layout(location = 8) in float instance_shadow_radius;"
+
+		"out vec2 texture_coords;"
+		"out float strength;"
+
+		"uniform vec2 pixel_size;"
+		"uniform float shadow_inset;"
+
+		"void main(void) {"
+		"	strength = instance_shadow_strength;"
+
+		// everything here is in pixels
+		// the slices can't be bigger than half the shadow, or else the ring would fold over itself
+
+		"	vec2 size = instance_size / pixel_size + 2 * instance_shadow_radius;"
+		"	float slice = instance_shadow_radius * (1 + shadow_inset);"
+
+		"	vec2 side = sign(vertex_anchor);"
+		"	vec2 inset = vertex_inset * min(vec2(slice), size / 2);"
+
+		"	texture_coords = 0.5 + side * (0.5 - inset / max(slice, 1.0) / 2);"
+		"	gl_Position = vec4((vertex_anchor * size - side * inset) * pixel_size + instance_position, instance_depth, 1.0);"
+		"}";
+
+	const char* shadow_fragment_shader_source = "#version 330\n"
+		"in vec2 texture_coords;"
+		"in float strength;"
+
+		"out vec4 fragment_colour;"
+
+		"uniform sampler2D shadow_sampler;"
+
+		"void main(void) {"
+		"	fragment_colour = vec4(0.0, 0.0, 0.0, texture(shadow_sampler, texture_coords).r * strength);"
+		"}";
+
+	wm->shadow_shader = gl_create_shader_program(shadow_vertex_shader_source, shadow_fragment_shader_source);
+	wm->shadow_pixel_size_uniform = glGetUniformLocation(wm->shadow_shader, "pixel_size");
+	wm->shadow_inset_uniform = glGetUniformLocation(wm->shadow_shader, "shadow_inset");
+
+	glUseProgram(wm->shadow_shader);
+	glUniform1i(glGetUniformLocation(wm->shadow_shader, "shadow_sampler"), 0);
+	glUniform2f(wm->shadow_pixel_size_uniform, 2.0 / wm->x_resolution, 2.0 / wm->y_resolution);
+	glUniform1f(wm->shadow_inset_uniform, SHADOW_INSET);
+
+	wm->shadow_texture = create_shadow_texture();
+
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
 
 int main(int argc, char* argv[]) {
@@ -558,6 +1815,14 @@ int main(int argc, char* argv[]) {
 	my_wm_t* wm = &_wm;
 	memset(wm, 0, sizeof(*wm));
 
+	for (int i = 0; i < LAYER_COUNT; i++) {
+		wm->stack_bottoms[i] = -1;
+		wm->stack_tops[i] = -1;
+	}
+
+	new_slab(&wm->windows, sizeof(window_t));
+	wm->focused_window = SLAB_NO_HANDLE;
+
 	// create a compositing window manager
 
 	new_wm(&wm->wm);
@@ -594,147 +1859,174 @@ int main(int argc, char* argv[]) {
 	wm->wm.create_event_callback   = (wm_create_event_callback_t)   create_event;
 	wm->wm.modify_event_callback   = (wm_modify_event_callback_t)   modify_event;
 	wm->wm.destroy_event_callback  = (wm_destroy_event_callback_t)  destroy_event;
+	wm->wm.damage_event_callback   = (wm_damage_event_callback_t)   damage_event;
 
 	// run any startup programs here
 	
 	// system("code-oss");
 
-	// OpenGL stuff
+	// OpenGL stuff, or the CPU compositor if we can't use OpenGL
+	// the background is the same gruvbox colour (#292828) the OpenGL path clears to
 
-	const char* vertex_shader_source = "#version 330\n"
-		"layout(location = 0) in vec2 vertex_position;"
-		"out vec2 local_position;"
+	if (wm->cwm.backend == CWM_BACKEND_CPU) {
+		new_soft(&wm->soft, &wm->cwm, CORNER_RADIUS, 0x292828);
+		soft_set_shadow(&wm->soft, create_shadow_falloff(), SHADOW_SLICE_SIZE, SHADOW_INSET);
+	}
 
-		"uniform float depth;"
-		"uniform vec2 position;"
-		"uniform vec2 size;"
+	else {
+		create_gl_objects(wm);
+	}
 
-		"void main(void) {"
-		"	local_position = vertex_position;"
-		"	gl_Position = vec4(vertex_position * size + position, depth, 1.0);"
-		"}";
+	// performance HUD
 
-	const char* fragment_shader_source = "#version 330\n"
-		"in vec2 local_position;"
-		"out vec4 fragment_colour;"
+	new_hud(&wm->hud, &wm->cwm, wm->quad_vbo, wm->quad_ibo, wm->quad_index_count);
 
-		"uniform float opacity;"
-		"uniform sampler2D texture_sampler;"
+	// adopt all the windows which were already there before we started, and get back whatever state we handed over to ourselves if we were restarted
 
-		"void main(void) {"
-		"   vec4 colour = texture(texture_sampler, local_position * vec2(1.0, -1.0) + vec2(0.5));"
-		"	float alpha = opacity * (1.0 - colour.a);"
+	wm->adopting = 1;
+	wm_adopt_windows(&wm->wm, wm);
+	wm->adopting = 0;
 
-		"	fragment_colour = vec4(colour.rgb, alpha);"
-		"}";
+	load_restart_state(wm);
 
-	wm->shader = gl_create_shader_program(vertex_shader_source, fragment_shader_source);
-	wm->texture_uniform = glGetUniformLocation(wm->shader, "texture_sampler");
+	// main loop
 
-	wm->opacity_uniform = glGetUniformLocation(wm->shader, "opacity");
-	wm->depth_uniform = glGetUniformLocation(wm->shader, "depth");
+	float average_delta = 0.0;
 
-	wm->position_uniform = glGetUniformLocation(wm->shader, "position");
-	wm->size_uniform = glGetUniformLocation(wm->shader, "size");
+	// stop cleanly when we're asked to, instead of just dying (mostly useful for benchmarks)
 
-	// shadow stuff
+	signal(SIGTERM, terminate_signal_handler);
+	signal(SIGINT,  terminate_signal_handler);
 
-	const GLubyte shadow_indices[] = { 0, 1, 2, 0, 2, 3 };
+	uint64_t start_time = cwm_now();
 
-	const GLfloat shadow_vertex_positions[] = {
-		-0.5,  0.5,
-		-0.5, -0.5,
-		 0.5, -0.5,
-		 0.5,  0.5,
-	};
+	wm->running = 1;
+	while (wm->running && !terminating) {
+		// wait until either something happens or it's time to draw the next frame, and then handle all the events we got in one batch
 
-	gl_create_vao_vbo_ibo(&wm->shadow_vao, &wm->shadow_vbo, &wm->shadow_ibo);
+		wm_wait_events(&wm->wm, cwm_frame_timeout(&wm->cwm));
 
-	wm->shadow_index_count = sizeof(shadow_indices) / sizeof(*shadow_indices);
-	gl_set_vao_vbo_ibo_data(wm->shadow_vao, wm->shadow_vbo, sizeof(shadow_vertex_positions), shadow_vertex_positions, wm->shadow_ibo, sizeof(shadow_indices), shadow_indices);
+		wm->hud.frame_start = cwm_now();
+		wm_process_events(&wm->wm, wm);
+		wm->hud.events_end = cwm_now();
 
-	const char* shadow_vertex_shader_source = "#version 330\n"
-		"layout(location = 0) in vec2 vertex_position;"
+		// check if a window can bypass compositing altogether (or if the one which did can't anymore)
+		// if it covers the whole screen, there's no point in drawing anything until that changes
 
-		"out vec2 map_position;"
+		update_unredirection(wm);
 
-		"uniform float depth;"
-		"uniform vec2 position;"
-		"uniform vec2 size;"
-		"uniform vec2 spread;"
+		if (wm->cwm.suspended) {
+			cwm_skip_frame(&wm->cwm);
+			wm->cwm.needs_repaint = 0;
 
-		"void main(void) {"
-		"	map_position = vertex_position * (size + spread);"
-		"	gl_Position = vec4(map_position + position, depth, 1.0);"
-		"}";
+			continue;
+		}
 
-	const char* shadow_fragment_shader_source = "#version 330\n"
-		"in vec2 map_position;"
-		"out vec4 fragment_colour;"
+		// if nothing changed since the last frame, don't bother redrawing anything
 
-		"uniform float strength;"
+		if (!wm->cwm.needs_repaint) {
+			continue;
+		}
 
-		"uniform vec2 size;"
-		"uniform vec2 spread;"
+		// if something did change but it's too early to draw the next frame, go back to waiting (this will sleep until the deadline)
 
-		"void main(void) {"
+		if (!cwm_frame_due(&wm->cwm)) {
+			continue;
+		}
 
-		// find distance from point on shadow plane to window bounds
+		wm->cwm.needs_repaint = 0;
 
-		"	float dx = (2 * abs(map_position.x) - size.x + spread.x / 8) / spread.x;"
-		"	float dy = (2 * abs(map_position.y) - size.y + spread.y / 8) / spread.y;"
+		// update our windows' animations
+		// if any of them are still animating, we're gonna need to draw another frame after this one
 
-		"	if (map_position.y > 0) dy *= 1.5;"
-		"	if (map_position.y < 0) dy /= 1.2;"
+		int animating = 0;
 
-		"	dx = clamp(dx, 0, 1);"
-		"	dy = clamp(dy, 0, 1);"
+		for (int i = 0; i < wm->windows.slot_count; i++) {
+			animating |= animate_window(wm, i, average_delta);
+		}
 
-		// calculate the shadow colour
+		if (animating) {
+			cwm_request_repaint(&wm->cwm);
+		}
 
-		"	float value = 1.0 - clamp(length(vec2(dx, dy)), 0, 1);"
-		"	fragment_colour = vec4(0.0, 0.0, 0.0, value * value) * strength;"
-		"}";
+		// refresh the HUD if it's time to, so that it's repainted along with the rest of this frame
 
-	wm->shadow_shader = gl_create_shader_program(shadow_vertex_shader_source, shadow_fragment_shader_source);
+		hud_update(&wm->hud);
 
-	wm->shadow_strength_uniform = glGetUniformLocation(wm->shadow_shader, "strength");
+		// now that we know everything that changed this frame, find out what we actually need to repaint
 
-	wm->shadow_depth_uniform = glGetUniformLocation(wm->shadow_shader, "depth");
-	wm->shadow_position_uniform = glGetUniformLocation(wm->shadow_shader, "position");
-	wm->shadow_size_uniform = glGetUniformLocation(wm->shadow_shader, "size");
+		cwm_damage_t* repaint = cwm_repaint_region(&wm->cwm);
 
-	wm->shadow_spread_uniform = glGetUniformLocation(wm->shadow_shader, "spread");
+		// if nothing on screen actually changed (e.g. a window animating off-screen), there's nothing to present
+		// we still wait until the next deadline though, so that we don't spin
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		if (!repaint->rect_count) {
+			cwm_defer_frame(&wm->cwm);
+			continue;
+		}
 
-	// main loop
+		// render our windows (opaque ones from the top of the stack to the bottom, and then translucent ones from the bottom to the top)
+		// the CPU compositor clears the screen itself, and only where it's not covered by an opaque window anyway
 
-	float average_delta = 0.0;
+		occlude_windows(wm);
+		build_instances(wm, repaint);
 
-	wm->running = 1;
-	while (wm->running) {
-		while (wm_process_events(&wm->wm, wm));
+		if (wm->cwm.backend == CWM_BACKEND_CPU) {
+			render_windows_cpu(wm, repaint);
+		}
+
+		else {
+			glEnable(GL_SCISSOR_TEST);
 
-		// glClearColor(0.4, 0.2, 0.4, 1.0);
-		// gruvbox background colour (#292828)
-		glClearColor(0.16015625, 0.15625, 0.15625, 1.);
-		
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			// glClearColor(0.4, 0.2, 0.4, 1.0);
+			// gruvbox background colour (#292828)
+			glClearColor(0.16015625, 0.15625, 0.15625, 1.);
 
-		// render our windows
+			for (int i = 0; i < repaint->rect_count; i++) {
+				cwm_scissor(&wm->cwm, repaint->rects[i]);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			}
+
+			render_windows(wm, repaint);
+			hud_render(&wm->hud, repaint);
 
-		for (int i = 0; i < wm->window_count; i++) {
-			render_window(wm, i, average_delta);
+			glDisable(GL_SCISSOR_TEST);
 		}
 
+		wm->hud.render_end = cwm_now();
+
 		float delta = (float) cwm_swap(&wm->cwm) / 1000000;
 
+		wm->hud.swap_end = cwm_now();
+		hud_record_frame(&wm->hud, wm->wm.raw_event_count, wm->cwm.bind_count, wm->draw_call_count);
+
 		average_delta += delta;
 		average_delta /= 2;
+	}
+
+	printf("Rendered %" PRIu64 " frames, skipped %" PRIu64 " frames\n", wm->cwm.rendered_frame_count, wm->cwm.skipped_frame_count);
+
+	for (int i = 0; i < wm->cwm.output_count; i++) {
+		cwm_output_t* output = &wm->cwm.outputs[i];
+		printf("Output %d (%dx%d+%d+%d): rendered %" PRIu64 " frames\n", i, output->rect.width, output->rect.height, output->rect.x, output->rect.y, output->rendered_frame_count);
+	}
+	printf("Received %" PRIu64 " events, delivered %" PRIu64 " after coalescing\n", wm->wm.raw_event_count, wm->wm.delivered_event_count);
+	printf("Sent %" PRIu64 " queries to keep track of windows\n", wm->wm.query_count);
+	printf("Window slots: %d live, %d free, %d at peak\n", wm->wm.windows.live_count, slab_free_count(&wm->wm.windows), wm->wm.windows.peak_count);
+	printf("Created %" PRIu64 " window pixmaps, destroyed %" PRIu64 " window pixmaps\n", wm->cwm.pixmap_creation_count, wm->cwm.pixmap_destruction_count);
+	if (wm->cwm.content_path == CWM_CONTENT_SHM) printf("Uploaded %" PRIu64 " bytes of window contents through MIT-SHM\n", wm->cwm.uploaded_byte_count);
+	if (wm->cwm.backend == CWM_BACKEND_CPU) printf("Drew %" PRIu64 " tiles with the CPU compositor (%d threads)\n", wm->soft.tile_count, wm->soft.thread_count);
+	printf("Unredirected %" PRIu64 " windows\n", wm->cwm.unredirection_count);
+
+	// if asked to, write all that in a more machine-readable way
+
+	const char* stats_path = getenv("CWM_STATS");
+
+	if (stats_path) {
+		write_stats(wm, stats_path, start_time);
+	}
 
-		// printf("average fps %f\n", 1 / average_delta);
+	if (wm->cwm.backend == CWM_BACKEND_CPU) {
+		free_soft(&wm->soft);
 	}
 }
@@ -63,4 +63,22 @@ void gl_set_vao_vbo_ibo_data(GLuint vao, GLuint vbo, GLsizeiptr vbo_size, const
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, ibo_size, ibo_data, GL_STATIC_DRAW);
-}
\ No newline at end of file
+}
+
+// vertex attributes
+// these apply to the VAO and the 'GL_ARRAY_BUFFER' currently bound
+
+void gl_vertex_attribute(GLuint index, GLint size, GLsizei stride, size_t offset) {
+	glVertexAttribPointer(index, size, GL_FLOAT, GL_FALSE, stride, (const void*) offset);
+	glEnableVertexAttribArray(index);
+}
+
+void gl_instance_attribute(GLuint index, GLint size, GLenum type, GLsizei stride, size_t offset) {
+	// integer attributes must go through 'glVertexAttribIPointer', or else they're converted to floats
+
+	if (type == GL_INT) glVertexAttribIPointer(index, size, type, stride, (const void*) offset);
+	else glVertexAttribPointer(index, size, type, GL_FALSE, stride, (const void*) offset);
+
+	glEnableVertexAttribArray(index);
+	glVertexAttribDivisor(index, 1); // advance once per instance instead of once per vertex
+}
@@ -0,0 +1,151 @@
+// this file contains a slab allocator, which we use for records which come and go all the time (such as per-window state)
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// slots are allocated in chunks of 'SLAB_CHUNK_SIZE', which are never moved or freed until the whole slab is
+// so a pointer to a slot stays valid for as long as the slot is in use (and reading a freed slot is still safe, it just holds whatever was last in it)
+// freed slots go on a free list and are reused before we allocate any new chunk, so churning through lots of short-lived records doesn't make us grow forever
+
+#define SLAB_CHUNK_BITS 6
+#define SLAB_CHUNK_SIZE (1 << SLAB_CHUNK_BITS)
+
+// handles refer to a slot along with its generation, which is bumped each time the slot is freed
+// this way, a handle to a record which has since been freed can be told apart from a handle to whatever reused its slot
+// the index is in the lower 'SLAB_INDEX_BITS' bits and the generation in the rest (so a handle only goes stale for good after its slot has been reused 256 times)
+
+#define SLAB_INDEX_BITS 24
+#define SLAB_INDEX_MASK ((1u << SLAB_INDEX_BITS) - 1)
+
+#define SLAB_NO_HANDLE ((slab_handle_t) -1) // never refers to anything, as there can't be that many slots
+
+typedef uint32_t slab_handle_t;
+
+typedef struct {
+	size_t slot_size;
+
+	char** chunks;
+	int chunk_count;
+
+	// per-slot bookkeeping, indexed by slot index
+	// unlike the slots themselves, nothing points into these, so it's fine for them to move around when they grow
+
+	uint8_t* generations;
+	uint8_t* used;
+	int* next_free; // next slot in the free list (-1 at the end)
+
+	int slot_count; // always 'chunk_count * SLAB_CHUNK_SIZE'
+	int free_head; // first slot of the free list (-1 if it's empty)
+
+	// statistics
+
+	int live_count;
+	int peak_count;
+} slab_t;
+
+void new_slab(slab_t* slab, size_t slot_size) {
+	memset(slab, 0, sizeof(*slab));
+
+	slab->slot_size = slot_size;
+	slab->free_head = -1;
+}
+
+void free_slab(slab_t* slab) {
+	for (int i = 0; i < slab->chunk_count; i++) {
+		free(slab->chunks[i]);
+	}
+
+	free(slab->chunks);
+
+	free(slab->generations);
+	free(slab->used);
+	free(slab->next_free);
+
+	new_slab(slab, slab->slot_size);
+}
+
+static void __slab_grow(slab_t* slab) {
+	// add a chunk and put all its slots on the free list, lowest index first
+
+	int first_slot = slab->slot_count;
+
+	slab->chunks = (char**) realloc(slab->chunks, (slab->chunk_count + 1) * sizeof(*slab->chunks));
+	slab->chunks[slab->chunk_count++] = (char*) calloc(SLAB_CHUNK_SIZE, slab->slot_size);
+
+	slab->slot_count += SLAB_CHUNK_SIZE;
+
+	slab->generations = (uint8_t*) realloc(slab->generations, slab->slot_count * sizeof(*slab->generations));
+	slab->used        = (uint8_t*) realloc(slab->used,        slab->slot_count * sizeof(*slab->used));
+	slab->next_free   = (int*)     realloc(slab->next_free,   slab->slot_count * sizeof(*slab->next_free));
+
+	memset(&slab->generations[first_slot], 0, SLAB_CHUNK_SIZE * sizeof(*slab->generations));
+	memset(&slab->used       [first_slot], 0, SLAB_CHUNK_SIZE * sizeof(*slab->used));
+
+	for (int i = first_slot; i < slab->slot_count; i++) {
+		slab->next_free[i] = i + 1 < slab->slot_count ? i + 1 : slab->free_head;
+	}
+
+	slab->free_head = first_slot;
+}
+
+static inline void* slab_get(slab_t* slab, int index) {
+	return slab->chunks[index >> SLAB_CHUNK_BITS] + (size_t) (index & (SLAB_CHUNK_SIZE - 1)) * slab->slot_size;
+}
+
+static inline int slab_used(slab_t* slab, int index) {
+	return index >= 0 && index < slab->slot_count && slab->used[index];
+}
+
+int slab_alloc(slab_t* slab) {
+	// returns the index of a zeroed out slot
+
+	if (slab->free_head < 0) {
+		__slab_grow(slab);
+	}
+
+	int index = slab->free_head;
+	slab->free_head = slab->next_free[index];
+
+	slab->used[index] = 1;
+	memset(slab_get(slab, index), 0, slab->slot_size);
+
+	slab->live_count++;
+	slab->peak_count = MAX(slab->peak_count, slab->live_count);
+
+	return index;
+}
+
+void slab_free(slab_t* slab, int index) {
+	if (!slab_used(slab, index)) return;
+
+	slab->used[index] = 0;
+	slab->generations[index]++;
+
+	slab->next_free[index] = slab->free_head;
+	slab->free_head = index;
+
+	slab->live_count--;
+}
+
+static inline slab_handle_t slab_handle(slab_t* slab, int index) {
+	if (!slab_used(slab, index)) return SLAB_NO_HANDLE;
+	return (slab_handle_t) slab->generations[index] << SLAB_INDEX_BITS | index;
+}
+
+static inline int slab_resolve(slab_t* slab, slab_handle_t handle) {
+	// returns the index of the slot the handle refers to, or -1 if it's been freed since
+
+	int index = handle & SLAB_INDEX_MASK;
+
+	if (handle == SLAB_NO_HANDLE || !slab_used(slab, index) || slab->generations[index] != handle >> SLAB_INDEX_BITS) {
+		return -1;
+	}
+
+	return index;
+}
+
+static inline int slab_free_count(slab_t* slab) {
+	return slab->slot_count - slab->live_count;
+}
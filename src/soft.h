@@ -0,0 +1,833 @@
+// this file contains the CPU compositor, which draws windows into a frame buffer in memory when we can't use OpenGL (see 'CWM_BACKEND_CPU')
+// it draws the same thing as the OpenGL path in 'main.c': windows with antialiased rounded corners, opacity, and shadows
+// the screen is split into tiles, each of which only goes through the layers (windows) which touch it, and stops at the first one which hides everything below
+// tiles are shared out between a pool of threads, and the per-pixel work (blending and shadows) is done by SSE2 or AVX2 kernels when the CPU has them
+// this must be included after 'cwm.h'
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__)
+	#include <immintrin.h>
+	#define SOFT_X86 1
+#endif
+
+#define SOFT_TILE_SIZE 64 // pixels, so that a tile of the frame buffer (16 KiB) fits in L1
+#define SOFT_MAX_THREADS 16
+
+// one window, as passed to 'soft_render'
+// positions and sizes are in pixels, from the top left of the screen
+
+typedef struct {
+	float x, y;
+	float width, height;
+
+	float opacity;
+	int opaque; // whether the window is drawn without blending inside its rounded corners
+
+	// the window's contents (NULL if they couldn't be bound, in which case only the shadow is drawn)
+	// these are stretched to the window's size if it isn't the same as theirs
+
+	const uint32_t* pixels;
+	int pixels_width, pixels_height;
+	int has_alpha; // only 32-bit windows have an alpha channel, the unused byte of the others is garbage
+
+	cwm_rect_t clip; // the part of the window which isn't covered by opaque windows above it (see 'occlude_windows' in 'main.c')
+
+	float shadow_strength;
+	float shadow_radius;
+
+	// the rest is worked out by 'soft_render'
+	// windows are drawn aligned to whole pixels, which is only noticeable while they're animating (and then only barely)
+
+	cwm_rect_t rect;
+	cwm_rect_t bounds; // shadow included
+	int radius; // of the rounded corners
+
+	unsigned opacity_byte;
+	unsigned shadow_strength_byte;
+
+	float shadow_slice; // pixels covered by a slice of the shadow falloff (see 'soft_set_shadow')
+	float shadow_inset_x, shadow_inset_y;
+
+	// maps from each column and row of the window to a column and row of its contents, if they need to be stretched
+
+	int* x_map;
+	int* y_map;
+} soft_layer_t;
+
+// what each thread needs to draw a tile
+
+typedef struct {
+	int* layers; // indices of the layers touching the tile, from the top down
+	uint32_t row[SOFT_TILE_SIZE]; // stretched window contents
+	uint8_t alpha[SOFT_TILE_SIZE]; // shadow falloff
+} soft_scratch_t;
+
+typedef void (*soft_blend_row_t) (uint32_t* destination, const uint32_t* source, int count, unsigned opacity, int has_alpha);
+typedef void (*soft_shade_row_t) (uint32_t* destination, const uint8_t* alpha, int count);
+
+typedef struct {
+	cwm_t* cwm;
+
+	uint32_t* frame_buffer; // only valid during 'soft_render'
+	int stride;
+
+	uint32_t background;
+
+	// coverage of the pixels in a rounded corner, for each radius up to 'corner_radius'
+	// the corner of a window aligned to whole pixels always covers the same pixels the same way, so there's no point in working it out each time
+
+	int corner_radius;
+	uint8_t* corner_coverage;
+
+	// shadow falloff, in the same nine-slice layout as the OpenGL path's shadow texture
+
+	uint8_t* shadow_falloff; // ours
+	int shadow_slice_size; // texels
+	float shadow_inset;
+
+	// kernels, picked according to what the CPU supports
+
+	soft_blend_row_t blend_row;
+	soft_shade_row_t shade_row;
+
+	// this frame's layers and the pieces of tiles we need to draw (each is a tile clipped to one of the rectangles we're repainting)
+
+	soft_layer_t* layers;
+	int layer_count;
+	int layer_capacity;
+
+	int* maps;
+	int map_capacity;
+
+	cwm_rect_t* jobs;
+	int job_count;
+	int job_capacity;
+
+	atomic_int next_job;
+
+	// thread pool
+	// the thread calling 'soft_render' draws tiles too, so it has the first scratch space, and the workers have the rest
+
+	int thread_count; // including the calling thread
+	pthread_t* threads;
+
+	soft_scratch_t* scratches;
+	atomic_int started_thread_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_condition;
+	pthread_cond_t done_condition;
+
+	unsigned generation; // bumped each time there's work for the workers
+	int busy_thread_count;
+	int stopping; // set once, when the workers should exit instead of waiting for more work
+
+	// statistics
+
+	uint64_t tile_count;
+} soft_t;
+
+// scalar kernels
+// these are what we use on other architectures, and for whatever is left over at the end of a row by the SIMD kernels
+
+static inline unsigned __soft_div255(unsigned x) {
+	// exact 'x / 255' rounded to nearest, for 'x' up to 255 * 255
+
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t __soft_blend_pixel(uint32_t destination, uint32_t source, unsigned alpha) {
+	uint32_t result = 0xff000000;
+
+	for (int shift = 0; shift < 24; shift += 8) {
+		unsigned s = (source      >> shift) & 0xff;
+		unsigned d = (destination >> shift) & 0xff;
+
+		result |= __soft_div255(s * alpha + d * (255 - alpha)) << shift;
+	}
+
+	return result;
+}
+
+static void __soft_blend_row_scalar(uint32_t* destination, const uint32_t* source, int count, unsigned opacity, int has_alpha) {
+	for (int i = 0; i < count; i++) {
+		unsigned alpha = has_alpha ? source[i] >> 24 : 255;
+		destination[i] = __soft_blend_pixel(destination[i], source[i], __soft_div255(alpha * opacity));
+	}
+}
+
+static void __soft_shade_row_scalar(uint32_t* destination, const uint8_t* alpha, int count) {
+	// shadows are black, so all there is to do is darken what's already there
+
+	for (int i = 0; i < count; i++) {
+		destination[i] = __soft_blend_pixel(destination[i], 0, alpha[i]);
+	}
+}
+
+// SIMD kernels
+// pixels are widened to 16 bits per channel so that they can be multiplied without overflowing, and '__soft_div255' is done as '(x + 128) * 257 >> 16', which is exact over the same range
+
+#if SOFT_X86
+
+static inline __m128i __soft_div255_sse2(__m128i x) {
+	return _mm_mulhi_epu16(_mm_add_epi16(x, _mm_set1_epi16(128)), _mm_set1_epi16(257));
+}
+
+static inline __m128i __soft_lerp_sse2(__m128i source, __m128i destination, __m128i alpha) {
+	__m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+	return __soft_div255_sse2(_mm_add_epi16(_mm_mullo_epi16(source, alpha), _mm_mullo_epi16(destination, inverse)));
+}
+
+static void __soft_blend_row_sse2(uint32_t* destination, const uint32_t* source, int count, unsigned opacity, int has_alpha) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opacity_vector = _mm_set1_epi16(opacity);
+	const __m128i opaque = _mm_set1_epi32(0xff000000);
+
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*) &source[i]);
+		__m128i d = _mm_loadu_si128((const __m128i*) &destination[i]);
+
+		__m128i s_low  = _mm_unpacklo_epi8(s, zero);
+		__m128i s_high = _mm_unpackhi_epi8(s, zero);
+
+		__m128i d_low  = _mm_unpacklo_epi8(d, zero);
+		__m128i d_high = _mm_unpackhi_epi8(d, zero);
+
+		// spread each pixel's alpha over its 4 channels
+
+		__m128i alpha_low  = _mm_set1_epi16(255);
+		__m128i alpha_high = _mm_set1_epi16(255);
+
+		if (has_alpha) {
+			alpha_low  = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_low,  _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			alpha_high = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_high, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		}
+
+		alpha_low  = __soft_div255_sse2(_mm_mullo_epi16(alpha_low,  opacity_vector));
+		alpha_high = __soft_div255_sse2(_mm_mullo_epi16(alpha_high, opacity_vector));
+
+		__m128i result = _mm_packus_epi16(__soft_lerp_sse2(s_low, d_low, alpha_low), __soft_lerp_sse2(s_high, d_high, alpha_high));
+		_mm_storeu_si128((__m128i*) &destination[i], _mm_or_si128(result, opaque));
+	}
+
+	__soft_blend_row_scalar(destination + i, source + i, count - i, opacity, has_alpha);
+}
+
+static void __soft_shade_row_sse2(uint32_t* destination, const uint8_t* alpha, int count) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i opaque = _mm_set1_epi32(0xff000000);
+
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		int32_t packed_alpha;
+		memcpy(&packed_alpha, &alpha[i], sizeof(packed_alpha));
+
+		// spread each pixel's alpha over its 4 channels
+
+		__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_alpha), zero);
+		a = _mm_unpacklo_epi16(a, a);
+
+		__m128i inverse_low  = _mm_sub_epi16(full, _mm_unpacklo_epi32(a, a));
+		__m128i inverse_high = _mm_sub_epi16(full, _mm_unpackhi_epi32(a, a));
+
+		__m128i d = _mm_loadu_si128((const __m128i*) &destination[i]);
+
+		__m128i low  = __soft_div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inverse_low));
+		__m128i high = __soft_div255_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inverse_high));
+
+		_mm_storeu_si128((__m128i*) &destination[i], _mm_or_si128(_mm_packus_epi16(low, high), opaque));
+	}
+
+	__soft_shade_row_scalar(destination + i, alpha + i, count - i);
+}
+
+// the AVX2 kernels are the same as the SSE2 ones, 8 pixels at a time instead of 4
+// unpacking and packing work within each 128-bit half, so pixels stay in order as long as we do both the same way
+
+__attribute__((target("avx2")))
+static inline __m256i __soft_div255_avx2(__m256i x) {
+	return _mm256_mulhi_epu16(_mm256_add_epi16(x, _mm256_set1_epi16(128)), _mm256_set1_epi16(257));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i __soft_lerp_avx2(__m256i source, __m256i destination, __m256i alpha) {
+	__m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+	return __soft_div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(source, alpha), _mm256_mullo_epi16(destination, inverse)));
+}
+
+__attribute__((target("avx2")))
+static void __soft_blend_row_avx2(uint32_t* destination, const uint32_t* source, int count, unsigned opacity, int has_alpha) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i opacity_vector = _mm256_set1_epi16(opacity);
+	const __m256i opaque = _mm256_set1_epi32(0xff000000);
+
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*) &source[i]);
+		__m256i d = _mm256_loadu_si256((const __m256i*) &destination[i]);
+
+		__m256i s_low  = _mm256_unpacklo_epi8(s, zero);
+		__m256i s_high = _mm256_unpackhi_epi8(s, zero);
+
+		__m256i d_low  = _mm256_unpacklo_epi8(d, zero);
+		__m256i d_high = _mm256_unpackhi_epi8(d, zero);
+
+		__m256i alpha_low  = _mm256_set1_epi16(255);
+		__m256i alpha_high = _mm256_set1_epi16(255);
+
+		if (has_alpha) {
+			alpha_low  = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_low,  _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			alpha_high = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_high, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		}
+
+		alpha_low  = __soft_div255_avx2(_mm256_mullo_epi16(alpha_low,  opacity_vector));
+		alpha_high = __soft_div255_avx2(_mm256_mullo_epi16(alpha_high, opacity_vector));
+
+		__m256i result = _mm256_packus_epi16(__soft_lerp_avx2(s_low, d_low, alpha_low), __soft_lerp_avx2(s_high, d_high, alpha_high));
+		_mm256_storeu_si256((__m256i*) &destination[i], _mm256_or_si256(result, opaque));
+	}
+
+	__soft_blend_row_sse2(destination + i, source + i, count - i, opacity, has_alpha);
+}
+
+__attribute__((target("avx2")))
+static void __soft_shade_row_avx2(uint32_t* destination, const uint8_t* alpha, int count) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i full = _mm256_set1_epi16(255);
+	const __m256i opaque = _mm256_set1_epi32(0xff000000);
+
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		// widen the 8 alphas to 32 bits and copy each into both of its 16-bit halves
+		// then, in each 128-bit half, the low and high unpacks line up with the pixels unpacked from the destination
+
+		__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &alpha[i]));
+		a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+
+		__m256i inverse_low  = _mm256_sub_epi16(full, _mm256_unpacklo_epi32(a, a));
+		__m256i inverse_high = _mm256_sub_epi16(full, _mm256_unpackhi_epi32(a, a));
+
+		__m256i d = _mm256_loadu_si256((const __m256i*) &destination[i]);
+
+		__m256i low  = __soft_div255_avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inverse_low));
+		__m256i high = __soft_div255_avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inverse_high));
+
+		_mm256_storeu_si256((__m256i*) &destination[i], _mm256_or_si256(_mm256_packus_epi16(low, high), opaque));
+	}
+
+	__soft_shade_row_sse2(destination + i, alpha + i, count - i);
+}
+
+#endif
+
+// functions
+
+static void* __soft_worker(void* argument);
+
+void new_soft(soft_t* soft, cwm_t* cwm, int corner_radius, uint32_t background) {
+	memset(soft, 0, sizeof(*soft));
+
+	soft->cwm = cwm;
+	soft->stride = cwm->wm->width;
+	soft->background = background;
+
+	// pick the fastest kernels we can use
+
+	soft->blend_row = __soft_blend_row_scalar;
+	soft->shade_row = __soft_shade_row_scalar;
+
+#if SOFT_X86
+	soft->blend_row = __soft_blend_row_sse2;
+	soft->shade_row = __soft_shade_row_sse2;
+
+	if (__builtin_cpu_supports("avx2")) {
+		soft->blend_row = __soft_blend_row_avx2;
+		soft->shade_row = __soft_shade_row_avx2;
+	}
+#endif
+
+	// work out the coverage of rounded corners, the same way the OpenGL path's window shader does
+	// this is the top left corner, the others are the same thing mirrored
+
+	soft->corner_radius = corner_radius;
+	soft->corner_coverage = (uint8_t*) calloc((corner_radius + 1) * corner_radius * corner_radius + 1, 1);
+
+	for (int radius = 1; radius <= corner_radius; radius++) {
+		uint8_t* coverage = &soft->corner_coverage[radius * corner_radius * corner_radius];
+
+		for (int y = 0; y < radius; y++) {
+			for (int x = 0; x < radius; x++) {
+				float qx = radius - x - 0.5;
+				float qy = radius - y - 0.5;
+
+				float distance = sqrt(MAX(qx, 0) * MAX(qx, 0) + MAX(qy, 0) * MAX(qy, 0)) + MIN(MAX(qx, qy), 0) - radius;
+				float value = MIN(1.0, MAX(0.0, 0.5 - distance));
+
+				coverage[y * corner_radius + x] = (uint8_t) round(value * 255);
+			}
+		}
+	}
+
+	// start the thread pool
+	// by default, that's one thread per CPU, but this can be overridden with the 'CWM_THREADS' environment variable
+
+	const char* thread_count_string = getenv("CWM_THREADS");
+	soft->thread_count = thread_count_string ? atoi(thread_count_string) : sysconf(_SC_NPROCESSORS_ONLN);
+	soft->thread_count = MAX(1, MIN(soft->thread_count, SOFT_MAX_THREADS));
+
+	soft->scratches = (soft_scratch_t*) calloc(soft->thread_count, sizeof(*soft->scratches));
+	soft->threads = (pthread_t*) calloc(soft->thread_count, sizeof(*soft->threads));
+
+	pthread_mutex_init(&soft->mutex, NULL);
+	pthread_cond_init(&soft->work_condition, NULL);
+	pthread_cond_init(&soft->done_condition, NULL);
+
+	// the workers live until 'free_soft'
+
+	for (int i = 1; i < soft->thread_count; i++) {
+		pthread_create(&soft->threads[i], NULL, __soft_worker, soft);
+	}
+}
+
+void free_soft(soft_t* soft) {
+	// stop the workers and wait for them to exit before freeing anything they might still be looking at
+
+	pthread_mutex_lock(&soft->mutex);
+
+	soft->stopping = 1;
+
+	pthread_cond_broadcast(&soft->work_condition);
+	pthread_mutex_unlock(&soft->mutex);
+
+	for (int i = 1; i < soft->thread_count; i++) {
+		pthread_join(soft->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&soft->mutex);
+	pthread_cond_destroy(&soft->work_condition);
+	pthread_cond_destroy(&soft->done_condition);
+
+	for (int i = 0; i < soft->thread_count; i++) {
+		free(soft->scratches[i].layers);
+	}
+
+	free(soft->scratches);
+	free(soft->threads);
+
+	free(soft->corner_coverage);
+	free(soft->shadow_falloff);
+
+	free(soft->maps);
+	free(soft->jobs);
+
+	memset(soft, 0, sizeof(*soft));
+}
+
+void soft_set_shadow(soft_t* soft, uint8_t* falloff, int slice_size, float inset) {
+	// give the CPU compositor the same shadow falloff the OpenGL path uses (it's freed along with the CPU compositor)
+
+	soft->shadow_falloff = falloff;
+	soft->shadow_slice_size = slice_size;
+	soft->shadow_inset = inset;
+}
+
+static inline int __soft_rect_contains(cwm_rect_t outer, cwm_rect_t inner) {
+	return inner.x >= outer.x && inner.y >= outer.y && inner.x + inner.width <= outer.x + outer.width && inner.y + inner.height <= outer.y + outer.height;
+}
+
+static int __soft_layer_covers(soft_layer_t* layer, cwm_rect_t piece) {
+	// whether the layer completely hides everything below it in 'piece'
+	// like in 'occlude_windows', its rounded corners don't hide anything, so it only covers a cross shape
+
+	if (!layer->pixels || !layer->opaque) return 0;
+	if (!__soft_rect_contains(layer->clip, piece)) return 0;
+
+	cwm_rect_t rect = layer->rect;
+	int radius = layer->radius;
+
+	return
+		__soft_rect_contains((cwm_rect_t) { rect.x, rect.y + radius, rect.width, rect.height - radius * 2 }, piece) ||
+		__soft_rect_contains((cwm_rect_t) { rect.x + radius, rect.y, rect.width - radius * 2, rect.height }, piece);
+}
+
+static void __soft_draw_shadow_span(soft_t* soft, soft_scratch_t* scratch, soft_layer_t* layer, uint32_t* row, int start, int end, const uint8_t* falloff_row) {
+	// shade the pixels of one row of a shadow from 'start' to 'end'
+	// like the OpenGL path's shadow texture, the falloff in the left half is mirrored in the right half
+
+	if (start >= end) return;
+
+	cwm_rect_t bounds = layer->bounds;
+	int slice_size = soft->shadow_slice_size;
+
+	for (int x = start; x < end; x++) {
+		float edge = MIN(x - bounds.x, bounds.x + bounds.width - 1 - x) + 0.5;
+		int i = MIN(slice_size - 1, (int) (edge / layer->shadow_slice * slice_size));
+
+		scratch->alpha[x - start] = __soft_div255(falloff_row[i] * layer->shadow_strength_byte);
+	}
+
+	soft->shade_row(&row[start], scratch->alpha, end - start);
+}
+
+static void __soft_draw_shadow(soft_t* soft, soft_scratch_t* scratch, soft_layer_t* layer, cwm_rect_t piece) {
+	// the shadow is drawn as a ring around the window, which stops where the falloff does (the middle would be hidden by the window anyway)
+	// if the window is opaque, we also leave out whatever is under it, since it'll be drawn over straight after
+
+	if (!layer->shadow_strength_byte) return;
+
+	cwm_rect_t area = cwm_rect_intersection(layer->bounds, piece);
+	if (area.width <= 0 || area.height <= 0) return;
+
+	cwm_rect_t bounds = layer->bounds;
+	cwm_rect_t rect = layer->rect;
+
+	int size = soft->shadow_slice_size * 2;
+	int hide_under_window = layer->pixels && layer->opaque;
+
+	for (int y = area.y; y < area.y + area.height; y++) {
+		uint32_t* row = &soft->frame_buffer[(size_t) y * soft->stride];
+
+		// work out which row of the falloff this is
+		// the texture's rows go from the bottom up (like everything in OpenGL), so its top half is the bottom of the shadow
+
+		float top_edge    = y - bounds.y + 0.5;
+		float bottom_edge = bounds.y + bounds.height - y - 0.5;
+
+		int top = top_edge < bottom_edge;
+		float edge = top ? top_edge : bottom_edge;
+
+		int j = MIN(soft->shadow_slice_size - 1, (int) (edge / layer->shadow_slice * soft->shadow_slice_size));
+		const uint8_t* falloff_row = &soft->shadow_falloff[(top ? size - 1 - j : j) * size];
+
+		// work out the hole in the middle of this row (if any)
+
+		int hole_start = INT32_MAX;
+		int hole_end = INT32_MIN;
+
+		if (edge >= layer->shadow_inset_y) {
+			hole_start = bounds.x + (int) ceil(layer->shadow_inset_x - 0.5);
+			hole_end   = bounds.x + bounds.width - (int) ceil(layer->shadow_inset_x - 0.5);
+		}
+
+		if (hide_under_window && y >= rect.y && y < rect.y + rect.height) {
+			int corner_row = y < rect.y + layer->radius || y >= rect.y + rect.height - layer->radius;
+			int inset = corner_row ? layer->radius : 0;
+
+			hole_start = MIN(hole_start, rect.x + inset);
+			hole_end   = MAX(hole_end,   rect.x + rect.width - inset);
+		}
+
+		int start = area.x;
+		int end = area.x + area.width;
+
+		if (hole_start >= hole_end) {
+			__soft_draw_shadow_span(soft, scratch, layer, row, start, end, falloff_row);
+			continue;
+		}
+
+		__soft_draw_shadow_span(soft, scratch, layer, row, start, MIN(end, hole_start), falloff_row);
+		__soft_draw_shadow_span(soft, scratch, layer, row, MAX(start, hole_end), end, falloff_row);
+	}
+}
+
+static void __soft_draw_contents(soft_t* soft, soft_scratch_t* scratch, soft_layer_t* layer, cwm_rect_t piece) {
+	if (!layer->pixels) return;
+
+	cwm_rect_t area = cwm_rect_intersection(layer->clip, piece);
+	if (area.width <= 0 || area.height <= 0) return;
+
+	cwm_rect_t rect = layer->rect;
+	int radius = layer->radius;
+
+	const uint8_t* coverage = &soft->corner_coverage[radius * soft->corner_radius * soft->corner_radius];
+
+	// opaque windows at full opacity don't need blending at all (24-bit windows don't have an alpha channel, and the alpha byte of the frame buffer is ignored)
+
+	int copy = layer->opaque && layer->opacity_byte == 255 && !layer->has_alpha;
+
+	for (int y = area.y; y < area.y + area.height; y++) {
+		uint32_t* row = &soft->frame_buffer[(size_t) y * soft->stride];
+
+		int window_y = y - rect.y;
+		const uint32_t* source_row = &layer->pixels[(size_t) (layer->y_map ? layer->y_map[window_y] : window_y) * layer->pixels_width];
+
+		// in the rows with rounded corners, the corners are blended one pixel at a time according to their coverage
+		// everything in between is fully covered, and goes through the kernels
+
+		int corner_y = window_y < radius ? window_y : rect.height - 1 - window_y;
+		int corner_row = corner_y < radius;
+
+		int start = area.x;
+		int end = area.x + area.width;
+
+		int middle_start = MAX(start, corner_row ? rect.x + radius : rect.x);
+		int middle_end   = MIN(end,   corner_row ? rect.x + rect.width - radius : rect.x + rect.width);
+
+		for (int x = start; x < end; x++) {
+			if (x == middle_start && middle_start < middle_end) {
+				x = middle_end - 1;
+				continue;
+			}
+
+			int window_x = x - rect.x;
+			int corner_x = window_x < radius ? window_x : rect.width - 1 - window_x;
+
+			uint32_t pixel = source_row[layer->x_map ? layer->x_map[window_x] : window_x];
+			unsigned alpha = __soft_div255((layer->has_alpha ? pixel >> 24 : 255) * layer->opacity_byte);
+
+			row[x] = __soft_blend_pixel(row[x], pixel, __soft_div255(alpha * coverage[corner_y * soft->corner_radius + corner_x]));
+		}
+
+		if (middle_start >= middle_end) continue;
+
+		int count = middle_end - middle_start;
+		const uint32_t* source = &source_row[middle_start - rect.x];
+
+		// stretched windows are sampled at the nearest pixel (the OpenGL path filters them linearly)
+
+		if (layer->x_map) {
+			for (int i = 0; i < count; i++) {
+				scratch->row[i] = source_row[layer->x_map[middle_start - rect.x + i]];
+			}
+
+			source = scratch->row;
+		}
+
+		if (copy) memcpy(&row[middle_start], source, count * sizeof(*row));
+		else soft->blend_row(&row[middle_start], source, count, layer->opacity_byte, layer->has_alpha);
+	}
+}
+
+static void __soft_draw_piece(soft_t* soft, soft_scratch_t* scratch, cwm_rect_t piece) {
+	// find the layers touching this piece, from the top of the stack down to the first one which hides everything below it
+
+	int count = 0;
+	int covered = 0;
+
+	for (int i = soft->layer_count - 1; i >= 0; i--) {
+		soft_layer_t* layer = &soft->layers[i];
+		if (!cwm_rect_intersects(layer->bounds, piece)) continue;
+
+		scratch->layers[count++] = i;
+
+		if (__soft_layer_covers(layer, piece)) {
+			covered = 1;
+			break;
+		}
+	}
+
+	if (!covered) {
+		for (int y = piece.y; y < piece.y + piece.height; y++) {
+			uint32_t* row = &soft->frame_buffer[(size_t) y * soft->stride + piece.x];
+
+			for (int x = 0; x < piece.width; x++) {
+				row[x] = soft->background;
+			}
+		}
+	}
+
+	// then draw them from the bottom up, each window over its own shadow
+	// (the bottom one's shadow is hidden if it covers everything)
+
+	for (int i = count - 1; i >= 0; i--) {
+		soft_layer_t* layer = &soft->layers[scratch->layers[i]];
+
+		if (!covered || i != count - 1) {
+			__soft_draw_shadow(soft, scratch, layer, piece);
+		}
+
+		__soft_draw_contents(soft, scratch, layer, piece);
+	}
+}
+
+static void __soft_run_jobs(soft_t* soft, soft_scratch_t* scratch) {
+	for (;;) {
+		int job = atomic_fetch_add(&soft->next_job, 1);
+		if (job >= soft->job_count) break;
+
+		__soft_draw_piece(soft, scratch, soft->jobs[job]);
+	}
+}
+
+static void* __soft_worker(void* argument) {
+	soft_t* soft = (soft_t*) argument;
+
+	int index = atomic_fetch_add(&soft->started_thread_count, 1) + 1;
+	unsigned generation = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&soft->mutex);
+
+		while (soft->generation == generation && !soft->stopping) {
+			pthread_cond_wait(&soft->work_condition, &soft->mutex);
+		}
+
+		if (soft->stopping) {
+			pthread_mutex_unlock(&soft->mutex);
+			break;
+		}
+
+		generation = soft->generation;
+		pthread_mutex_unlock(&soft->mutex);
+
+		__soft_run_jobs(soft, &soft->scratches[index]);
+
+		pthread_mutex_lock(&soft->mutex);
+
+		if (!--soft->busy_thread_count) {
+			pthread_cond_signal(&soft->done_condition);
+		}
+
+		pthread_mutex_unlock(&soft->mutex);
+	}
+
+	return NULL;
+}
+
+static void __soft_prepare_layers(soft_t* soft) {
+	// work out everything about the layers which doesn't depend on which tile we're drawing
+
+	int map_size = 0;
+
+	for (int i = 0; i < soft->layer_count; i++) {
+		soft_layer_t* layer = &soft->layers[i];
+
+		int x = (int) round(layer->x);
+		int y = (int) round(layer->y);
+
+		layer->rect = (cwm_rect_t) { x, y, (int) round(layer->x + layer->width) - x, (int) round(layer->y + layer->height) - y };
+		layer->clip = cwm_rect_intersection(layer->clip, layer->rect);
+
+		layer->radius = MAX(0, MIN(soft->corner_radius, MIN(layer->rect.width, layer->rect.height) / 2));
+
+		layer->opacity_byte = (unsigned) round(MIN(1.0, MAX(0.0, layer->opacity)) * 255);
+		layer->shadow_strength_byte = (unsigned) round(MIN(1.0, MAX(0.0, layer->shadow_strength)) * 255);
+
+		// the shadow sticks out by its radius all around the window, and a slice of its falloff goes a bit further in than that
+		// the slices can't be bigger than half the shadow, or else the ring would fold over itself
+
+		int shadow_radius = layer->shadow_strength_byte ? (int) round(layer->shadow_radius) : 0;
+		layer->bounds = (cwm_rect_t) { x - shadow_radius, y - shadow_radius, layer->rect.width + shadow_radius * 2, layer->rect.height + shadow_radius * 2 };
+
+		layer->shadow_slice = MAX(1.0, layer->shadow_radius * (1 + soft->shadow_inset));
+		layer->shadow_inset_x = MIN(layer->shadow_slice, layer->bounds.width  / 2.0);
+		layer->shadow_inset_y = MIN(layer->shadow_slice, layer->bounds.height / 2.0);
+
+		layer->x_map = NULL;
+		layer->y_map = NULL;
+
+		if (layer->pixels && (layer->pixels_width != layer->rect.width || layer->pixels_height != layer->rect.height)) {
+			map_size += layer->rect.width + layer->rect.height;
+		}
+	}
+
+	// fill in the maps of the stretched layers, all in one allocation
+
+	if (map_size > soft->map_capacity) {
+		soft->map_capacity = map_size;
+		soft->maps = (int*) realloc(soft->maps, soft->map_capacity * sizeof(*soft->maps));
+	}
+
+	int* map = soft->maps;
+
+	for (int i = 0; i < soft->layer_count; i++) {
+		soft_layer_t* layer = &soft->layers[i];
+		if (!layer->pixels || (layer->pixels_width == layer->rect.width && layer->pixels_height == layer->rect.height)) continue;
+
+		layer->x_map = map;
+		map += layer->rect.width;
+
+		layer->y_map = map;
+		map += layer->rect.height;
+
+		for (int j = 0; j < layer->rect.width; j++) {
+			layer->x_map[j] = MIN(layer->pixels_width - 1, (int) ((j + 0.5) * layer->pixels_width / layer->rect.width));
+		}
+
+		for (int j = 0; j < layer->rect.height; j++) {
+			layer->y_map[j] = MIN(layer->pixels_height - 1, (int) ((j + 0.5) * layer->pixels_height / layer->rect.height));
+		}
+	}
+}
+
+void soft_render(soft_t* soft, soft_layer_t* layers, int layer_count, cwm_damage_t* repaint) {
+	// draw the layers (from the bottom of the stack to the top) over the parts of the screen in 'repaint'
+
+	soft->frame_buffer = cwm_frame_buffer(soft->cwm);
+
+	soft->layers = layers;
+	soft->layer_count = layer_count;
+
+	__soft_prepare_layers(soft);
+
+	// make sure each thread has room to list all the layers
+
+	if (layer_count > soft->layer_capacity) {
+		soft->layer_capacity = layer_count;
+
+		for (int i = 0; i < soft->thread_count; i++) {
+			soft->scratches[i].layers = (int*) realloc(soft->scratches[i].layers, soft->layer_capacity * sizeof(int));
+		}
+	}
+
+	// split the rectangles we're repainting along the tile grid
+	// the rectangles don't overlap, so neither do the pieces, which means threads never draw to the same pixels
+
+	soft->job_count = 0;
+
+	for (int i = 0; i < repaint->rect_count; i++) {
+		cwm_rect_t rect = repaint->rects[i];
+
+		for (int y = rect.y / SOFT_TILE_SIZE * SOFT_TILE_SIZE; y < rect.y + rect.height; y += SOFT_TILE_SIZE) {
+			for (int x = rect.x / SOFT_TILE_SIZE * SOFT_TILE_SIZE; x < rect.x + rect.width; x += SOFT_TILE_SIZE) {
+				cwm_rect_t piece = cwm_rect_intersection(rect, (cwm_rect_t) { x, y, SOFT_TILE_SIZE, SOFT_TILE_SIZE });
+				if (piece.width <= 0 || piece.height <= 0) continue;
+
+				if (soft->job_count >= soft->job_capacity) {
+					soft->job_capacity = soft->job_capacity ? soft->job_capacity * 2 : 64;
+					soft->jobs = (cwm_rect_t*) realloc(soft->jobs, soft->job_capacity * sizeof(*soft->jobs));
+				}
+
+				soft->jobs[soft->job_count++] = piece;
+			}
+		}
+	}
+
+	soft->tile_count += soft->job_count;
+	atomic_store(&soft->next_job, 0);
+
+	// waking the workers up isn't free, so don't bother when there's only a tile or so to draw (e.g. a blinking cursor)
+
+	if (soft->thread_count == 1 || soft->job_count <= 2) {
+		__soft_run_jobs(soft, &soft->scratches[0]);
+		return;
+	}
+
+	pthread_mutex_lock(&soft->mutex);
+
+	soft->generation++;
+	soft->busy_thread_count = soft->thread_count - 1;
+
+	pthread_cond_broadcast(&soft->work_condition);
+	pthread_mutex_unlock(&soft->mutex);
+
+	__soft_run_jobs(soft, &soft->scratches[0]);
+
+	pthread_mutex_lock(&soft->mutex);
+
+	while (soft->busy_thread_count) {
+		pthread_cond_wait(&soft->done_condition, &soft->mutex);
+	}
+
+	pthread_mutex_unlock(&soft->mutex);
+}
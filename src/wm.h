@@ -2,14 +2,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
+#include <time.h>
+#include <poll.h>
+#include <sys/param.h>
+
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+
+#include <xcb/xcb.h>
 
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/sync.h>
+
+#include <slab.h>
 
 #if !defined(DEBUGGING)
 	#define DEBUGGING 0
@@ -17,6 +30,10 @@
 
 #define WM_NAME "Basic X compositing WM"
 
+// how long to wait for a client to finish drawing at a new size before we stop caring, in microseconds (see 'wm_window_busy')
+
+#define WM_SYNC_REQUEST_TIMEOUT 200000
+
 // structures and types
 
 typedef void (*wm_keyboard_event_callback_t) (void*, unsigned window, unsigned press, unsigned modifiers, unsigned key);
@@ -25,17 +42,83 @@ typedef void (*wm_move_event_callback_t) (void*, unsigned window, unsigned modif
 
 typedef void (*wm_create_event_callback_t) (void*, unsigned window);
 typedef void (*wm_modify_event_callback_t) (void*, unsigned window, int visible, float x, float y, float width, float height);
-typedef void (*wm_destroy_event_callback_t) (void*, unsigned window);
+typedef void (*wm_destroy_event_callback_t) (void*, unsigned window, int destroyed);
+typedef void (*wm_damage_event_callback_t) (void*, unsigned window, int x, int y, int width, int height);
+
+// hash table mapping XIDs to indices in the WM's window list, so we don't have to search the whole list to find the window something is about
+// this uses open addressing with linear probing; empty buckets have an index of -1 and the capacity is always a power of 2
+
+typedef struct {
+	Window xid;
+	int index;
+} wm_hash_entry_t;
+
+typedef struct {
+	wm_hash_entry_t* entries;
+	int capacity;
+	int count;
+} wm_hash_t;
+
+// a request for one of a window's properties which is in flight (see 'wm_request_property')
+
+typedef struct {
+	int pending;
+	xcb_get_property_cookie_t cookie;
+} wm_property_query_t;
 
 typedef struct {
 	int exists;
 	Window window;
 
+	// all this is kept up to date from the events we get about the window, so we don't have to ask the server for it each time
+	// the exception is the depth, which isn't in any event, so we ask for it once when the window is created
+
 	int visible;
 
 	int x, y;
 	int width, height;
 
+	int override_redirect;
+	int depth; // this can't change after the window is created
+
+	int state_known; // whether we've seen the window from the start, or whether we need to ask the server for its state (see 'wm_request_window_state')
+	int needs_centering; // whether the window was just mapped at (0, 0), and should be moved under the cursor
+
+	// value of the window's '_NET_WM_BYPASS_COMPOSITOR' property
+	// 0 if the client has no preference, 1 if it would rather not be composited (e.g. games and video players), 2 if it really wants to be composited
+
+	int bypass_compositor;
+
+	// value of the window's '_NET_WM_WINDOW_OPACITY' property, from 0.0 to 1.0 (1.0 if it doesn't have one)
+
+	float opacity;
+
+	// '_NET_WM_SYNC_REQUEST' state
+	// clients which support it have a counter, which they set to the value we give them once they're done drawing at the last size we gave them
+	// 'sync_alarm' is how the server tells us the counter reached that value (it's created the first time we need it)
+
+	XSyncCounter sync_counter; // 'None' if the client doesn't support the protocol
+	XSyncAlarm sync_alarm;
+
+	uint64_t sync_value;
+	int sync_pending; // whether we're waiting for the client to catch up
+	uint64_t sync_request_time;
+
+	int pending_modify; // whether this window is in 'pending_modify_windows' waiting for its modify event to be delivered
+	int pending_create; // whether this window is in 'pending_create_windows' waiting for its initial state to come back from the server
+
+	// requests for the window's state which are in flight (see 'wm_request_window_state' and co)
+	// these are sent as soon as we know we need them, but we only wait for the replies at the end of the batch of events
+
+	xcb_get_window_attributes_cookie_t attributes_cookie;
+	xcb_get_geometry_cookie_t geometry_cookie;
+
+	int pending_state;
+
+	wm_property_query_t bypass_compositor_query;
+	wm_property_query_t opacity_query;
+	wm_property_query_t sync_counter_query;
+
 	// this is extra data that can be allocated by extensions such as a compositor
 	void* internal;
 } wm_window_t;
@@ -44,22 +127,47 @@ typedef struct {
 	Display* display;
 	int screen;
 
+	// XCB connection underlying 'display'
+	// we still use Xlib for most things (and it still owns the event queue), but XCB lets us send off queries without waiting for their replies straight away
+	// so a batch of N new or modified windows costs us one round trip to the server instead of N
+
+	xcb_connection_t* connection;
+
 	Window root_window;
 
 	unsigned width;
 	unsigned height;
 
-	wm_window_t* windows;
-	int window_count;
+	// all the windows we know about, indexed by what the callbacks call their internal id
+	// these are kept in a slab so that they never move around in memory, and so that the slots of destroyed windows get reused (see 'slab.h')
+
+	slab_t windows;
+
+	// hash tables mapping XIDs to indices in 'windows', so we don't have to search the whole list on each event
+	// one is for the windows themselves, the other for the '_NET_WM_SYNC_REQUEST' alarms we have on them (see 'wm_send_sync_request')
+
+	wm_hash_t window_hash;
+	wm_hash_t alarm_hash;
 
 	// individual monitor information
 
 	int monitor_count;
 	XineramaScreenInfo* monitor_infos;
 
+	float* monitor_refresh_rates; // in Hz, one for each monitor
+	float refresh_rate; // in Hz, of the fastest monitor
+
 	// atoms (used for communicating information about the window manager to other clients)
 
 	Atom client_list_atom;
+	Atom bypass_compositor_atom;
+	Atom opacity_atom;
+
+	Atom protocols_atom;
+	Atom delete_window_atom;
+
+	Atom sync_request_atom;
+	Atom sync_request_counter_atom;
 
 	// list of windows that are blacklisted for events
 	// this is mostly useful for non-application windows that the client doesn't care about
@@ -67,6 +175,45 @@ typedef struct {
 	Window* event_blacklisted_windows;
 	int event_blacklisted_window_count;
 
+	// first event number of the XDamage extension
+	// this is left at 0 (meaning we don't care about damage events) unless an extension such as a compositor sets it
+
+	int damage_event_base;
+
+	// first event number of the X SYNC extension, which we need for '_NET_WM_SYNC_REQUEST' (and which a compositor can use for fences)
+
+	int sync_supported;
+	int sync_event_base;
+
+	// event coalescing
+	// we only want to deliver the latest pointer position and the net change of each window once per batch of events
+	// (a window being dragged or resized can easily send us hundreds of 'ConfigureNotify' events per frame)
+
+	int motion_pending;
+	XEvent pending_motion;
+
+	int* pending_modify_windows;
+	int pending_modify_count;
+	int pending_modify_capacity;
+
+	// newly created windows are only delivered at the end of the batch too, once we have their initial state
+
+	int* pending_create_windows;
+	int pending_create_count;
+	int pending_create_capacity;
+
+	// same goes for '_NET_CLIENT_LIST', which is rewritten whole each time, so we only do that once per batch however many windows came and went
+
+	int client_list_dirty;
+
+	// statistics on how many events we received vs how many we actually delivered to the callbacks
+	// and on how many queries we had to send to the server to keep track of windows (each of which needs a reply)
+
+	uint64_t raw_event_count;
+	uint64_t delivered_event_count;
+
+	uint64_t query_count;
+
 	// event callbacks
 
 	wm_keyboard_event_callback_t keyboard_event_callback;
@@ -76,15 +223,29 @@ typedef struct {
 	wm_create_event_callback_t   create_event_callback;
 	wm_modify_event_callback_t   modify_event_callback;
 	wm_destroy_event_callback_t  destroy_event_callback;
+	wm_damage_event_callback_t   damage_event_callback;
 } wm_t;
 
 // utility functions
 
+static inline wm_window_t* wm_get_window(wm_t* wm, int window_index) {
+	return (wm_window_t*) slab_get(&wm->windows, window_index);
+}
+
 static void wm_error(wm_t* wm, const char* message) {
 	fprintf(stderr, "[WM_ERROR:%p] %s\n", wm, message);
 	exit(1);
 }
 
+static uint64_t wm_now(void) {
+	// monotonic time in microseconds
+
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
 // don't forget for all the functions dealing with the y coordinate:
 // X coordinates start from the top left, whereas AQUA coordinates start from the bottom left (where they should be!)
 
@@ -110,18 +271,113 @@ static int wm_event_blacklisted_window(wm_t* wm, Window window) {
 	return 0;
 }
 
-static int wm_find_window_by_xid(wm_t* wm, Window xid) {
-	for (int i = 0; i < wm->window_count; i++) {
-		wm_window_t* window = &wm->windows[i];
+// XID hash table functions
+
+static inline unsigned wm_hash_xid(wm_hash_t* hash, Window xid) {
+	// XIDs are mostly sequential with the client's resource base in the upper bits, so mix them up a bit (Fibonacci hashing)
+	return (unsigned) (((uint64_t) xid * 0x9E3779B97F4A7C15ull) >> 32) & (hash->capacity - 1);
+}
+
+static void wm_hash_insert(wm_hash_t* hash, Window xid, int index);
+
+static void wm_hash_grow(wm_hash_t* hash) {
+	wm_hash_entry_t* old_entries = hash->entries;
+	int old_capacity = hash->capacity;
+
+	hash->capacity = old_capacity ? old_capacity * 2 : 64;
+	hash->entries = (wm_hash_entry_t*) malloc(hash->capacity * sizeof(*hash->entries));
+	hash->count = 0;
+
+	for (int i = 0; i < hash->capacity; i++) {
+		hash->entries[i].index = -1;
+	}
+
+	for (int i = 0; i < old_capacity; i++) {
+		if (old_entries[i].index >= 0) {
+			wm_hash_insert(hash, old_entries[i].xid, old_entries[i].index);
+		}
+	}
+
+	free(old_entries);
+}
+
+static void wm_hash_insert(wm_hash_t* hash, Window xid, int index) {
+	// keep the load factor under 1/2 so probe sequences stay short
+
+	if ((hash->count + 1) * 2 > hash->capacity) {
+		wm_hash_grow(hash);
+	}
+
+	unsigned bucket = wm_hash_xid(hash, xid);
+
+	while (hash->entries[bucket].index >= 0) {
+		if (hash->entries[bucket].xid == xid) { // replace stale entries with the same XID
+			hash->entries[bucket].index = index;
+			return;
+		}
+
+		bucket = (bucket + 1) & (hash->capacity - 1);
+	}
+
+	hash->entries[bucket] = (wm_hash_entry_t) { xid, index };
+	hash->count++;
+}
+
+static int wm_hash_lookup(wm_hash_t* hash, Window xid) {
+	if (!hash->capacity) return -1;
+	unsigned bucket = wm_hash_xid(hash, xid);
+
+	while (hash->entries[bucket].index >= 0) {
+		if (hash->entries[bucket].xid == xid) {
+			return hash->entries[bucket].index;
+		}
 
-		// it's really super important to verify our window actually exists
-		// we could have a window that doesn't exist anymore, but that had the same ID as one that currently exists
+		bucket = (bucket + 1) & (hash->capacity - 1);
+	}
+
+	return -1;
+}
+
+static void wm_hash_remove(wm_hash_t* hash, Window xid) {
+	if (!hash->capacity) return;
+
+	unsigned mask = hash->capacity - 1;
+	unsigned bucket = wm_hash_xid(hash, xid);
+
+	while (hash->entries[bucket].index >= 0 && hash->entries[bucket].xid != xid) {
+		bucket = (bucket + 1) & mask;
+	}
+
+	if (hash->entries[bucket].index < 0) return; // not in the table
+
+	// we can't just empty the bucket, as that would cut off the probe sequences of the entries after it
+	// instead, shift back any entry that would still be reachable from its ideal bucket
+
+	unsigned hole = bucket;
 
-		if (window->exists && window->window == xid) {
-			return i;
+	for (unsigned next = (hole + 1) & mask; hash->entries[next].index >= 0; next = (next + 1) & mask) {
+		unsigned ideal = wm_hash_xid(hash, hash->entries[next].xid);
+
+		if (((next - ideal) & mask) >= ((next - hole) & mask)) {
+			hash->entries[hole] = hash->entries[next];
+			hole = next;
 		}
 	}
 
+	hash->entries[hole].index = -1;
+	hash->count--;
+}
+
+static int wm_find_window_by_xid(wm_t* wm, Window xid) {
+	int window_index = wm_hash_lookup(&wm->window_hash, xid);
+
+	// it's really super important to verify our window actually exists
+	// we could have a window that doesn't exist anymore, but that had the same ID as one that currently exists
+
+	if (window_index >= 0 && wm_get_window(wm, window_index)->exists) {
+		return window_index;
+	}
+
 	// this shouldn't ever happen normally
 	// we allow it when debugging, because sometimes it's useful to run our WM at the same time as another is running
 	// so even if *this* WM has never heard of a certain window, it's possible it's been modified in our previous WM
@@ -133,41 +389,204 @@ static int wm_find_window_by_xid(wm_t* wm, Window xid) {
 	return -1;
 }
 
-static void wm_sync_window(wm_t* wm, wm_window_t* window) {
-	XWindowAttributes attributes;
+// window state functions
+// all these queries are split in two: one function sends the request, and another waits for its reply
+// send all the requests you need first, and only then wait for any of them, so that they're all processed in one round trip
+
+static void wm_request_window_state(wm_t* wm, wm_window_t* window) {
+	// we always need to ask for the window's geometry once, because that's the only way to get its depth
+	// the rest is only needed if we haven't seen the window from the start (e.g. it was reparented to the root window), as we won't have gotten the events telling us about it
+
+	if (window->pending_state) return;
+	window->pending_state = 1;
+
+	if (!window->state_known) {
+		window->attributes_cookie = xcb_get_window_attributes(wm->connection, window->window);
+		wm->query_count++;
+	}
+
+	window->geometry_cookie = xcb_get_geometry(wm->connection, window->window);
+	wm->query_count++;
+}
+
+static void wm_receive_window_state(wm_t* wm, wm_window_t* window) {
+	if (!window->pending_state) return;
+	window->pending_state = 0;
 
-	XGetWindowAttributes(wm->display, window->window, &attributes);
+	// if the window was destroyed in the meantime, we'll get errors instead of replies
+	// that's fine, we'll get a 'DestroyNotify' event for it soon enough, so just keep whatever state we had
 
-	window->visible = attributes.map_state == IsViewable;
+	xcb_generic_error_t* error = NULL;
 
-	window->x = attributes.x;
-	window->y = attributes.y;
+	if (!window->state_known) {
+		xcb_get_window_attributes_reply_t* attributes = xcb_get_window_attributes_reply(wm->connection, window->attributes_cookie, &error);
 
-	window->width  = attributes.width;
-	window->height = attributes.height;
+		if (attributes) {
+			window->visible = attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+			window->override_redirect = attributes->override_redirect;
+
+			free(attributes);
+		}
+
+		free(error);
+		error = NULL;
+	}
+
+	xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(wm->connection, window->geometry_cookie, &error);
+
+	if (geometry) {
+		// events we got since we sent the request are more up to date than the reply, so only use the reply for what they can't tell us
+
+		if (!window->state_known) {
+			window->x = geometry->x;
+			window->y = geometry->y;
+
+			window->width  = geometry->width;
+			window->height = geometry->height;
+		}
+
+		window->depth = geometry->depth;
+		free(geometry);
+	}
+
+	free(error);
+	window->state_known = 1;
 
-	// TODO also get opacity of window here using the '_NET_WM_WINDOW_OPACITY' atom
-	//      see if this also is useful for checking if a window actually uses transparency at all (so that programs like OBS don't break)
-	//      (although I don't know how much of OBS breaking is due to GLX transparency not being properly implemented by me or due to some other reason where the alpha channel has garbage written in it)
-	//      when you re-implement transparency, don't forget to set the 'GLX_TEXTURE_FORMAT_EXT' attribute in 'cwm.h' and uncomment opacity in the shader code in 'main.c'
 }
 
-static void wm_update_client_list(wm_t* wm) {
-	int existing_window_count = 0;
+static void wm_request_property(wm_t* wm, wm_window_t* window, Atom atom, wm_property_query_t* query) {
+	// if there's already a request in flight, its reply might be out of date by now, so throw it away and ask again
+
+	if (query->pending) {
+		xcb_discard_reply(wm->connection, query->cookie.sequence);
+	}
+
+	query->pending = 1;
+	query->cookie = xcb_get_property(wm->connection, 0, window->window, atom, XCB_ATOM_CARDINAL, 0, 1);
+
+	wm->query_count++;
+}
+
+static int wm_receive_cardinal_property(wm_t* wm, wm_property_query_t* query, uint32_t* value) {
+	// returns whether or not the window has the property (if not, 'value' is left untouched)
+
+	if (!query->pending) return 0;
+	query->pending = 0;
+
+	xcb_generic_error_t* error = NULL;
+	xcb_get_property_reply_t* reply = xcb_get_property_reply(wm->connection, query->cookie, &error);
+
+	free(error);
+	if (!reply) return 0;
+
+	int found = reply->type == XCB_ATOM_CARDINAL && reply->format == 32 && xcb_get_property_value_length(reply) >= 4;
+
+	if (found) {
+		*value = *(uint32_t*) xcb_get_property_value(reply); // unlike Xlib, XCB gives us 32-bit properties as actual 32-bit values
+	}
+
+	free(reply);
+	return found;
+}
+
+static void wm_discard_property(wm_t* wm, wm_property_query_t* query) {
+	if (query->pending) {
+		xcb_discard_reply(wm->connection, query->cookie.sequence);
+	}
+
+	query->pending = 0;
+}
+
+static void wm_receive_properties(wm_t* wm, wm_window_t* window) {
+	// only update the properties we actually asked for
+
+	uint32_t value;
+
+	if (window->bypass_compositor_query.pending) {
+		window->bypass_compositor = wm_receive_cardinal_property(wm, &window->bypass_compositor_query, &value) ? (int) value : 0;
+	}
+
+	// opacity goes from 0 (completely transparent) to 0xffffffff (completely opaque)
+
+	if (window->opacity_query.pending) {
+		window->opacity = wm_receive_cardinal_property(wm, &window->opacity_query, &value) ? (float) value / 0xffffffff : 1.0;
+	}
+
+	// the sync counter is an XID, so if it changed, whatever alarm we had on the old one is useless
+
+	if (window->sync_counter_query.pending) {
+		XSyncCounter counter = wm_receive_cardinal_property(wm, &window->sync_counter_query, &value) ? (XSyncCounter) value : None;
+
+		if (counter != window->sync_counter) {
+			if (window->sync_alarm) {
+				XSyncDestroyAlarm(wm->display, window->sync_alarm);
+				wm_hash_remove(&wm->alarm_hash, window->sync_alarm);
+			}
+
+			window->sync_counter = counter;
+			window->sync_alarm = None;
+			window->sync_pending = 0;
+		}
+	}
+}
+
+static void wm_discard_window_state(wm_t* wm, wm_window_t* window) {
+	// we don't care about the replies anymore, but XCB still needs to know so it doesn't keep them around forever
+
+	if (window->pending_state) {
+		if (!window->state_known) xcb_discard_reply(wm->connection, window->attributes_cookie.sequence);
+		xcb_discard_reply(wm->connection, window->geometry_cookie.sequence);
+	}
+
+	window->pending_state = 0;
+
+	wm_discard_property(wm, &window->bypass_compositor_query);
+	wm_discard_property(wm, &window->opacity_query);
+	wm_discard_property(wm, &window->sync_counter_query);
+}
+
+static void wm_intern_atoms(wm_t* wm, const char** names, Atom* atoms, int count) {
+	// intern a bunch of atoms in a single round trip
 
-	for (int i = 0; i < wm->window_count; i++) {
-		existing_window_count += wm->windows[i].exists;
+	xcb_intern_atom_cookie_t cookies[count];
+
+	for (int i = 0; i < count; i++) {
+		cookies[i] = xcb_intern_atom(wm->connection, 0, strlen(names[i]), names[i]);
+	}
+
+	for (int i = 0; i < count; i++) {
+		xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(wm->connection, cookies[i], NULL);
+
+		atoms[i] = reply ? reply->atom : None;
+		free(reply);
 	}
+}
+
+static void wm_update_client_list(wm_t* wm) {
+	int existing_window_count = 0;
+	Window client_list[MAX(wm->windows.live_count, 1)];
 
-	Window client_list[existing_window_count];
+	for (int i = 0; i < wm->windows.slot_count; i++) {
+		wm_window_t* window = wm_get_window(wm, i);
 
-	for (int i = 0; i < existing_window_count; i++) {
-		client_list[i] = wm->windows[i].window;
+		if (window->exists) {
+			client_list[existing_window_count++] = window->window;
+		}
 	}
 
 	XChangeProperty(wm->display, wm->root_window, wm->client_list_atom, XA_WINDOW, 32, PropModeReplace, (unsigned char*) client_list, existing_window_count);
 }
 
+static float wm_mode_refresh_rate(XRRModeInfo* mode) {
+	float lines = mode->vTotal;
+
+	if (mode->modeFlags & RR_DoubleScan) lines *= 2;
+	if (mode->modeFlags & RR_Interlace)  lines /= 2;
+
+	if (!mode->hTotal || !lines) return 0;
+	return (float) mode->dotClock / (mode->hTotal * lines);
+}
+
 static int wm_error_handler(Display* display, XErrorEvent* event) {
 	if (!event->resourceid) return 0; // invalid window
 
@@ -194,6 +613,8 @@ void new_wm(wm_t* wm) {
 	wm->screen = DefaultScreen(wm->display);
 	wm->root_window = DefaultRootWindow(wm->display);
 
+	wm->connection = XGetXCBConnection(wm->display);
+
 	// get width/height of root window
 
 	XWindowAttributes attributes;
@@ -202,7 +623,7 @@ void new_wm(wm_t* wm) {
 	wm->width  = attributes.width;
 	wm->height = attributes.height;
 
-	// tell X to send us all 'CreateNotify', 'ConfigureNotify', and 'DestroyNotify' events ('SubstructureNotifyMask' also sends back some other events but we're not using those)
+	// tell X to send us all 'CreateNotify', 'ConfigureNotify', 'MapNotify', 'UnmapNotify', 'ReparentNotify', and 'DestroyNotify' events ('SubstructureNotifyMask' also sends back some other events but we're not using those)
 
 	XSelectInput(wm->display, wm->root_window, SubstructureNotifyMask | PointerMotionMask | ButtonMotionMask | ButtonPressMask | ButtonReleaseMask);
 
@@ -213,23 +634,43 @@ void new_wm(wm_t* wm) {
 	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XStringToKeysym("t")), Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
 	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XStringToKeysym("v")), Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
 	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XStringToKeysym("r")), Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
+	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XStringToKeysym("l")), Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
+	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XStringToKeysym("h")), Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
+	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XStringToKeysym("a")), Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
 	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XK_Print) /* PrtSc */, Mod4Mask | Mod1Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
 	XGrabKey(wm->display, XKeysymToKeycode(wm->display, XK_Print) /* PrtSc */, Mod4Mask, wm->root_window, 0, GrabModeAsync, GrabModeAsync);
 
 	// setup our atoms (explained in more detail in the 'wm_t' struct)
 	// we also need to specify which atoms are supported in '_NET_SUPPORTED'
 
-	wm->client_list_atom = XInternAtom(wm->display, "_NET_CLIENT_LIST", 0);
+	const char* atom_names[] = { "_NET_SUPPORTED", "_NET_CLIENT_LIST", "_NET_WM_BYPASS_COMPOSITOR", "_NET_SUPPORTING_WM_CHECK", "_NET_WM_NAME", "WM_PROTOCOLS", "WM_DELETE_WINDOW", "_NET_WM_WINDOW_OPACITY", "_NET_WM_SYNC_REQUEST", "_NET_WM_SYNC_REQUEST_COUNTER" };
+	Atom atoms[sizeof(atom_names) / sizeof(*atom_names)];
 
-	Atom supported_list_atom = XInternAtom(wm->display, "_NET_SUPPORTED", 0);
-	Atom supported_atoms[] = { supported_list_atom, wm->client_list_atom };
+	wm_intern_atoms(wm, atom_names, atoms, sizeof(atom_names) / sizeof(*atom_names));
+
+	Atom supported_list_atom = atoms[0];
+
+	wm->client_list_atom = atoms[1];
+	wm->bypass_compositor_atom = atoms[2];
+
+	Atom supporting_wm_check_atom = atoms[3];
+	Atom name_atom = atoms[4];
+
+	wm->protocols_atom = atoms[5];
+	wm->delete_window_atom = atoms[6];
+
+	wm->opacity_atom = atoms[7];
+
+	wm->sync_request_atom = atoms[8];
+	wm->sync_request_counter_atom = atoms[9];
+
+	Atom supported_atoms[] = { supported_list_atom, wm->client_list_atom, wm->bypass_compositor_atom, wm->opacity_atom, wm->sync_request_atom, wm->sync_request_counter_atom };
 
 	XChangeProperty(wm->display, wm->root_window, supported_list_atom, XA_ATOM, 32, PropModeReplace, (const unsigned char*) supported_atoms, sizeof(supported_atoms) / sizeof(*supported_atoms));
 
 	// now, we move on to '_NET_SUPPORTING_WM_CHECK'
 	// this is a bit weird, but it's all specified by the EWMH spec: https://developer.gnome.org/wm-spec/
 
-	Atom supporting_wm_check_atom = XInternAtom(wm->display, "_NET_SUPPORTING_WM_CHECK", 0);
 	Window support_window = XCreateSimpleWindow(wm->display, wm->root_window, 0, 0, 1, 1, 0, 0, 0);
 
 	Window support_window_list[1] = { support_window };
@@ -237,13 +678,62 @@ void new_wm(wm_t* wm) {
 	XChangeProperty(wm->display, wm->root_window, supporting_wm_check_atom, XA_WINDOW, 32, PropModeReplace, (const unsigned char*) support_window_list, 1);
 	XChangeProperty(wm->display, support_window,  supporting_wm_check_atom, XA_WINDOW, 32, PropModeReplace, (const unsigned char*) support_window_list, 1);
 
-	Atom name_atom = XInternAtom(wm->display, "_NET_WM_NAME", 0);
 	XChangeProperty(wm->display, support_window, name_atom, XA_STRING, 8, PropModeReplace, (const unsigned char*) WM_NAME, sizeof(WM_NAME));
 
 	// get all monitors and their individual resolutions
 
 	wm->monitor_infos = XineramaQueryScreens(wm->display, &wm->monitor_count);
 
+	// get the refresh rate of each monitor through RandR, so that a compositor can pace its frames to them
+	// Xinerama doesn't tell us which CRTC each of its screens is, so we match them by geometry
+	// if we can't get that for whatever reason, just assume 60 Hz
+
+	wm->refresh_rate = 0;
+	wm->monitor_refresh_rates = (float*) calloc(MAX(wm->monitor_count, 1), sizeof(*wm->monitor_refresh_rates));
+
+	int randr_event_base, randr_error_base;
+
+	if (XRRQueryExtension(wm->display, &randr_event_base, &randr_error_base)) {
+		XRRScreenResources* resources = XRRGetScreenResourcesCurrent(wm->display, wm->root_window);
+
+		for (int i = 0; resources && i < resources->ncrtc; i++) {
+			XRRCrtcInfo* crtc_info = XRRGetCrtcInfo(wm->display, resources, resources->crtcs[i]);
+			if (!crtc_info) continue;
+
+			float rate = 0;
+
+			for (int j = 0; j < resources->nmode; j++) {
+				if (resources->modes[j].id == crtc_info->mode) {
+					rate = wm_mode_refresh_rate(&resources->modes[j]);
+				}
+			}
+
+			wm->refresh_rate = MAX(wm->refresh_rate, rate);
+
+			for (int j = 0; j < wm->monitor_count; j++) {
+				XineramaScreenInfo* info = &wm->monitor_infos[j];
+
+				if (info->x_org == crtc_info->x && info->y_org == crtc_info->y && info->width == (int) crtc_info->width && info->height == (int) crtc_info->height) {
+					wm->monitor_refresh_rates[j] = MAX(wm->monitor_refresh_rates[j], rate); // mirrored CRTCs show up as a single Xinerama screen
+				}
+			}
+
+			XRRFreeCrtcInfo(crtc_info);
+		}
+
+		if (resources) XRRFreeScreenResources(resources);
+	}
+
+	if (wm->refresh_rate <= 0) {
+		wm->refresh_rate = 60;
+	}
+
+	for (int i = 0; i < wm->monitor_count; i++) {
+		if (wm->monitor_refresh_rates[i] <= 0) {
+			wm->monitor_refresh_rates[i] = wm->refresh_rate;
+		}
+	}
+
 	// TODO REMME, this was just for testing
 
 	// wm->monitor_count = 3; // virtual monitors
@@ -273,6 +763,14 @@ void new_wm(wm_t* wm) {
 	// wm->monitor_infos[2].width  = 640;
 	// wm->monitor_infos[2].height = 1024;
 
+	// we need X SYNC for '_NET_WM_SYNC_REQUEST'
+	// if it's not there, we just resize windows without waiting for clients to catch up
+
+	int sync_error_base;
+	int sync_major, sync_minor;
+
+	wm->sync_supported = XSyncQueryExtension(wm->display, &wm->sync_event_base, &sync_error_base) && XSyncInitialize(wm->display, &sync_major, &sync_minor);
+
 	// create our own error handler so X doesn't crash
 
 	XSetErrorHandler(wm_error_handler);
@@ -291,8 +789,7 @@ void new_wm(wm_t* wm) {
 
 	// setup windows
 
-	wm->windows = (wm_window_t*) malloc(1);
-	wm->window_count = 0;
+	new_slab(&wm->windows, sizeof(wm_window_t));
 }
 
 int wm_x_resolution(wm_t* wm) { return wm->width;  }
@@ -306,6 +803,14 @@ float wm_monitor_y(wm_t* wm, int monitor_index) { return wm_y_coordinate_to_floa
 float wm_monitor_width (wm_t* wm, int monitor_index) { return wm_width_dimension_to_float (wm, wm->monitor_infos[monitor_index].width ); }
 float wm_monitor_height(wm_t* wm, int monitor_index) { return wm_height_dimension_to_float(wm, wm->monitor_infos[monitor_index].height); }
 
+float wm_monitor_refresh_rate(wm_t* wm, int monitor_index) { return wm->monitor_refresh_rates[monitor_index]; }
+
+// window handles
+// unlike internal ids, these can be held on to across events, as they stop referring to anything once their window is destroyed (even if its slot is reused)
+
+slab_handle_t wm_window_handle(wm_t* wm, unsigned window_id) { return slab_handle(&wm->windows, window_id); }
+int wm_window_from_handle(wm_t* wm, slab_handle_t handle) { return slab_resolve(&wm->windows, handle); } // -1 if the window doesn't exist anymore
+
 // useful functions for managing windows
 
 void wm_close_window(wm_t* wm, unsigned window_id) {
@@ -315,202 +820,666 @@ void wm_close_window(wm_t* wm, unsigned window_id) {
 	XEvent event;
 
 	event.xclient.type = ClientMessage;
-	event.xclient.window = wm->windows[window_id].window;
-	event.xclient.message_type = XInternAtom(wm->display, "WM_PROTOCOLS", 1);
+	event.xclient.window = wm_get_window(wm, window_id)->window;
+	event.xclient.message_type = wm->protocols_atom;
 	event.xclient.format = 32;
-	event.xclient.data.l[0] = XInternAtom(wm->display, "WM_DELETE_WINDOW", 0);
+	event.xclient.data.l[0] = wm->delete_window_atom;
 	event.xclient.data.l[1] = CurrentTime;
 
-	XSendEvent(wm->display, wm->windows[window_id].window, 0, NoEventMask, &event);
+	XSendEvent(wm->display, wm_get_window(wm, window_id)->window, 0, NoEventMask, &event);
 }
 
 void wm_kill_window(wm_t* wm, unsigned window_id) {
 	// this function properly kills windows
 	// use this sparingly, when force-closing an unresponsive window for example
 
-	XDestroyWindow(wm->display, wm->windows[window_id].window);
+	XDestroyWindow(wm->display, wm_get_window(wm, window_id)->window);
+}
+
+static void wm_send_sync_request(wm_t* wm, unsigned window_id) {
+	// ask the client to tell us when it's done drawing at the size we're about to give it (this must be sent before the resize itself)
+	// see the '_NET_WM_SYNC_REQUEST' section of the EWMH spec
+
+	wm_window_t* window = wm_get_window(wm, window_id);
+	if (!wm->sync_supported || !window->sync_counter) return;
+
+	// we have to count up from wherever the client's counter currently is, so ask for that the first time around
+	// this is the only round trip of the whole thing, and it only happens once per window
+
+	if (!window->sync_alarm) {
+		XSyncValue value;
+		if (!XSyncQueryCounter(wm->display, window->sync_counter, &value)) return;
+
+		window->sync_value = (uint64_t) XSyncValueHigh32(value) << 32 | XSyncValueLow32(value);
+	}
+
+	window->sync_value++;
+
+	XSyncAlarmAttributes attributes;
+	XSyncIntsToValue(&attributes.trigger.wait_value, window->sync_value & 0xffffffff, window->sync_value >> 32);
+
+	// the server checks an alarm's trigger as soon as it's created, so the alarm is only created once we know the first value to wait for
+	// creating it with the counter's current value would make it go off straight away, and the first resize wouldn't be throttled at all
+
+	if (!window->sync_alarm) {
+		attributes.trigger.counter = window->sync_counter;
+		attributes.trigger.value_type = XSyncAbsolute;
+		attributes.trigger.test_type = XSyncPositiveComparison;
+
+		XSyncIntToValue(&attributes.delta, 0);
+		attributes.events = True;
+
+		window->sync_alarm = XSyncCreateAlarm(wm->display, XSyncCACounter | XSyncCAValueType | XSyncCAValue | XSyncCATestType | XSyncCADelta | XSyncCAEvents, &attributes);
+		wm_hash_insert(&wm->alarm_hash, window->sync_alarm, window_id);
+	}
+
+	// changing the alarm's value also rearms it
+
+	else {
+		XSyncChangeAlarm(wm->display, window->sync_alarm, XSyncCAValue, &attributes);
+	}
+
+	XEvent event;
+	memset(&event, 0, sizeof(event));
+
+	event.xclient.type = ClientMessage;
+	event.xclient.window = window->window;
+	event.xclient.message_type = wm->protocols_atom;
+	event.xclient.format = 32;
+	event.xclient.data.l[0] = wm->sync_request_atom;
+	event.xclient.data.l[1] = CurrentTime;
+	event.xclient.data.l[2] = window->sync_value & 0xffffffff;
+	event.xclient.data.l[3] = window->sync_value >> 32;
+
+	XSendEvent(wm->display, window->window, 0, NoEventMask, &event);
+
+	window->sync_pending = 1;
+	window->sync_request_time = wm_now();
+}
+
+int wm_window_busy(wm_t* wm, unsigned window_id) {
+	// returns whether the client is still drawing at the last size we gave it, in which case sending it another one now would just make it fall further behind
+	// clients which don't support '_NET_WM_SYNC_REQUEST' are never busy, and we stop waiting for ones which take too long, in case they're stuck
+
+	wm_window_t* window = wm_get_window(wm, window_id);
+	return window->sync_pending && wm_now() - window->sync_request_time < WM_SYNC_REQUEST_TIMEOUT;
 }
 
 void wm_move_window(wm_t* wm, unsigned window_id, float x, float y, float width, float height) {
-	XMoveResizeWindow(wm->display, wm->windows[window_id].window,
+	wm_window_t* window = wm_get_window(wm, window_id);
+
+	int pixel_width  = wm_float_to_width_dimension (wm, width);
+	int pixel_height = wm_float_to_height_dimension(wm, height);
+
+	if (pixel_width != window->width || pixel_height != window->height) {
+		wm_send_sync_request(wm, window_id);
+	}
+
+	XMoveResizeWindow(wm->display, window->window,
 		wm_float_to_x_coordinate(wm, x - width / 2), wm_float_to_y_coordinate(wm, y + height / 2),
-		wm_float_to_width_dimension(wm, width), wm_float_to_height_dimension(wm, height));
+		pixel_width, pixel_height);
 }
 
 void wm_focus_window(wm_t* wm, unsigned window_id) {
-	Window window = wm->windows[window_id].window;
+	Window window = wm_get_window(wm, window_id)->window;
 
 	XSetInputFocus(wm->display, window, RevertToParent, CurrentTime);
 	XMapRaised(wm->display, window);
 }
 
-// event processing call
+void wm_raise_window(wm_t* wm, unsigned window_id) {
+	XRaiseWindow(wm->display, wm_get_window(wm, window_id)->window);
+}
 
-int wm_process_events(wm_t* wm, void* thing) {
-	int events_left = XPending(wm->display);
+void wm_lower_window(wm_t* wm, unsigned window_id) {
+	XLowerWindow(wm->display, wm_get_window(wm, window_id)->window);
+}
 
-	if (events_left) {
-		XEvent event;
-		XNextEvent(wm->display, &event);
+// event processing calls
 
-		int type = event.type;
+void wm_wait_events(wm_t* wm, int timeout) {
+	// block until either events are available or 'timeout' milliseconds have passed (a negative timeout means wait forever)
+	// this is where we flush the output buffer, which means requests are only sent off once per iteration of the main loop
 
-		if (type == KeyPress || type == KeyRelease) {
-			if (wm->keyboard_event_callback) {
-				wm->keyboard_event_callback(thing, wm_find_window_by_xid(wm, event.xkey.window),
-					event.xkey.type == KeyPress, event.xkey.state, event.xkey.keycode);
-			}
+	XFlush(wm->display);
+
+	// Xlib might have already read some events into its queue (e.g. while waiting for a reply), in which case 'poll' wouldn't tell us about them
+
+	if (XEventsQueued(wm->display, QueuedAlready)) {
+		return;
+	}
+
+	struct pollfd poll_fd = {
+		.fd = ConnectionNumber(wm->display),
+		.events = POLLIN,
+	};
+
+	poll(&poll_fd, 1, timeout);
+}
+
+// event coalescing functions
+
+static void wm_flush_motion(wm_t* wm, void* thing) {
+	if (!wm->motion_pending) return;
+	wm->motion_pending = 0;
+
+	XEvent* event = &wm->pending_motion;
+
+	if (wm->move_event_callback) {
+		wm->move_event_callback(thing, wm_find_window_by_xid(wm, event->xmotion.subwindow),
+			event->xmotion.state,
+			wm_x_coordinate_to_float(wm, event->xmotion.x_root), wm_y_coordinate_to_float(wm, event->xmotion.y_root));
+	}
+
+	wm->delivered_event_count++;
+}
+
+static void wm_push_window_index(int** list, int* count, int* capacity, int window_index) {
+	if (*count >= *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 16;
+		*list = (int*) realloc(*list, *capacity * sizeof(**list));
+	}
+
+	(*list)[(*count)++] = window_index;
+}
+
+static void wm_mark_modified(wm_t* wm, int window_index) {
+	// we don't care about the individual 'ConfigureNotify'/'MapNotify'/'UnmapNotify' events, only about the state the window ends up in
+	// so just remember the window changed, and we'll get its net state once at the end of the batch
+
+	wm_window_t* window = wm_get_window(wm, window_index);
+	if (window->pending_modify) return;
+
+	window->pending_modify = 1;
+	wm_push_window_index(&wm->pending_modify_windows, &wm->pending_modify_count, &wm->pending_modify_capacity, window_index);
+}
+
+static void wm_mark_created(wm_t* wm, int window_index) {
+	wm_window_t* window = wm_get_window(wm, window_index);
+
+	window->pending_create = 1;
+	wm_push_window_index(&wm->pending_create_windows, &wm->pending_create_count, &wm->pending_create_capacity, window_index);
+}
+
+static void wm_deliver_create(wm_t* wm, void* thing, int window_index) {
+	wm_window_t* window = wm_get_window(wm, window_index);
+
+	wm_receive_window_state(wm, window);
+	wm_receive_properties(wm, window);
+
+	if (wm->create_event_callback) {
+		wm->create_event_callback(thing, window_index);
+	}
+
+	wm->delivered_event_count++;
+}
+
+static void wm_deliver_modify(wm_t* wm, void* thing, int window_index, xcb_query_pointer_reply_t* pointer) {
+	wm_window_t* window = wm_get_window(wm, window_index);
+
+	wm_receive_window_state(wm, window);
+	wm_receive_properties(wm, window);
+
+	// if the window was just mapped at (0, 0), center it to the cursor position
+	// the pointer position was requested once for all windows at the start of the batch, so this doesn't cost us a round trip per window
+
+	if (window->needs_centering && window->visible && pointer) {
+		window->x = pointer->root_x - window->width  / 2;
+		window->y = pointer->root_y - window->height / 2;
+
+		XMoveWindow(wm->display, window->window, window->x, window->y);
+	}
+
+	window->needs_centering = 0;
+
+	if (wm->modify_event_callback) {
+		wm->modify_event_callback(thing, window_index, window->visible,
+			wm_x_coordinate_to_float(wm, window->x + window->width / 2), wm_y_coordinate_to_float(wm, window->y + window->height / 2),
+			wm_width_dimension_to_float (wm, window->width), wm_height_dimension_to_float(wm, window->height));
+	}
+
+	wm->delivered_event_count++;
+}
+
+static void wm_flush_events(wm_t* wm, void* thing) {
+	// deliver everything we've been holding back, windows first so the pointer position makes sense relative to them
+	// windows destroyed in the meantime have had their 'pending_create'/'pending_modify' flags cleared, and a window can appear more than once if its slot was reused
+
+	// the window state itself comes from the events we got, so all we might still need to ask for is the pointer position, to center newly shown windows on it
+	// (any queries for windows we don't know enough about were already sent when we first heard of them)
+
+	int pointer_pending = 0;
+	xcb_query_pointer_cookie_t pointer_cookie;
+
+	for (int i = 0; i < wm->pending_modify_count; i++) {
+		wm_window_t* window = wm_get_window(wm, wm->pending_modify_windows[i]);
+		if (!window->exists || !window->pending_modify) continue;
+
+		if (window->needs_centering && window->visible) {
+			pointer_cookie = xcb_query_pointer(wm->connection, wm->root_window);
+			pointer_pending = 1;
+
+			wm->query_count++;
+			break;
 		}
+	}
 
-		else if (type == ButtonPress || type == ButtonRelease) {
-			if (wm->click_event_callback) {
-				unsigned window = -1;
+	// then, wait for the replies and deliver the events
+	// creations go first, so that the callbacks never hear about a window being modified before they've heard about it being created
 
-				if (!wm_event_blacklisted_window(wm, event.xbutton.window)) {
-					window = wm_find_window_by_xid(wm, event.xbutton.window);
-				}
+	for (int i = 0; i < wm->pending_create_count; i++) {
+		int window_index = wm->pending_create_windows[i];
+		wm_window_t* window = wm_get_window(wm, window_index);
 
-				if (wm->click_event_callback(thing, window,
-						event.xbutton.type == ButtonPress, event.xbutton.state, event.xbutton.button,
-						wm_x_coordinate_to_float(wm, event.xbutton.x_root), wm_y_coordinate_to_float(wm, event.xbutton.y_root))) {
+		if (!window->exists || !window->pending_create) continue;
+		window->pending_create = 0;
 
-					// pass the event on to the client
-					XAllowEvents(wm->display, ReplayPointer, CurrentTime);
-				}
+		wm_deliver_create(wm, thing, window_index);
+	}
 
-				else {
-					// if we shouldn't pass the event on to the client, we still need to sync the pointer or else we hang
-					XAllowEvents(wm->display, SyncPointer, CurrentTime);
-				}
-			}
+	wm->pending_create_count = 0;
+
+	// every window we're centering shares the same pointer position
+
+	xcb_query_pointer_reply_t* pointer = NULL;
+
+	if (pointer_pending) {
+		pointer = xcb_query_pointer_reply(wm->connection, pointer_cookie, NULL);
+	}
+
+	for (int i = 0; i < wm->pending_modify_count; i++) {
+		int window_index = wm->pending_modify_windows[i];
+		wm_window_t* window = wm_get_window(wm, window_index);
+
+		if (!window->exists || !window->pending_modify) continue;
+		window->pending_modify = 0;
+
+		wm_deliver_modify(wm, thing, window_index, pointer);
+	}
+
+	wm->pending_modify_count = 0;
+	free(pointer);
+
+	if (wm->client_list_dirty) {
+		wm_update_client_list(wm);
+		wm->client_list_dirty = 0;
+	}
+
+	wm_flush_motion(wm, thing);
+}
+
+static int wm_add_window(wm_t* wm, Window x_window) {
+	// start tracking a new window, and returns its index in the window list
+	// the callbacks only hear about it at the end of the batch, once its depth (and anything else we've asked for) has come back from the server
+
+	// this reuses the slot of a destroyed window if there is one (slots always come zeroed out)
+
+	int window_index = slab_alloc(&wm->windows);
+	wm_window_t* window = wm_get_window(wm, window_index);
+
+	window->exists = 1;
+	window->window = x_window;
+
+	wm_hash_insert(&wm->window_hash, x_window, window_index);
+
+	window->opacity = 1.0;
+
+	wm_request_property(wm, window, wm->bypass_compositor_atom, &window->bypass_compositor_query);
+	wm_request_property(wm, window, wm->opacity_atom, &window->opacity_query);
+	wm_request_property(wm, window, wm->sync_request_counter_atom, &window->sync_counter_query);
+
+	wm_mark_created(wm, window_index);
+
+	// set up some other stuff for the window
+	// this is saying we want focus change, property change, and button events from the window
+
+	XSelectInput(wm->display, x_window, FocusChangeMask | PropertyChangeMask);
+	XGrabButton(wm->display, AnyButton, AnyModifier, x_window, 1, ButtonPressMask | ButtonReleaseMask | ButtonMotionMask, GrabModeSync, GrabModeSync, 0, 0);
+
+	// '_NET_CLIENT_LIST' is only rewritten at the end of the batch (see 'wm_flush_events')
+
+	wm->client_list_dirty = 1;
+	return window_index;
+}
+
+static void wm_remove_window(wm_t* wm, void* thing, int window_index, int destroyed) {
+	// 'destroyed' is whether the window is actually gone, as opposed to just not being a top-level window anymore (e.g. reparented by some other client)
+
+	wm_window_t* window = wm_get_window(wm, window_index);
+
+	// if the callbacks haven't even heard about the window being created yet, there's no need to tell them it's gone
+
+	if (wm->destroy_event_callback && !window->pending_create) {
+		wm->destroy_event_callback(thing, window_index, destroyed);
+	}
+
+	// remove the window from our list
+	// if it still had events or replies waiting to be delivered, those are obviously not relevant anymore
+
+	wm_discard_window_state(wm, window);
+
+	// the counter belongs to the client, but the alarm is ours
+
+	if (window->sync_alarm) {
+		XSyncDestroyAlarm(wm->display, window->sync_alarm);
+		wm_hash_remove(&wm->alarm_hash, window->sync_alarm);
+
+		window->sync_alarm = None;
+	}
+
+	// if the window is still around, undo what 'wm_add_window' set up on it, so we stop hearing about it and its new parent gets its button presses back
+
+	if (!destroyed) {
+		XSelectInput(wm->display, window->window, NoEventMask);
+		XUngrabButton(wm->display, AnyButton, AnyModifier, window->window);
+	}
+
+	window->exists = 0;
+	window->pending_create = 0;
+	window->pending_modify = 0;
+	wm_hash_remove(&wm->window_hash, window->window);
+
+	// the slot can be reused straight away, but its contents stay around until it is, so anything still in the pending lists will just see it doesn't exist anymore
+
+	slab_free(&wm->windows, window_index);
+
+	wm->client_list_dirty = 1;
+}
+
+static void wm_handle_event(wm_t* wm, void* thing, XEvent* event) {
+	int type = event->type;
+
+	// only keep the latest pointer motion around, we'll deliver it when we're done with this batch
+	// anything the user does with the keyboard or buttons needs to see what happened before it though, so flush everything first
+
+	if (type == MotionNotify) {
+		wm->pending_motion = *event;
+		wm->motion_pending = 1;
+
+		return;
+	}
+
+	if (type == KeyPress || type == KeyRelease || type == ButtonPress || type == ButtonRelease) {
+		wm_flush_events(wm, thing);
+	}
+
+	// the rest of the events are delivered straight away, except for window creations and modifications which are marked and delivered at the end of the batch
+
+	if (type != CreateNotify && type != ConfigureNotify && type != MapNotify && type != UnmapNotify && type != ReparentNotify && type != PropertyNotify) {
+		wm->delivered_event_count++;
+	}
+
+	if (type == KeyPress || type == KeyRelease) {
+		if (wm->keyboard_event_callback) {
+			wm->keyboard_event_callback(thing, wm_find_window_by_xid(wm, event->xkey.window),
+				event->xkey.type == KeyPress, event->xkey.state, event->xkey.keycode);
 		}
+	}
+
+	else if (type == ButtonPress || type == ButtonRelease) {
+		if (wm->click_event_callback) {
+			unsigned window = -1;
+
+			if (!wm_event_blacklisted_window(wm, event->xbutton.window)) {
+				window = wm_find_window_by_xid(wm, event->xbutton.window);
+			}
+
+			if (wm->click_event_callback(thing, window,
+					event->xbutton.type == ButtonPress, event->xbutton.state, event->xbutton.button,
+					wm_x_coordinate_to_float(wm, event->xbutton.x_root), wm_y_coordinate_to_float(wm, event->xbutton.y_root))) {
+
+				// pass the event on to the client
+				XAllowEvents(wm->display, ReplayPointer, CurrentTime);
+			}
 
-		else if (type == MotionNotify) {
-			if (wm->move_event_callback) {
-				wm->move_event_callback(thing, wm_find_window_by_xid(wm, event.xmotion.subwindow),
-					event.xmotion.state,
-					wm_x_coordinate_to_float(wm, event.xmotion.x_root), wm_y_coordinate_to_float(wm, event.xmotion.y_root));
+			else {
+				// if we shouldn't pass the event on to the client, we still need to sync the pointer or else we hang
+				XAllowEvents(wm->display, SyncPointer, CurrentTime);
 			}
 		}
+	}
 
-		// window notification events
+	// window notification events
 
-		else if (type == CreateNotify) {
-			Window x_window = event.xcreatewindow.window;
-			if (wm_event_blacklisted_window(wm, x_window)) goto done;
+	else if (type == CreateNotify) {
+		Window x_window = event->xcreatewindow.window;
+		if (wm_event_blacklisted_window(wm, x_window)) return;
 
-			wm_window_t* window = (wm_window_t*) 0;
-			int window_index;
+		// we might already know about the window if it was created while we were adopting existing windows (see 'wm_adopt_windows')
 
-			// search for an empty space in the window list
+		int window_index = wm_hash_lookup(&wm->window_hash, x_window);
+		if (window_index >= 0 && wm_get_window(wm, window_index)->exists) return;
 
-			for (window_index = 0; window_index < wm->window_count; window_index++) {
-				if (!wm->windows[window_index].exists) {
-					window = &wm->windows[window_index];
-					break;
-				}
-			}
+		// new windows are always unmapped, and everything else we need to know (except for the depth) is in the event
 
-			// if no empty space found, add one
+		XCreateWindowEvent* create_event = &event->xcreatewindow;
+		wm_window_t* window = wm_get_window(wm, wm_add_window(wm, x_window));
 
-			if (!window) {
-				wm->windows = (wm_window_t*) realloc(wm->windows, (wm->window_count + 1) * sizeof(wm_window_t));
-				window_index = wm->window_count;
+		window->x = create_event->x;
+		window->y = create_event->y;
 
-				window = &wm->windows[window_index];
-				wm->window_count++;
-			}
+		window->width  = create_event->width;
+		window->height = create_event->height;
 
-			memset(window, 0, sizeof(*window));
+		window->override_redirect = create_event->override_redirect;
+		window->state_known = 1;
 
-			window->exists = 1;
-			window->window = x_window;
+		wm_request_window_state(wm, window);
+	}
 
-			if (wm->create_event_callback) {
-				wm->create_event_callback(thing, window_index);
-			}
+	// TODO 'VisibilityNotify'?
 
-			// set up some other stuff for the window
-			// this is saying we want focus change and button events from the window
+	else if (type == ConfigureNotify || type == MapNotify /* show window */ || type == UnmapNotify /* hide window */) {
+		Window x_window;
 
-			XSelectInput(wm->display, x_window, FocusChangeMask);
-			XGrabButton(wm->display, AnyButton, AnyModifier, x_window, 1, ButtonPressMask | ButtonReleaseMask | ButtonMotionMask, GrabModeSync, GrabModeSync, 0, 0);
+		if (type == ConfigureNotify) x_window = event->xconfigure.window;
+		else if (type == MapNotify) x_window = event->xmap.window;
+		else if (type == UnmapNotify) x_window = event->xunmap.window;
 
-			wm_update_client_list(wm);
-		}
+		if (wm_event_blacklisted_window(wm, x_window)) return;
 
-		// TODO 'VisibilityNotify'?
+		int window_index = wm_find_window_by_xid(wm, x_window);
+		if (window_index < 0) return;
+		wm_window_t* window = wm_get_window(wm, window_index);
 
-		else if (type == ConfigureNotify || type == MapNotify /* show window */ || type == UnmapNotify /* hide window */) {
-			Window x_window;
+		// keep track of the window's state ourselves, so we never have to ask the server for it
 
-			if (type == ConfigureNotify) x_window = event.xconfigure.window;
-			else if (type == MapNotify) x_window = event.xmap.window;
-			else if (type == UnmapNotify) x_window = event.xunmap.window;
+		if (type == ConfigureNotify) {
+			window->x = event->xconfigure.x;
+			window->y = event->xconfigure.y;
 
-			if (wm_event_blacklisted_window(wm, x_window)) goto done;
+			window->width  = event->xconfigure.width;
+			window->height = event->xconfigure.height;
 
-			int window_index = wm_find_window_by_xid(wm, x_window);
-			if (window_index < 0) goto done;
-			wm_window_t* window = &wm->windows[window_index];
+			window->override_redirect = event->xconfigure.override_redirect;
+		}
+
+		else if (type == MapNotify) {
+			// our windows are all children of the root window, so they're viewable as soon as they're mapped
 
-			int was_visible = window->visible;
-			wm_sync_window(wm, window);
+			window->needs_centering = !window->visible && !window->x && !window->y;
+			window->visible = 1;
 
-			// if window wasn't visible before but is now, center it to the cursor position
+			window->override_redirect = event->xmap.override_redirect;
+		}
 
-			if (window->visible && !was_visible && !window->x && !window->y) {
-				__attribute__((unused)) Window rw, cw; // root_return, child_return
-				__attribute__((unused)) int wx, wy; // win_x_return, win_y_return
-				__attribute__((unused)) unsigned int mask; // mask_return
+		else if (type == UnmapNotify) {
+			window->needs_centering = 0;
+			window->visible = 0;
+		}
 
-				int x, y;
-				XQueryPointer(wm->display, window->window, &rw, &cw, &x, &y, &wx, &wy, &mask);
+		wm_mark_modified(wm, window_index);
+	}
 
-				window->x = x - window->width  / 2;
-				window->y = y - window->height / 2;
+	else if (type == ReparentNotify) {
+		Window x_window = event->xreparent.window;
+		if (wm_event_blacklisted_window(wm, x_window)) return;
 
-				XMoveWindow(wm->display, window->window, window->x, window->y);
-			}
+		int window_index = wm_hash_lookup(&wm->window_hash, x_window);
 
-			if (wm->modify_event_callback) {
-				wm->modify_event_callback(thing, window_index, window->visible,
-					wm_x_coordinate_to_float(wm, window->x + window->width / 2), wm_y_coordinate_to_float(wm, window->y + window->height / 2),
-					wm_width_dimension_to_float (wm, window->width), wm_height_dimension_to_float(wm, window->height));
+		if (window_index >= 0 && !wm_get_window(wm, window_index)->exists) {
+			window_index = -1;
+		}
+
+		// if one of our windows was reparented to some other window, it's not a top-level window anymore, so it's as good as destroyed as far as we're concerned
+
+		if (event->xreparent.parent != wm->root_window) {
+			if (window_index >= 0) {
+				wm_remove_window(wm, thing, window_index, 0);
 			}
+
+			return;
 		}
 
-		// else if (type == FocusIn) {
-		// 	Window x_window = event.xfocus.window;
-		// 	if (wm_event_blacklisted_window(wm, x_window)) goto done;
+		// otherwise, it's a window which was reparented to the root window, which we may never have seen before
+		// if so, we have no idea what state it's in, so we have to ask the server
 
-		// 	int window_index = wm_find_window_by_xid(wm, x_window);
-		// 	if (window_index < 0) goto done;
+		if (window_index < 0) {
+			window_index = wm_add_window(wm, x_window);
+			wm_request_window_state(wm, wm_get_window(wm, window_index));
+		}
 
-		// 	if (wm->focus_event_callback) {
-		// 		wm->focus_event_callback(thing, window_index);
-		// 	}
-		// }
+		wm_window_t* window = wm_get_window(wm, window_index);
 
-		else if (type == DestroyNotify) {
-			Window x_window = event.xdestroywindow.window;
-			if (!x_window) goto done;
+		window->x = event->xreparent.x;
+		window->y = event->xreparent.y;
 
-			int window_index = wm_find_window_by_xid(wm, x_window);
-			if (window_index < 0) goto done;
-			wm_window_t* window = &wm->windows[window_index];
+		window->override_redirect = event->xreparent.override_redirect;
 
-			if (wm->destroy_event_callback) {
-				wm->destroy_event_callback(thing, window_index);
-			}
+		wm_mark_modified(wm, window_index);
+	}
+
+	else if (type == PropertyNotify) {
+		// we only care about properties which change how the window should be composited
+		// this is treated as a modification of the window, so that the compositor gets to know about it at the end of the batch
+
+		Atom atom = event->xproperty.atom;
+		if (atom != wm->bypass_compositor_atom && atom != wm->opacity_atom && atom != wm->sync_request_counter_atom) return;
+
+		Window x_window = event->xproperty.window;
+		if (wm_event_blacklisted_window(wm, x_window)) return;
+
+		int window_index = wm_find_window_by_xid(wm, x_window);
+		if (window_index < 0) return;
+		wm_window_t* window = wm_get_window(wm, window_index);
+
+		if (atom == wm->bypass_compositor_atom) wm_request_property(wm, window, atom, &window->bypass_compositor_query);
+		else if (atom == wm->opacity_atom) wm_request_property(wm, window, atom, &window->opacity_query);
+		else wm_request_property(wm, window, atom, &window->sync_counter_query);
+
+		wm_mark_modified(wm, window_index);
+	}
 
-			// remove the window from our list
-			wm->windows[window_index].exists = 0;
+	// else if (type == FocusIn) {
+	// 	Window x_window = event->xfocus.window;
+	// 	if (wm_event_blacklisted_window(wm, x_window)) return;
 
-			wm_update_client_list(wm);
+	// 	int window_index = wm_find_window_by_xid(wm, x_window);
+	// 	if (window_index < 0) return;
+
+	// 	if (wm->focus_event_callback) {
+	// 		wm->focus_event_callback(thing, window_index);
+	// 	}
+	// }
+
+	else if (type == DestroyNotify) {
+		Window x_window = event->xdestroywindow.window;
+		if (!x_window) return;
+
+		int window_index = wm_find_window_by_xid(wm, x_window);
+		if (window_index < 0) return;
+
+		wm_remove_window(wm, thing, window_index, 1);
+	}
+
+	else if (wm->damage_event_base && type == wm->damage_event_base + XDamageNotify) {
+		XDamageNotifyEvent* damage_event = (XDamageNotifyEvent*) event;
+
+		int window_index = wm_find_window_by_xid(wm, damage_event->drawable);
+		if (window_index < 0) return;
+
+		// the damaged area is given in pixels relative to the window
+
+		if (wm->damage_event_callback) {
+			wm->damage_event_callback(thing, window_index,
+				damage_event->area.x, damage_event->area.y, damage_event->area.width, damage_event->area.height);
 		}
 	}
 
-done:
-	return events_left;
+	else if (wm->sync_supported && type == wm->sync_event_base + XSyncAlarmNotify) {
+		// a client finished drawing at the size we last gave it (see 'wm_send_sync_request')
+		// alarms live from a window's first resize until it's destroyed, so they're looked up in their own hash table rather than by going through every window
+
+		XSyncAlarmNotifyEvent* alarm_event = (XSyncAlarmNotifyEvent*) event;
+
+		int window_index = wm_hash_lookup(&wm->alarm_hash, alarm_event->alarm);
+		if (window_index < 0) return;
+
+		wm_window_t* window = wm_get_window(wm, window_index);
+		if (!window->exists || window->sync_alarm != alarm_event->alarm) return;
+
+		// if we've sent another request since, this is the client catching up to an older one, so we still have to wait
+
+		uint64_t value = (uint64_t) XSyncValueHigh32(alarm_event->counter_value) << 32 | XSyncValueLow32(alarm_event->counter_value);
+		if (value < window->sync_value) return;
+
+		// this is treated as a modification of the window, so that whoever is resizing it gets to send it its next size, and so that a compositor can pick up its new contents
+
+		window->sync_pending = 0;
+		wm_mark_modified(wm, window_index);
+	}
+}
+
+void wm_adopt_windows(wm_t* wm, void* thing) {
+	// start tracking all the windows which already exist (e.g. if we were restarted), as we'd otherwise only hear about them once they're recreated
+	// we don't know anything about these, so we have to ask the server for their state, but it's all sent off at once so it only costs us two round trips however many windows there are
+	// the callbacks hear about them straight away, in stacking order from the bottom to the top
+
+	xcb_query_tree_reply_t* tree = xcb_query_tree_reply(wm->connection, xcb_query_tree(wm->connection, wm->root_window), NULL);
+	wm->query_count++;
+
+	if (!tree) return;
+
+	xcb_window_t* children = xcb_query_tree_children(tree);
+	int child_count = xcb_query_tree_children_length(tree);
+
+	for (int i = 0; i < child_count; i++) {
+		Window x_window = children[i];
+		if (wm_event_blacklisted_window(wm, x_window)) continue;
+
+		// we could already know about the window if it was created since we started listening for events
+
+		int window_index = wm_hash_lookup(&wm->window_hash, x_window);
+		if (window_index >= 0 && wm_get_window(wm, window_index)->exists) continue;
+
+		window_index = wm_add_window(wm, x_window);
+
+		wm_request_window_state(wm, wm_get_window(wm, window_index));
+		wm_mark_modified(wm, window_index);
+	}
+
+	free(tree);
+	wm_flush_events(wm, thing);
+}
+
+int wm_process_events(wm_t* wm, void* thing) {
+	// handle all the events we've received in one go
+	// 'XEventsQueued' with 'QueuedAfterReading' reads whatever is waiting on the connection without flushing the output buffer (unlike 'XPending')
+	// motion and window modification events are coalesced and only delivered once at the end
+	// returns the number of events received
+
+	int event_count = 0;
+
+	while (XEventsQueued(wm->display, QueuedAfterReading)) {
+		XEvent event;
+		XNextEvent(wm->display, &event);
+
+		wm_handle_event(wm, thing, &event);
+		event_count++;
+	}
+
+	wm_flush_events(wm, thing);
+	wm->raw_event_count += event_count;
+
+	return event_count;
 }